@@ -139,6 +139,10 @@ void import_from_abi(abi const & abi, void const * srcv,
 	// done extracting opd header
 
 	// begin extracting necessary parts of descr
+	if (!memcmp(src, ODB_FROZEN_MAGIC, strlen(ODB_FROZEN_MAGIC))) {
+		cerr << "error: frozen sample files can't be imported" << endl;
+		exit(EXIT_FAILURE);
+	}
 	odb_node_nr_t node_nr;
 	ext.extract(node_nr, src, "sizeof_odb_node_nr_t", "offsetof_descr_current_size");
 	src += abi.need("sizeof_odb_descr_t");
@@ -154,12 +158,16 @@ void import_from_abi(abi const & abi, void const * srcv,
 
 	assert(src + (node_nr * step) <= begin + len);
 
+	vector<odb_update_t> updates;
+	updates.reserve(node_nr);
 	for (odb_node_nr_t i = 1 ; i < node_nr ; ++i, src += step) {
-		odb_key_t key;
-		odb_value_t val;
-		ext.extract(key, src, "sizeof_odb_key_t", "offsetof_node_key");
-		ext.extract(val, src, "sizeof_odb_value_t", "offsetof_node_value");
-		int rc = odb_add_node(dest, key, val);
+		odb_update_t update;
+		ext.extract(update.key, src, "sizeof_odb_key_t", "offsetof_node_key");
+		ext.extract(update.offset, src, "sizeof_odb_value_t", "offsetof_node_value");
+		updates.push_back(update);
+	}
+	if (!updates.empty()) {
+		int rc = odb_update_nodes(dest, &updates[0], updates.size());
 		if (rc != EXIT_SUCCESS) {
 			cerr << strerror(rc) << endl;
 			exit(EXIT_FAILURE);
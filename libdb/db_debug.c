@@ -87,6 +87,97 @@ static int check_redundant_key(odb_data_t const * data, odb_key_t max)
 	return 0;
 }
 
+/* a bucket entry is found by a lookup only if no free entry precedes it
+ * from the start of its key hash bucket */
+static int check_reachable(odb_data_t const * data, odb_node_nr_t bucket_nr,
+                           int entry)
+{
+	odb_bucket_t const * bucket = &data->bucket_base[bucket_nr];
+	odb_node_nr_t pos = odb_do_bucket_hash(data, bucket->key[entry]);
+	int i;
+
+	for (i = 0 ; i < entry ; ++i) {
+		if (!bucket->index[i])
+			return 0;
+	}
+
+	for (; pos != bucket_nr ; pos = (pos + 1) & data->hash_mask) {
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			if (!data->bucket_base[pos].index[i])
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+static int check_bucket_hash(odb_data_t const * data)
+{
+	odb_node_nr_t pos;
+	odb_node_nr_t nr_node = 0;
+	odb_key_t max = 0;
+	int ret = 0;
+	unsigned char * bitmap = malloc(data->descr->current_size);
+	memset(bitmap, '\0', data->descr->current_size);
+
+	for (pos = 0 ; pos <= data->hash_mask && !ret ; ++pos) {
+		odb_bucket_t const * bucket = &data->bucket_base[pos];
+		int i;
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			odb_index_t index = bucket->index[i];
+			odb_node_t const * node;
+
+			if (!index)
+				continue;
+			if (index >= data->descr->current_size) {
+				printf("out of bound node index: %d\n", index);
+				ret = 1;
+				break;
+			}
+			if (bitmap[index]) {
+				printf("node %d found twice\n", index);
+				ret = 1;
+				break;
+			}
+			bitmap[index] = 1;
+			++nr_node;
+
+			node = &data->node_base[index];
+			if (node->key != bucket->key[i] ||
+			    node->value != bucket->value[i]) {
+				printf("node %d differs from its bucket entry\n",
+				       index);
+				ret = 1;
+				break;
+			}
+			if (!check_reachable(data, pos, i)) {
+				printf("key %lld is unreachable\n",
+				       (unsigned long long)node->key);
+				ret = 1;
+				break;
+			}
+
+			if (node->key > max)
+				max = node->key;
+		}
+	}
+
+	free(bitmap);
+
+	if (ret == 0 && nr_node != data->descr->current_size - 1) {
+		printf("hash table walk found %d node expect %d node\n",
+		       nr_node, data->descr->current_size - 1);
+		ret = 1;
+	}
+
+	if (ret == 0)
+		ret = check_redundant_key(data, max);
+
+	return ret;
+}
+
+
 int odb_check_hash(odb_t const * odb)
 {
 	odb_node_nr_t pos;
@@ -96,6 +187,12 @@ int odb_check_hash(odb_t const * odb)
 	odb_key_t max = 0;
 	odb_data_t * data = odb->data;
 
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		/* all keys must be in the hash table checked */
+		odb_migrate_buckets(data, ODB_MIGRATE_ALL);
+		return check_bucket_hash(data);
+	}
+
 	for (pos = 0 ; pos < data->descr->size * BUCKET_FACTOR ; ++pos) {
 		odb_index_t index = data->hash_base[pos];
 		while (index) {
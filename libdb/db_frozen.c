@@ -0,0 +1,283 @@
+/**
+ * @file db_frozen.c
+ * Compact, read-only form of a DB file
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "odb.h"
+#include "op_libiberty.h"
+
+
+/* the longest unsigned LEB128 encoding of an uint64_t */
+#define MAX_ENCODED_SIZE 10
+
+
+static int compare_node_key(void const * lhs, void const * rhs)
+{
+	odb_key_t lhs_key = ((odb_node_t const *)lhs)->key;
+	odb_key_t rhs_key = ((odb_node_t const *)rhs)->key;
+
+	if (lhs_key < rhs_key)
+		return -1;
+	return lhs_key > rhs_key;
+}
+
+
+static unsigned char * encode(unsigned char * pos, uint64_t value)
+{
+	do {
+		unsigned char byte = value & 0x7f;
+		value >>= 7;
+		if (value)
+			byte |= 0x80;
+		*pos++ = byte;
+	} while (value);
+
+	return pos;
+}
+
+
+static int write_all(int fd, void const * buf, size_t size)
+{
+	char const * pos = buf;
+
+	while (size) {
+		ssize_t nr = write(fd, pos, size);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		pos += nr;
+		size -= nr;
+	}
+
+	return 0;
+}
+
+
+/* filename with suffix appended, to build the file replacing filename */
+static char * temp_filename(char const * filename, char const * suffix)
+{
+	char * result = xmalloc(strlen(filename) + strlen(suffix) + 1);
+
+	strcpy(result, filename);
+	strcat(result, suffix);
+
+	return result;
+}
+
+
+int odb_freeze(char const * filename, size_t sizeof_header)
+{
+	odb_t odb;
+	odb_node_nr_t node_nr, pos;
+	odb_node_t * node;
+	odb_node_t * sorted;
+	odb_frozen_descr_t * descr;
+	unsigned char * buffer;
+	unsigned char * data;
+	unsigned char * end;
+	char * frozen_name;
+	odb_key_t last_key = 0;
+	int fd;
+	int err;
+
+	odb_init(&odb);
+	err = odb_open(&odb, filename, ODB_RDONLY, sizeof_header);
+	if (err)
+		return err;
+
+	node = odb_get_iterator(&odb, &node_nr);
+	buffer = xmalloc(sizeof_header + sizeof(odb_frozen_descr_t) +
+	                 node_nr * MAX_ENCODED_SIZE * 2);
+	memcpy(buffer, odb_get_data(&odb), sizeof_header);
+	descr = (odb_frozen_descr_t *)(buffer + sizeof_header);
+	memset(descr, '\0', sizeof(odb_frozen_descr_t));
+	memcpy(descr->magic, ODB_FROZEN_MAGIC, sizeof(descr->magic));
+	descr->version = ODB_FROZEN_VERSION;
+	descr->nr_node = node_nr;
+
+	sorted = xmalloc(node_nr * sizeof(odb_node_t));
+	memcpy(sorted, node, node_nr * sizeof(odb_node_t));
+	odb_close(&odb);
+	qsort(sorted, node_nr, sizeof(odb_node_t), compare_node_key);
+
+	data = end = (unsigned char *)(descr + 1);
+	for (pos = 0 ; pos < node_nr ; ++pos) {
+		end = encode(end, sorted[pos].key - last_key);
+		end = encode(end, sorted[pos].value);
+		last_key = sorted[pos].key;
+		descr->total_count += sorted[pos].value;
+	}
+	descr->data_size = end - data;
+	free(sorted);
+
+	frozen_name = temp_filename(filename, ".frozen");
+	fd = open(frozen_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = write_all(fd, buffer, end - buffer);
+	if (close(fd) && !err)
+		err = errno;
+	if (!err && rename(frozen_name, filename))
+		err = errno;
+	if (err)
+		unlink(frozen_name);
+
+out:
+	free(frozen_name);
+	free(buffer);
+	return err;
+}
+
+
+int odb_thaw(char const * filename, size_t sizeof_header)
+{
+	odb_frozen_t frozen;
+	odb_frozen_iterator_t it;
+	odb_t odb;
+	odb_key_t key;
+	odb_value_t value;
+	char * thawed_name;
+	int err;
+
+	err = odb_frozen_open(&frozen, filename, sizeof_header);
+	if (err)
+		return err;
+
+	thawed_name = temp_filename(filename, ".thawed");
+	unlink(thawed_name);
+
+	odb_init(&odb);
+	err = odb_open_hint(&odb, thawed_name, ODB_RDWR, sizeof_header,
+	                    frozen.descr->nr_node);
+	if (err)
+		goto out;
+
+	memcpy(odb_get_data(&odb), odb_frozen_get_data(&frozen), sizeof_header);
+
+	odb_frozen_get_iterator(&frozen, &it);
+	while (!err && odb_frozen_next(&it, &key, &value))
+		err = odb_update_node_with_offset(&odb, key, value);
+
+	odb_close(&odb);
+
+	if (!err && rename(thawed_name, filename))
+		err = errno;
+	if (err)
+		unlink(thawed_name);
+
+out:
+	free(thawed_name);
+	odb_frozen_close(&frozen);
+	return err;
+}
+
+
+int odb_is_frozen(char const * filename, size_t sizeof_header)
+{
+	char magic[sizeof(ODB_FROZEN_MAGIC) - 1];
+	int fd;
+	int ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	ret = pread(fd, magic, sizeof(magic), sizeof_header) == sizeof(magic) &&
+		!memcmp(magic, ODB_FROZEN_MAGIC, sizeof(magic));
+
+	close(fd);
+
+	return ret;
+}
+
+
+int odb_frozen_open(odb_frozen_t * frozen, char const * filename,
+                    size_t sizeof_header)
+{
+	struct stat stat_buf;
+	odb_frozen_descr_t const * descr;
+	int fd;
+	int err = 0;
+
+	memset(frozen, '\0', sizeof(odb_frozen_t));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &stat_buf)) {
+		err = errno;
+		goto out;
+	}
+
+	if ((size_t)stat_buf.st_size < sizeof_header + sizeof(odb_frozen_descr_t)) {
+		err = EINVAL;
+		goto out;
+	}
+
+	frozen->size = stat_buf.st_size;
+	frozen->base_memory = mmap(0, frozen->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (frozen->base_memory == MAP_FAILED) {
+		err = errno;
+		frozen->base_memory = NULL;
+		goto out;
+	}
+
+	descr = (odb_frozen_descr_t const *)
+		((char const *)frozen->base_memory + sizeof_header);
+	if (memcmp(descr->magic, ODB_FROZEN_MAGIC, sizeof(descr->magic)) ||
+	    descr->version != ODB_FROZEN_VERSION ||
+	    descr->data_size != frozen->size - sizeof_header - sizeof(*descr)) {
+		munmap(frozen->base_memory, frozen->size);
+		frozen->base_memory = NULL;
+		err = EINVAL;
+		goto out;
+	}
+
+	frozen->descr = descr;
+	frozen->data = (unsigned char const *)(descr + 1);
+out:
+	close(fd);
+	return err;
+}
+
+
+void odb_frozen_close(odb_frozen_t * frozen)
+{
+	if (frozen->base_memory)
+		munmap(frozen->base_memory, frozen->size);
+	frozen->base_memory = NULL;
+	frozen->descr = NULL;
+	frozen->data = NULL;
+}
+
+
+void odb_frozen_get_iterator(odb_frozen_t const * frozen,
+                             odb_frozen_iterator_t * it)
+{
+	it->pos = frozen->data;
+	it->end = frozen->data + frozen->descr->data_size;
+	it->key = 0;
+}
@@ -17,6 +17,9 @@
 
 #include "odb.h"
 
+/* the number of old buckets migrated at each step, see odb_migrate_buckets() */
+#define MIGRATE_STEP 4
+
 
 static inline int add_node(odb_data_t * data, odb_key_t key, odb_value_t value)
 {
@@ -39,9 +42,17 @@ static inline int add_node(odb_data_t * data, odb_key_t key, odb_value_t value)
 	node->value = value;
 	node->key = key;
 
-	index = odb_do_hash(data, key);
-	node->next = data->hash_base[index];
-	data->hash_base[index] = new_node;
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		node->next = 0;
+		odb_bucket_link_node(data, new_node);
+		/* the old table has one bucket for two of its nodes, thus
+		 * it's migrated long before the node array is full again */
+		odb_migrate_buckets(data, MIGRATE_STEP);
+	} else {
+		index = odb_do_hash(data, key);
+		node->next = data->hash_base[index];
+		data->hash_base[index] = new_node;
+	}
 
 	/* FIXME: we need wrmb() here */
 	odb_commit_reservation(data);
@@ -49,20 +60,70 @@ static inline int add_node(odb_data_t * data, odb_key_t key, odb_value_t value)
 	return 0;
 }
 
-int odb_update_node(odb_t * odb, odb_key_t key)
+/* look for key in the buckets not migrated yet after a grow, see
+ * odb_migrate_buckets(). These are the only ones a key which isn't in the
+ * new table can be in: the old table isn't modified by the migration */
+static int
+update_not_migrated(odb_data_t * data, odb_key_t key, unsigned long int offset)
 {
-	return odb_update_node_with_offset(odb, key, 1);
+	unsigned int pos = odb_do_bucket_hash(data, key) & data->old_hash_mask;
+
+	while (1) {
+		odb_bucket_t const * bucket = &data->old_bucket_base[pos];
+		int i;
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			odb_node_t * node;
+			if (!bucket->index[i])
+				return 0;
+			if (bucket->key[i] != key)
+				continue;
+			/* the old bucket value is stale, the node has the
+			 * current one and is what migration will copy */
+			node = &data->node_base[bucket->index[i]];
+			if (node->value + offset != 0)
+				node->value += offset;
+			odb_migrate_buckets(data, MIGRATE_STEP);
+			return 1;
+		}
+		pos = (pos + 1) & data->old_hash_mask;
+	}
 }
 
-int odb_update_node_with_offset(odb_t * odb, 
-				odb_key_t key, 
-				unsigned long int offset)
+
+/* add offset to the value of key, return 0 if key has no node yet */
+static inline int
+update_existing(odb_data_t * data, odb_key_t key, unsigned long int offset)
 {
 	odb_index_t index;
 	odb_node_t * node;
-	odb_data_t * data;
 
-	data = odb->data;
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		unsigned int pos = odb_do_bucket_hash(data, key);
+
+		while (1) {
+			odb_bucket_t * bucket = &data->bucket_base[pos];
+			int i;
+			for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+				if (!bucket->index[i]) {
+					if (data->old_bucket_base)
+						return update_not_migrated(
+							data, key, offset);
+					return 0;
+				}
+				if (bucket->key[i] == key) {
+					/* overflow is handled like below */
+					if (bucket->value[i] + offset != 0) {
+						bucket->value[i] += offset;
+						data->node_base[bucket->index[i]].value =
+							bucket->value[i];
+					}
+					return 1;
+				}
+			}
+			pos = (pos + 1) & data->hash_mask;
+		}
+	}
+
 	index = data->hash_base[odb_do_hash(data, key)];
 	while (index) {
 		node = &data->node_base[index];
@@ -93,16 +154,137 @@ int odb_update_node_with_offset(odb_t * odb,
 				 * store a value)
 				 */
 			}
-			return 0;
+			return 1;
 		}
 
 		index = node->next;
 	}
 
+	return 0;
+}
+
+
+int odb_update_node(odb_t * odb, odb_key_t key)
+{
+	return odb_update_node_with_offset(odb, key, 1);
+}
+
+int odb_update_node_with_offset(odb_t * odb, 
+				odb_key_t key, 
+				unsigned long int offset)
+{
+	odb_data_t * data = odb->data;
+
+	if (update_existing(data, key, offset))
+		return 0;
+
 	return add_node(data, key, offset);
 }
 
 
+/* the number of updates combined and prefetched together by
+ * odb_update_nodes(), this bounds the stack it uses */
+#define UPDATE_CHUNK 1024
+/* distance, in update, between a prefetch and the lookup needing it */
+#define PREFETCH_AHEAD 8
+
+static __inline void const * hash_entry(odb_data_t const * data, odb_key_t key)
+{
+	if (data->layout == ODB_LAYOUT_BUCKET)
+		return &data->bucket_base[odb_do_bucket_hash(data, key)];
+	return &data->hash_base[odb_do_hash(data, key)];
+}
+
+
+/* sum the offsets of the updates sharing the same key into the first of
+ * them, return the number of distinct updates now at start of updates */
+static size_t combine_updates(odb_update_t * updates, size_t nr)
+{
+	/* 2 * UPDATE_CHUNK entries, entry i + 1 or 0 if free */
+	unsigned short slots[UPDATE_CHUNK * 2];
+	unsigned int const mask = UPDATE_CHUNK * 2 - 1;
+	size_t nr_unique = 0;
+	size_t i;
+
+	memset(slots, '\0', sizeof(slots));
+
+	for (i = 0 ; i < nr ; ++i) {
+		odb_update_t * update = &updates[i];
+		unsigned int pos = (update->key * 0x9e3779b97f4a7c15ULL) >> 40;
+
+		while (1) {
+			odb_update_t * first;
+
+			pos &= mask;
+			if (!slots[pos]) {
+				updates[nr_unique] = *update;
+				slots[pos] = ++nr_unique;
+				break;
+			}
+			first = &updates[slots[pos] - 1];
+			/* don't combine to a wrapped value */
+			if (first->key == update->key &&
+			    first->offset + update->offset >= first->offset) {
+				first->offset += update->offset;
+				break;
+			}
+			++pos;
+		}
+	}
+
+	return nr_unique;
+}
+
+
+int odb_update_nodes(odb_t * odb, odb_update_t * updates, size_t nr)
+{
+	odb_data_t * data = odb->data;
+	size_t nr_new = 0;
+	size_t start;
+	size_t i;
+
+	/* first apply the updates whose key is already in the DB, moving
+	 * the others to the start of the array */
+	for (start = 0 ; start < nr ; start += UPDATE_CHUNK) {
+		size_t nr_chunk = nr - start < UPDATE_CHUNK
+			? nr - start : UPDATE_CHUNK;
+		odb_update_t * chunk = updates + start;
+
+		nr_chunk = combine_updates(chunk, nr_chunk);
+
+		for (i = 0 ; i < nr_chunk && i < PREFETCH_AHEAD ; ++i)
+			__builtin_prefetch(hash_entry(data, chunk[i].key));
+
+		for (i = 0 ; i < nr_chunk ; ++i) {
+			if (i + PREFETCH_AHEAD < nr_chunk) {
+				__builtin_prefetch(hash_entry(data,
+					chunk[i + PREFETCH_AHEAD].key));
+			}
+			if (!update_existing(data, chunk[i].key, chunk[i].offset))
+				updates[nr_new++] = chunk[i];
+		}
+	}
+
+	if (!nr_new)
+		return 0;
+
+	/* then make room for all new keys at once, some of them can be
+	 * the same key coming from different chunks so they still need
+	 * a lookup */
+	if (odb_reserve_nodes(data, nr_new))
+		return EINVAL;
+
+	for (i = 0 ; i < nr_new ; ++i) {
+		if (update_existing(data, updates[i].key, updates[i].offset))
+			continue;
+		if (add_node(data, updates[i].key, updates[i].offset))
+			return EINVAL;
+	}
+
+	return 0;
+}
+
+
 int odb_add_node(odb_t * odb, odb_key_t key, odb_value_t value)
 {
 	return add_node(odb->data, key, value);
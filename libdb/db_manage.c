@@ -44,6 +44,29 @@ static __inline odb_index_t * odb_to_hash_base(odb_data_t * data)
 				(data->descr->size * sizeof(odb_node_t)));
 }
 
+
+/** number of odb_bucket_t for a given number of node */
+static __inline size_t nr_bucket(odb_node_nr_t node_nr)
+{
+	return (node_nr * 2) / ODB_BUCKET_NODES;
+}
+
+
+/** offset from base_memory of the ODB_LAYOUT_BUCKET hash table */
+static size_t bucket_offset(odb_data_t const * data, odb_node_nr_t node_nr)
+{
+	size_t offset = data->offset_node + node_nr * sizeof(odb_node_t);
+
+	return (offset + ODB_BUCKET_ALIGN - 1) & ~(size_t)(ODB_BUCKET_ALIGN - 1);
+}
+
+
+static __inline odb_bucket_t * odb_to_bucket_base(odb_data_t * data)
+{
+	return (odb_bucket_t *)(((char *)data->base_memory) +
+				bucket_offset(data, data->descr->size));
+}
+
  
 /**
  * return the number of bytes used by hash table, node table and header.
@@ -52,6 +75,10 @@ static unsigned int tables_size(odb_data_t const * data, odb_node_nr_t node_nr)
 {
 	size_t size;
 
+	if (data->layout == ODB_LAYOUT_BUCKET)
+		return bucket_offset(data, node_nr) +
+			nr_bucket(node_nr) * sizeof(odb_bucket_t);
+
 	size = node_nr * (sizeof(odb_index_t) * BUCKET_FACTOR);
 	size += node_nr * sizeof(odb_node_t);
 	size += data->offset_node;
@@ -60,31 +87,143 @@ static unsigned int tables_size(odb_data_t const * data, odb_node_nr_t node_nr)
 }
 
 
-int odb_grow_hashtable(odb_data_t * data)
+/** setup the in memory pointers from data->descr */
+static void set_hash_table(odb_data_t * data)
+{
+	data->node_base = odb_to_node_base(data);
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		data->hash_base = NULL;
+		data->bucket_base = odb_to_bucket_base(data);
+		data->hash_mask = nr_bucket(data->descr->size) - 1;
+	} else {
+		data->hash_base = odb_to_hash_base(data);
+		data->bucket_base = NULL;
+		data->hash_mask = (data->descr->size * BUCKET_FACTOR) - 1;
+	}
+}
+
+
+void odb_bucket_link_node(odb_data_t * data, odb_index_t node_nr)
+{
+	odb_node_t const * node = &data->node_base[node_nr];
+	unsigned int pos = odb_do_bucket_hash(data, node->key);
+
+	/* the table is never more than half full, so this terminates */
+	while (1) {
+		odb_bucket_t * bucket = &data->bucket_base[pos];
+		int i;
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			if (!bucket->index[i]) {
+				bucket->key[i] = node->key;
+				bucket->value[i] = node->value;
+				bucket->index[i] = node_nr;
+				return;
+			}
+		}
+		pos = (pos + 1) & data->hash_mask;
+	}
+}
+
+
+/* rebuild the whole ODB_LAYOUT_BUCKET hash table from the node array */
+static void rebuild_bucket_table(odb_data_t * data)
+{
+	odb_node_nr_t pos;
+
+	memset(data->bucket_base, '\0',
+	       nr_bucket(data->descr->size) * sizeof(odb_bucket_t));
+	for (pos = 1; pos < data->descr->current_size; ++pos)
+		odb_bucket_link_node(data, pos);
+	data->descr->flags &= ~ODB_DESCR_REHASHING;
+}
+
+
+void odb_migrate_buckets(odb_data_t * data, odb_node_nr_t nr_bucket)
+{
+	odb_node_nr_t end;
+
+	if (!data->old_bucket_base)
+		return;
+
+	end = data->old_hash_mask + 1;
+	if (nr_bucket < end - data->migrate_pos)
+		end = data->migrate_pos + nr_bucket;
+
+	/* the old table isn't modified, so a lookup can still probe the
+	 * buckets not migrated yet. The node array has the current value of
+	 * all the keys, odb_bucket_link_node() takes it from there */
+	for (; data->migrate_pos < end; ++data->migrate_pos) {
+		odb_bucket_t const * bucket =
+			&data->old_bucket_base[data->migrate_pos];
+		int i;
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			if (bucket->index[i])
+				odb_bucket_link_node(data, bucket->index[i]);
+		}
+	}
+
+	if (data->migrate_pos > data->old_hash_mask) {
+		free(data->old_bucket_base);
+		data->old_bucket_base = NULL;
+		data->descr->flags &= ~ODB_DESCR_REHASHING;
+	}
+}
+
+
+/* grow the tables to new_size nodes, a power of two */
+static int resize_tables(odb_data_t * data, odb_node_nr_t new_size)
 {
 	unsigned int old_file_size;
 	unsigned int new_file_size;
+	odb_bucket_t * old_buckets = NULL;
+	odb_hash_mask_t old_hash_mask = data->hash_mask;
 	unsigned int pos;
 	void * new_map;
 
 	old_file_size = tables_size(data, data->descr->size);
-	new_file_size = tables_size(data, data->descr->size * 2);
+	new_file_size = tables_size(data, new_size);
+
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		/* the node array will cover the start of the current table,
+		 * keep a copy of it to migrate from */
+		size_t size = nr_bucket(data->descr->size) *
+			sizeof(odb_bucket_t);
+
+		odb_migrate_buckets(data, ODB_MIGRATE_ALL);
+		old_buckets = malloc(size);
+		if (!old_buckets)
+			return 1;
+		memcpy(old_buckets, data->bucket_base, size);
+	}
 
 	if (ftruncate(data->fd, new_file_size))
-		return 1;
+		goto fail;
 
 	new_map = mremap(data->base_memory,
 			 old_file_size, new_file_size, MREMAP_MAYMOVE);
 
 	if (new_map == MAP_FAILED)
-		return 1;
+		goto fail;
 
 	data->base_memory = new_map;
 	data->descr = odb_to_descr(data);
-	data->descr->size *= 2;
-	data->node_base = odb_to_node_base(data);
-	data->hash_base = odb_to_hash_base(data);
-	data->hash_mask = (data->descr->size * BUCKET_FACTOR) - 1;
+	data->descr->size = new_size;
+	set_hash_table(data);
+
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		/* the new table can overlap the end of the old one, its
+		 * other part is in the grown part of the file, thus zeroed */
+		size_t offset = bucket_offset(data, new_size);
+		if (offset < old_file_size) {
+			memset(data->bucket_base, '\0',
+			       old_file_size - offset);
+		}
+		data->old_bucket_base = old_buckets;
+		data->old_hash_mask = old_hash_mask;
+		data->migrate_pos = 0;
+		data->descr->flags |= ODB_DESCR_REHASHING;
+		return 0;
+	}
 
 	/* rebuild the hash table, node zero is never used. This works
 	 * because layout of file is node table then hash table,
@@ -93,7 +232,8 @@ int odb_grow_hashtable(odb_data_t * data)
 	 * overlap so on the new hash table is entirely in the new
 	 * memory area (the grown part) and we know the new hash
 	 * hash table is zeroed. That's why we don't need to zero init
-	 * the new table */
+	 * the new table. Growing by more than twice the size only moves
+	 * the new hash table further in the grown part. */
 	/* OK: the above is not exact
 	 * if BUCKET_FACTOR < sizeof(bd_node_t) / sizeof(bd_node_nr_t)
 	 * all things are fine and we don't need to init the hash
@@ -114,6 +254,80 @@ int odb_grow_hashtable(odb_data_t * data)
 	}
 
 	return 0;
+
+fail:
+	free(old_buckets);
+	return 1;
+}
+
+
+/* same as resize_tables(), also for a file whose descriptor was released */
+static int resize_hashtable(odb_data_t * data, odb_node_nr_t new_size)
+{
+	int saved_errno;
+	int err;
+
+	if (data->fd >= 0)
+		return resize_tables(data, new_size);
+
+	data->fd = open(data->filename, O_RDWR);
+	if (data->fd < 0)
+		return 1;
+
+	err = resize_tables(data, new_size);
+
+	saved_errno = errno;
+	close(data->fd);
+	data->fd = -1;
+	errno = saved_errno;
+
+	return err;
+}
+
+
+/* the size multiplier used when the hashtable grows, a power of two */
+static unsigned int growth_factor = 2;
+
+
+void odb_set_growth_factor(unsigned int factor)
+{
+	unsigned int result = 2;
+
+	while (result < 256 && result * 2 <= factor)
+		result *= 2;
+	growth_factor = result;
+}
+
+
+int odb_grow_hashtable(odb_data_t * data)
+{
+	odb_node_nr_t new_size = data->descr->size * growth_factor;
+
+	if (!new_size) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	return resize_hashtable(data, new_size);
+}
+
+
+int odb_reserve_nodes(odb_data_t * data, odb_node_nr_t nr_node)
+{
+	odb_node_nr_t new_size = data->descr->size;
+
+	while (new_size - data->descr->current_size < nr_node) {
+		new_size *= growth_factor;
+		if (!new_size) {
+			errno = ENOMEM;
+			return 1;
+		}
+	}
+
+	if (new_size == data->descr->size)
+		return 0;
+
+	return resize_hashtable(data, new_size);
 }
 
 
@@ -125,9 +339,12 @@ void odb_init(odb_t * odb)
 
 /* the default number of page, calculated to fit in 4096 bytes */
 #define DEFAULT_NODE_NR(offset_node)	128
+/* a size hint can't make a new file larger than this number of node */
+#define MAX_HINT_NODE_NR		(1 << 24)
 #define FILES_HASH_SIZE                 512
 
 static struct list_head files_hash[FILES_HASH_SIZE];
+static enum odb_layout new_file_layout = ODB_LAYOUT_BUCKET;
 
 
 static void init_hash()
@@ -159,10 +376,20 @@ find_samples_data(size_t hash, char const * filename)
 }
 
 
-int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
-	     size_t sizeof_header)
+void odb_set_layout(enum odb_layout layout)
+{
+	new_file_layout = layout;
+}
+
+
+/* returned by open_hash_file() when the file is a frozen one */
+#define FROZEN_FILE -1
+
+static int open_hash_file(odb_t * odb, char const * filename, enum odb_rw rw,
+                          size_t sizeof_header, odb_node_nr_t size_hint)
 {
 	struct stat stat_buf;
+	odb_descr_t descr;
 	odb_node_nr_t nr_node;
 	odb_data_t * data;
 	size_t hash;
@@ -206,7 +433,11 @@ int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
 			goto fail;
 		}
 
+		/* node zero is unused */
 		nr_node = DEFAULT_NODE_NR(data->offset_node);
+		while (nr_node <= size_hint && nr_node < MAX_HINT_NODE_NR)
+			nr_node *= 2;
+		data->layout = new_file_layout;
 
 		file_size = tables_size(data, nr_node);
 		if (ftruncate(data->fd, file_size)) {
@@ -214,9 +445,38 @@ int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
 			goto fail;
 		}
 	} else {
+		/* the layout must be known to find how large the mapping is */
+		if (pread(data->fd, &descr, sizeof(descr), sizeof_header) !=
+		    sizeof(descr)) {
+			err = EINVAL;
+			goto fail;
+		}
+		if (!memcmp(&descr, ODB_FROZEN_MAGIC, sizeof(descr.size))) {
+			err = FROZEN_FILE;
+			goto fail;
+		}
+		data->layout = descr.layout;
+
 		/* Calculate nr node allowing a sanity check later */
-		nr_node = (stat_buf.st_size - data->offset_node) /
-			((sizeof(odb_index_t) * BUCKET_FACTOR) + sizeof(odb_node_t));
+		switch (data->layout) {
+		case ODB_LAYOUT_CHAINED:
+			nr_node = (stat_buf.st_size - data->offset_node) /
+				((sizeof(odb_index_t) * BUCKET_FACTOR) +
+				 sizeof(odb_node_t));
+			break;
+		case ODB_LAYOUT_BUCKET:
+			nr_node = descr.size;
+			if (nr_bucket(nr_node) == 0 ||
+			    (nr_node & (nr_node - 1)) ||
+			    tables_size(data, nr_node) != stat_buf.st_size) {
+				err = EINVAL;
+				goto fail;
+			}
+			break;
+		default:
+			err = EINVAL;
+			goto fail;
+		}
 	}
 
 	data->base_memory = mmap(0, tables_size(data, nr_node), mmflags,
@@ -233,6 +493,7 @@ int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
 		data->descr->size = nr_node;
 		/* page zero is not used */
 		data->descr->current_size = 1;
+		data->descr->layout = data->layout;
 	} else {
 		/* file already exist, sanity check nr node */
 		if (nr_node != data->descr->size) {
@@ -241,9 +502,12 @@ int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
 		}
 	}
 
-	data->hash_base = odb_to_hash_base(data);
-	data->node_base = odb_to_node_base(data);
-	data->hash_mask = (data->descr->size * BUCKET_FACTOR) - 1;
+	set_hash_table(data);
+
+	/* the previous writer didn't close it, a grow was left unfinished */
+	if (rw == ODB_RDWR && data->layout == ODB_LAYOUT_BUCKET &&
+	    (data->descr->flags & ODB_DESCR_REHASHING))
+		rebuild_bucket_table(data);
 
 	list_add(&data->list, &files_hash[hash]);
 	odb->data = data;
@@ -260,6 +524,31 @@ fail:
 }
 
 
+int odb_open(odb_t * odb, char const * filename, enum odb_rw rw,
+	     size_t sizeof_header)
+{
+	return odb_open_hint(odb, filename, rw, sizeof_header, 0);
+}
+
+
+int odb_open_hint(odb_t * odb, char const * filename, enum odb_rw rw,
+                  size_t sizeof_header, odb_node_nr_t size_hint)
+{
+	int err = open_hash_file(odb, filename, rw, sizeof_header, size_hint);
+
+	/* a frozen file must be turned back into a hash file to be updated,
+	 * else it can only be read through odb_frozen_open() */
+	if (err == FROZEN_FILE && rw == ODB_RDWR) {
+		err = odb_thaw(filename, sizeof_header);
+		if (!err)
+			err = open_hash_file(odb, filename, rw,
+					     sizeof_header, 0);
+	}
+
+	return err == FROZEN_FILE ? EINVAL : err;
+}
+
+
 void odb_close(odb_t * odb)
 {
 	odb_data_t * data = odb->data;
@@ -267,15 +556,18 @@ void odb_close(odb_t * odb)
 	if (data) {
 		data->ref_count--;
 		if (data->ref_count == 0) {
-			size_t size = tables_size(data, data->descr->size);
+			size_t size;
+			odb_migrate_buckets(data, ODB_MIGRATE_ALL);
+			size = tables_size(data, data->descr->size);
 			list_del(&data->list);
 			munmap(data->base_memory, size);
 			if (data->fd >= 0)
 				close(data->fd);
 			free(data->filename);
 			free(data);
-			odb->data = NULL;
 		}
+		/* the other handles on the file keep it open, not this one */
+		odb->data = NULL;
 	}
 }
 
@@ -288,6 +580,33 @@ int odb_open_count(odb_t const * odb)
 }
 
 
+int odb_release_fd(odb_t * odb)
+{
+	odb_data_t * data = odb->data;
+
+	if (!data || data->fd < 0)
+		return 0;
+
+	close(data->fd);
+	data->fd = -1;
+	return 1;
+}
+
+
+int odb_has_fd(odb_t const * odb)
+{
+	return odb->data && odb->data->fd >= 0;
+}
+
+
+size_t odb_get_mapped_size(odb_t const * odb)
+{
+	if (!odb->data)
+		return 0;
+	return tables_size(odb->data, odb->data->descr->size);
+}
+
+
 void * odb_get_data(odb_t * odb)
 {
 	return odb->data->base_memory;
@@ -20,11 +20,43 @@ struct odb_hash_stat_t {
 	odb_node_nr_t used_node_nr;		/**< in use node number */
 	count_type    total_count;		/**< cumulated samples count */
 	odb_index_t   hash_table_size;		/**< hash table entry number */
-	odb_node_nr_t max_list_length;		/**< worst case   */
+	/** worst case, for ODB_LAYOUT_BUCKET the nr of bucket to probe */
+	odb_node_nr_t max_list_length;
 	double       average_list_length;	/**< average case */
 	/* do we need variance ? */
 };
 
+/* the number of bucket read to find the key of each node */
+static void bucket_stat(odb_data_t const * data, odb_hash_stat_t * result)
+{
+	odb_node_nr_t max_length = 0;
+	double total_length = 0.0;
+	size_t nr_node = 0;
+	size_t pos;
+
+	for (pos = 0 ; pos <= data->hash_mask ; ++pos) {
+		odb_bucket_t const * bucket = &data->bucket_base[pos];
+		int i;
+		for (i = 0 ; i < ODB_BUCKET_NODES ; ++i) {
+			odb_node_nr_t length;
+			if (!bucket->index[i])
+				continue;
+			result->total_count += bucket->value[i];
+			length = ((pos - odb_do_bucket_hash(data, bucket->key[i]))
+			          & data->hash_mask) + 1;
+			if (length > max_length)
+				max_length = length;
+			total_length += length;
+			++nr_node;
+		}
+	}
+
+	result->hash_table_size = data->hash_mask + 1;
+	result->max_list_length = max_length;
+	result->average_list_length = (!nr_node) ? 0 : total_length / nr_node;
+}
+
+
 odb_hash_stat_t * odb_hash_stat(odb_t const * odb)
 {
 	size_t max_length = 0;
@@ -41,6 +73,13 @@ odb_hash_stat_t * odb_hash_stat(odb_t const * odb)
 
 	result->node_nr = data->descr->size;
 	result->used_node_nr = data->descr->current_size;
+
+	if (data->layout == ODB_LAYOUT_BUCKET) {
+		odb_migrate_buckets(data, ODB_MIGRATE_ALL);
+		bucket_stat(data, result);
+		return result;
+	}
+
 	result->hash_table_size = data->descr->size * BUCKET_FACTOR;
 
 	/* FIXME: I'm dubious if this do right statistics for hash table
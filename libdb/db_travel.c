@@ -8,6 +8,11 @@
  * @author Philippe Elie
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
 #include "odb.h"
 
 odb_node_t * odb_get_iterator(odb_t const * odb, odb_node_nr_t * nr)
@@ -16,3 +21,35 @@ odb_node_t * odb_get_iterator(odb_t const * odb, odb_node_nr_t * nr)
 	*nr = odb->data->descr->current_size - 1;
 	return odb->data->node_base + 1;
 }
+
+
+int odb_get_node_count(char const * filename, size_t sizeof_header,
+                       odb_node_nr_t * nr)
+{
+	union {
+		odb_descr_t hash;
+		odb_frozen_descr_t frozen;
+	} descr;
+	ssize_t size;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	size = pread(fd, &descr, sizeof(descr), sizeof_header);
+	close(fd);
+
+	if (size >= (ssize_t)sizeof(descr.frozen) &&
+	    !memcmp(descr.frozen.magic, ODB_FROZEN_MAGIC,
+	            sizeof(descr.frozen.magic))) {
+		*nr = descr.frozen.nr_node;
+		return 0;
+	}
+
+	if (size < (ssize_t)sizeof(descr.hash) || !descr.hash.current_size)
+		return EINVAL;
+
+	*nr = descr.hash.current_size - 1;
+	return 0;
+}
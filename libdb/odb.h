@@ -38,13 +38,44 @@ typedef odb_index_t odb_hash_mask_t;
  */
 #define BUCKET_FACTOR 1
 
+/** alignment of the ODB_LAYOUT_BUCKET hash table in the file */
+#define ODB_BUCKET_ALIGN 64
+
 /** a db hash node */
 typedef struct {
 	odb_key_t key;			/**< eip */
 	odb_value_t value;		/**< samples count */
-	odb_index_t next;		/**< next entry for this bucket */
+	odb_index_t next;		/**< next entry for this bucket, unused
+					  *  with ODB_LAYOUT_BUCKET */
 } odb_node_t;
 
+/** how the hash table following the node array is organized */
+enum odb_layout {
+	/** an array of odb_index_t, each the head of a list of nodes
+	 * chained through odb_node_t.next. Files written before the layout
+	 * was recorded in odb_descr_t have zero there, so this must stay 0 */
+	ODB_LAYOUT_CHAINED = 0,
+	/** open addressing over odb_bucket_t, see below */
+	ODB_LAYOUT_BUCKET = 1
+};
+
+/** number of entries in an odb_bucket_t */
+#define ODB_BUCKET_NODES 4
+
+/** an ODB_LAYOUT_BUCKET hash table entry, the size of a cache line.
+ *
+ * A key is looked up by probing buckets linearly from the one picked by
+ * odb_do_bucket_hash(); the first entry with a zero index ends the
+ * search. The count is kept here so that updating a known key reads a
+ * single cache line, the node it indexes is only written to: the node
+ * array remains what odb_get_iterator() and opimport see.
+ */
+typedef struct {
+	odb_key_t key[ODB_BUCKET_NODES];	/**< eip */
+	odb_value_t value[ODB_BUCKET_NODES];	/**< samples count */
+	odb_index_t index[ODB_BUCKET_NODES];	/**< node nr, 0 if free */
+} odb_bucket_t;
+
 /** the minimal information which must be stored in the file to reload
  * properly the data base, following this header is the node array then
  * the hash table (when growing we avoid to copy node array)
@@ -52,9 +83,16 @@ typedef struct {
 typedef struct {
 	odb_node_nr_t size;		/**< in node nr (power of two) */
 	odb_node_nr_t current_size;	/**< nr used node + 1, node 0 unused */
-	int padding[6];			/**< for padding and future use */
+	unsigned int layout;		/**< \enum odb_layout */
+	unsigned int flags;		/**< ODB_DESCR_* */
+	int padding[4];			/**< for padding and future use */
 } odb_descr_t;
 
+/** set while an ODB_LAYOUT_BUCKET hash table is only partly rebuilt after
+ * a grow, see odb_migrate_buckets(). The node array is always complete,
+ * but a file left in this state must have its hash table rebuilt */
+#define ODB_DESCR_REHASHING	1
+
 /** a "database". this is an in memory only description.
  *
  * We allow to manage a database inside a mapped file with an "header" of
@@ -69,18 +107,29 @@ typedef struct {
  *  the unknown header (sizeof_header)
  *  odb_descr_t
  *  the node array: (descr->size * sizeof(odb_node_t) entries
- *  the hash table: array of odb_index_t indexing the node array 
- *    (descr->size * BUCKET_FACTOR) entries
+ *  the hash table, with ODB_LAYOUT_CHAINED: array of odb_index_t
+ *    indexing the node array (descr->size * BUCKET_FACTOR) entries
+ *  or with ODB_LAYOUT_BUCKET: starting at the next ODB_BUCKET_ALIGN
+ *    boundary, (descr->size * 2 / ODB_BUCKET_NODES) odb_bucket_t, so
+ *    that the table is at most half full
  */
 typedef struct odb_data {
 	odb_node_t * node_base;		/**< base memory area of the page */
 	odb_index_t * hash_base;	/**< base memory of hash table */
+	odb_bucket_t * bucket_base;	/**< same for ODB_LAYOUT_BUCKET */
+	odb_bucket_t * old_bucket_base;	/**< malloced copy of the table
+					  *  before the last grow, NULL once
+					  *  all its entries are migrated */
+	odb_hash_mask_t old_hash_mask;	/**< hash_mask of old_bucket_base */
+	odb_node_nr_t migrate_pos;	/**< next old bucket to migrate */
 	odb_descr_t * descr;		/**< the current state of database */
-	odb_hash_mask_t hash_mask;	/**< == descr->size - 1 */
+	odb_hash_mask_t hash_mask;	/**< nr of hash table entries - 1 */
+	unsigned int layout;		/**< \enum odb_layout */
 	unsigned int sizeof_header;	/**< from base_memory to odb header */
 	unsigned int offset_node;	/**< from base_memory to node array */
 	void * base_memory;		/**< base memory of the maped memory */
-	int fd;				/**< mmaped memory file descriptor */
+	int fd;				/**< mmaped memory file descriptor, -1
+					  *  after odb_release_fd() */
 	char * filename;                /**< full path name of sample file */
 	int ref_count;                  /**< reference count */
 	struct list_head list;          /**< hash bucket list */
@@ -118,17 +167,64 @@ void odb_init(odb_t * odb);
  * The sizeof_header parameter allows the data file to have a header
  * at the start of the file which is skipped.
  * odb_open() always preallocate a few number of pages.
+ * A frozen file (see odb_freeze()) is turned back into a hash file when
+ * opened with ODB_RDWR, opening it ODB_RDONLY fails with EINVAL.
  * returns 0 on success, errno on failure
  */
 int odb_open(odb_t * odb, char const * filename,
              enum odb_rw rw, size_t sizeof_header);
 
+/**
+ * odb_open_hint - open a DB file, sizing it if it's created
+ * @param size_hint the number of nodes the file is expected to hold
+ *
+ * Same as odb_open() but a new file is created with room for size_hint
+ * nodes, so filling it needs no grow. size_hint is ignored if the file
+ * already exists, zero means no hint.
+ */
+int odb_open_hint(odb_t * odb, char const * filename, enum odb_rw rw,
+                  size_t sizeof_header, odb_node_nr_t size_hint);
+
+/**
+ * odb_set_layout - select the layout of DB files created from now on
+ * @param layout \enum odb_layout
+ *
+ * The default is ODB_LAYOUT_BUCKET. Existing files are always read and
+ * updated using the layout they were created with.
+ */
+void odb_set_layout(enum odb_layout layout);
+
+/**
+ * odb_set_growth_factor - select how much the hash table grows at once
+ * @param factor the node array size is multiplied by this
+ *
+ * factor is rounded down to a power of two between 2 and 256, the
+ * default is 2. A larger factor trades file size for fewer grows.
+ */
+void odb_set_growth_factor(unsigned int factor);
+
 /** Close the given ODB file */
 void odb_close(odb_t * odb);
 
 /** return the number of times this sample file is open */
 int odb_open_count(odb_t const * odb);
 
+/**
+ * odb_release_fd - close the file descriptor of an open DB file
+ *
+ * The file stays mapped and can still be read and updated: it's only
+ * opened again for the time needed to grow it. This allows to keep more
+ * DB files open than the process can have file descriptors.
+ * returns non zero if a file descriptor was closed
+ */
+int odb_release_fd(odb_t * odb);
+
+/** return non zero if the DB file is open and has a file descriptor */
+int odb_has_fd(odb_t const * odb);
+
+/** return the size of the mapping of an open DB file, else 0 */
+size_t odb_get_mapped_size(odb_t const * odb);
+
 /** return the start of the mapped data */
 void * odb_get_data(odb_t * odb);
 
@@ -150,6 +246,25 @@ void odb_sync(odb_t const * odb);
  * after cleanup some program resource.
  */
 int odb_grow_hashtable(odb_data_t * data);
+/**
+ * grow the hashtable, if needed, so that nr_node nodes can be added
+ * without growing it again. Same return value as odb_grow_hashtable().
+ */
+int odb_reserve_nodes(odb_data_t * data, odb_node_nr_t nr_node);
+/**
+ * enter node number node_nr in the hash table of an ODB_LAYOUT_BUCKET
+ * file, at the first free entry found probing from its key hash bucket.
+ */
+void odb_bucket_link_node(odb_data_t * data, odb_index_t node_nr);
+/**
+ * Growing an ODB_LAYOUT_BUCKET file doesn't rebuild its hash table at
+ * once: the old table is kept aside and its entries are moved to the new
+ * one nr_bucket buckets at a time as the file is updated, see
+ * update_existing() in db_insert.c. This moves the entries of up to
+ * nr_bucket more old buckets, use ODB_MIGRATE_ALL to finish the job.
+ */
+void odb_migrate_buckets(odb_data_t * data, odb_node_nr_t nr_bucket);
+#define ODB_MIGRATE_ALL ((odb_node_nr_t)-1)
 /**
  * commit a previously successfull node reservation. This can't fail.
  */
@@ -196,6 +311,28 @@ int odb_update_node_with_offset(odb_t * odb,
 				odb_key_t key, 
 				unsigned long int offset);
 
+/** a key and the amount to add to its value, see odb_update_nodes() */
+typedef struct {
+	odb_key_t key;
+	odb_value_t offset;
+} odb_update_t;
+
+/**
+ * odb_update_nodes
+ * @param odb the data base object to update
+ * @param updates the keys to update and the offset to add to each
+ * @param nr number of updates
+ *
+ * same as calling odb_update_node_with_offset() for each update but
+ * cheaper: updates sharing a key are combined, the hash table entries
+ * are prefetched ahead of the lookups and the hashtable is grown at most
+ * once for the whole array. The updates array is used as scratch space,
+ * its content is undefined on return.
+ *
+ * returns EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int odb_update_nodes(odb_t * odb, odb_update_t * updates, size_t nr);
+
 /** Add a new node w/o regarding if a node with the same key already exists
  *
  * returns EXIT_SUCCESS on success, EXIT_FAILURE on failure
@@ -217,6 +354,18 @@ int odb_add_node(odb_t * odb, odb_key_t key, odb_value_t value);
  */
 odb_node_t * odb_get_iterator(odb_t const * odb, odb_node_nr_t * nr);
 
+/**
+ * odb_get_node_count - number of nodes in a DB file, without mapping it
+ * @param filename a hash or a frozen DB file
+ * @param sizeof_header size of the file header
+ * @param nr where to store the number of nodes
+ *
+ * Meant to get a size hint for odb_open_hint() from an older file.
+ * returns 0 on success, errno on failure
+ */
+int odb_get_node_count(char const * filename, size_t sizeof_header,
+                       odb_node_nr_t * nr);
+
 static __inline unsigned int
 odb_do_hash(odb_data_t const * data, odb_key_t value)
 {
@@ -232,6 +381,150 @@ odb_do_hash(odb_data_t const * data, odb_key_t value)
 	return ((temp << 0) ^ (temp >> 8)) & data->hash_mask;
 }
 
+static __inline unsigned int
+odb_do_bucket_hash(odb_data_t const * data, odb_key_t value)
+{
+	/* the 64 bits finalizer of MurmurHash3: every bit of the key,
+	 * including the callee half of callgraph keys, affects the low
+	 * order bits used to pick a bucket. Like odb_do_hash() changing
+	 * this changes the file format. */
+	value ^= value >> 33;
+	value *= 0xff51afd7ed558ccdULL;
+	value ^= value >> 33;
+	value *= 0xc4ceb9fe1a85ec53ULL;
+	value ^= value >> 33;
+	return value & data->hash_mask;
+}
+
+/* db_frozen.c */
+
+/** start of odb_frozen_descr_t. Read as the size field of odb_descr_t it
+ * can't be a power of two, so it tells frozen and hash files apart */
+#define ODB_FROZEN_MAGIC "ODBZ"
+/** current frozen file format */
+#define ODB_FROZEN_VERSION 1
+
+/**
+ * What follows the file header in a frozen DB file, see odb_freeze().
+ * After this come data_size bytes of nodes sorted by key, each encoded
+ * as the difference between its key and the previous one (or zero) then
+ * its value, both as unsigned LEB128. A key can appear more than once.
+ */
+typedef struct {
+	char magic[4];			/**< ODB_FROZEN_MAGIC */
+	uint32_t version;		/**< ODB_FROZEN_VERSION */
+	uint64_t nr_node;		/**< number of encoded nodes */
+	uint64_t total_count;		/**< sum of all values */
+	uint64_t data_size;		/**< size of the encoded nodes */
+} odb_frozen_descr_t;
+
+/** a read-only, mapped, frozen DB file */
+typedef struct {
+	void * base_memory;		/**< start of the mapped file */
+	size_t size;			/**< size of the mapped file */
+	odb_frozen_descr_t const * descr;
+	unsigned char const * data;	/**< the encoded nodes */
+} odb_frozen_t;
+
+/** a position in the nodes of a frozen DB file */
+typedef struct {
+	unsigned char const * pos;
+	unsigned char const * end;
+	odb_key_t key;			/**< the last key returned */
+} odb_frozen_iterator_t;
+
+/**
+ * odb_freeze - turn a DB file into a frozen one
+ * @param filename the DB file, it must not be open for writing
+ * @param sizeof_header size of the file header, copied as is
+ *
+ * A frozen file only stores the nodes, sorted and packed, so it is much
+ * smaller than the hash file and can be read in key order without any
+ * sorting. It can't be updated in place: odb_open() turns it back into a
+ * hash file when it is opened with ODB_RDWR, else it must be read through
+ * odb_frozen_open(). The file is replaced atomically.
+ *
+ * returns 0 on success, errno on failure
+ */
+int odb_freeze(char const * filename, size_t sizeof_header);
+
+/**
+ * odb_thaw - turn a frozen DB file back into a hash file
+ * @param filename the frozen file
+ * @param sizeof_header size of the file header
+ *
+ * returns 0 on success, errno on failure
+ */
+int odb_thaw(char const * filename, size_t sizeof_header);
+
+/** return non zero if filename is a frozen DB file */
+int odb_is_frozen(char const * filename, size_t sizeof_header);
+
+/**
+ * odb_frozen_open - map a frozen DB file
+ * @param frozen the object to setup
+ * @param filename the frozen file
+ * @param sizeof_header size of the file header
+ *
+ * returns 0 on success, errno on failure
+ */
+int odb_frozen_open(odb_frozen_t * frozen, char const * filename,
+                    size_t sizeof_header);
+
+/** unmap a frozen DB file */
+void odb_frozen_close(odb_frozen_t * frozen);
+
+/** return the start of the mapped data, i.e. the file header */
+static __inline void * odb_frozen_get_data(odb_frozen_t const * frozen)
+{
+	return frozen->base_memory;
+}
+
+/** position it before the first node of frozen */
+void odb_frozen_get_iterator(odb_frozen_t const * frozen,
+                             odb_frozen_iterator_t * it);
+
+/** decode an unsigned LEB128 number, return 0 if it's truncated */
+static __inline int
+odb_frozen_decode(odb_frozen_iterator_t * it, uint64_t * value)
+{
+	uint64_t result = 0;
+	unsigned int shift = 0;
+
+	while (it->pos != it->end && shift < 64) {
+		unsigned char byte = *it->pos++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return 1;
+		}
+		shift += 7;
+	}
+
+	return 0;
+}
+
+/**
+ * odb_frozen_next - read the next node of a frozen file
+ *
+ * returns 0 when there are no nodes left, in this case key and value are
+ * not modified
+ */
+static __inline int
+odb_frozen_next(odb_frozen_iterator_t * it, odb_key_t * key,
+                odb_value_t * value)
+{
+	uint64_t delta, count;
+
+	if (!odb_frozen_decode(it, &delta) || !odb_frozen_decode(it, &count))
+		return 0;
+
+	it->key += delta;
+	*key = it->key;
+	*value = count;
+	return 1;
+}
+
 #ifdef __cplusplus
 }
 #endif
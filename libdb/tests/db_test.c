@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 
 #include "op_sample_file.h"
@@ -85,6 +86,424 @@ static void do_speed_test(void)
 }
 
 
+static int check_counts(odb_t * hash, unsigned int const * counts,
+                        int nr_unique_item)
+{
+	odb_node_nr_t node_nr, pos;
+	odb_node_t * node = odb_get_iterator(hash, &node_nr);
+	int nr_key = 0;
+	int i;
+
+	for (i = 1 ; i <= nr_unique_item ; ++i) {
+		if (counts[i])
+			++nr_key;
+	}
+
+	if ((int)node_nr != nr_key)
+		return 1;
+
+	for (pos = 0 ; pos < node_nr ; ++pos) {
+		if (node[pos].key < 1 || node[pos].key > (odb_key_t)nr_unique_item)
+			return 1;
+		if (node[pos].value != counts[node[pos].key])
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* a file keeps the layout it was created with */
+static int layout_test(enum odb_layout create, enum odb_layout update)
+{
+	int const nr_unique_item = 5000;
+	unsigned int * counts = calloc(nr_unique_item + 1, sizeof(*counts));
+	odb_t hash;
+	int ret = 0;
+	int pass;
+	int i;
+	int rc;
+
+	for (pass = 0 ; pass < 2 && !ret ; ++pass) {
+		odb_set_layout(pass == 0 ? create : update);
+		rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR,
+		              sizeof(struct opd_header));
+		if (rc) {
+			fprintf(stderr, "%s", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0 ; i < 20000 ; ++i) {
+			odb_key_t key = (random() % nr_unique_item) + 1;
+			if (odb_update_node_with_offset(&hash, key, pass + 1)) {
+				ret = 1;
+				break;
+			}
+			counts[key] += pass + 1;
+		}
+
+		if (hash.data->descr->layout != (unsigned int)create)
+			ret = 1;
+
+		odb_close(&hash);
+	}
+
+	if (!ret) {
+		rc = odb_open(&hash, TEST_FILENAME, ODB_RDONLY,
+		              sizeof(struct opd_header));
+		if (rc) {
+			fprintf(stderr, "%s", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+		ret = odb_check_hash(&hash) || check_counts(&hash, counts,
+		                                            nr_unique_item);
+		odb_close(&hash);
+	}
+
+	odb_set_layout(ODB_LAYOUT_BUCKET);
+	remove(TEST_FILENAME);
+	free(counts);
+
+	return ret;
+}
+
+
+/* odb_update_nodes() must give the same result as updating one by one */
+static int batch_test(int nr_item, int nr_unique_item)
+{
+	unsigned int * counts = calloc(nr_unique_item + 1, sizeof(*counts));
+	odb_update_t * updates = malloc(nr_item * sizeof(*updates));
+	odb_t hash;
+	int ret = 0;
+	int i, j;
+	int rc;
+
+	rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR, sizeof(struct opd_header));
+	if (rc) {
+		fprintf(stderr, "%s", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0 ; i < nr_item && !ret ; i += j) {
+		int nr = random() % 3000 + 1;
+		if (nr > nr_item - i)
+			nr = nr_item - i;
+		for (j = 0 ; j < nr ; ++j) {
+			updates[j].key = (random() % nr_unique_item) + 1;
+			updates[j].offset = random() % 3 + 1;
+			counts[updates[j].key] += updates[j].offset;
+		}
+		ret = odb_update_nodes(&hash, updates, nr);
+	}
+
+	if (!ret)
+		ret = odb_check_hash(&hash) ||
+			check_counts(&hash, counts, nr_unique_item);
+
+	odb_close(&hash);
+	remove(TEST_FILENAME);
+	free(updates);
+	free(counts);
+
+	return ret;
+}
+
+
+static void do_batch_test(enum odb_layout layout)
+{
+	int i, j;
+
+	odb_set_layout(layout);
+
+	for (i = 1000; i <= 100000; i *= 10) {
+		for (j = 10 ; j <= i ; j *= 10) {
+			if (batch_test(i, j)) {
+				fprintf(stderr, "%s:%d failure for %d %d\n",
+				       __FILE__, __LINE__, i, j);
+				nr_error++;
+			} else {
+				verbprintf("batch_test() ok %d %d\n", i, j);
+			}
+		}
+	}
+
+	odb_set_layout(ODB_LAYOUT_BUCKET);
+}
+
+
+/* a new file is sized from its hint, then grows by the growth factor and
+ * gives the right counts while its hash table is migrated */
+static int growth_test(enum odb_layout layout_of_new_files,
+                       unsigned int factor, odb_node_nr_t size_hint)
+{
+	int const nr_unique_item = 20000;
+	unsigned int * counts = calloc(nr_unique_item + 1, sizeof(*counts));
+	odb_node_nr_t size, nr_node;
+	odb_t hash;
+	int ret = 0;
+	int i;
+	int rc;
+
+	odb_set_growth_factor(factor);
+	rc = odb_open_hint(&hash, TEST_FILENAME, ODB_RDWR,
+	                   sizeof(struct opd_header), size_hint);
+	if (rc) {
+		fprintf(stderr, "%s", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+
+	size = hash.data->descr->size;
+	if (size <= size_hint)
+		ret = 1;
+
+	for (i = 0 ; i < 50000 && !ret ; ++i) {
+		odb_key_t key = (random() % nr_unique_item) + 1;
+		if (odb_update_node(&hash, key))
+			ret = 1;
+		counts[key]++;
+		if (hash.data->descr->size != size) {
+			if (hash.data->descr->size != size * factor)
+				ret = 1;
+			size = hash.data->descr->size;
+		}
+	}
+
+	/* the last grow is likely not fully migrated yet */
+	if (!ret)
+		ret = check_counts(&hash, counts, nr_unique_item);
+
+	odb_close(&hash);
+
+	/* as if the writer died while migrating */
+	if (!ret && layout_of_new_files == ODB_LAYOUT_BUCKET) {
+		rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR,
+		              sizeof(struct opd_header));
+		ret = rc || (hash.data->descr->flags & ODB_DESCR_REHASHING);
+		hash.data->descr->flags |= ODB_DESCR_REHASHING;
+		memset(hash.data->bucket_base, '\0', sizeof(odb_bucket_t));
+		odb_close(&hash);
+	}
+
+	if (!ret) {
+		rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR,
+		              sizeof(struct opd_header));
+		ret = rc || odb_check_hash(&hash) ||
+			check_counts(&hash, counts, nr_unique_item);
+		odb_close(&hash);
+	}
+
+	if (!ret) {
+		ret = odb_get_node_count(TEST_FILENAME,
+		                         sizeof(struct opd_header), &nr_node);
+		for (i = 1 ; i <= nr_unique_item ; ++i)
+			nr_node -= counts[i] != 0;
+		ret = ret || nr_node;
+	}
+
+	odb_set_growth_factor(2);
+	remove(TEST_FILENAME);
+	free(counts);
+
+	return ret;
+}
+
+
+static void do_growth_test(enum odb_layout layout)
+{
+	unsigned int factor;
+	odb_node_nr_t size_hint;
+
+	odb_set_layout(layout);
+
+	for (factor = 2 ; factor <= 16 ; factor *= 2) {
+		for (size_hint = 0 ; size_hint <= 30000 ; size_hint += 10000) {
+			if (growth_test(layout, factor, size_hint)) {
+				fprintf(stderr, "%s:%d failure for %u %u\n",
+				       __FILE__, __LINE__, factor, size_hint);
+				nr_error++;
+			} else {
+				verbprintf("growth_test() ok %u %u\n",
+				           factor, size_hint);
+			}
+		}
+	}
+
+	odb_set_layout(ODB_LAYOUT_BUCKET);
+}
+
+
+/* a DB file whose descriptor is released can still grow */
+static int release_fd_test(enum odb_layout layout)
+{
+	int const nr_unique_item = 20000;
+	unsigned int * counts = calloc(nr_unique_item + 1, sizeof(*counts));
+	size_t mapped_size;
+	odb_t hash;
+	int ret;
+	int i;
+	int rc;
+
+	odb_set_layout(layout);
+	rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR, sizeof(struct opd_header));
+	if (rc) {
+		fprintf(stderr, "%s", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+
+	mapped_size = odb_get_mapped_size(&hash);
+	ret = !odb_has_fd(&hash) || !odb_release_fd(&hash) ||
+		odb_has_fd(&hash) || odb_release_fd(&hash);
+
+	for (i = 0 ; i < 50000 && !ret ; ++i) {
+		odb_key_t key = (random() % nr_unique_item) + 1;
+		if (odb_update_node(&hash, key))
+			ret = 1;
+		counts[key]++;
+	}
+
+	if (!ret)
+		ret = odb_has_fd(&hash) ||
+			odb_get_mapped_size(&hash) <= mapped_size ||
+			odb_check_hash(&hash) ||
+			check_counts(&hash, counts, nr_unique_item);
+
+	odb_close(&hash);
+
+	if (!ret) {
+		rc = odb_open(&hash, TEST_FILENAME, ODB_RDONLY,
+		              sizeof(struct opd_header));
+		ret = rc || odb_check_hash(&hash) ||
+			check_counts(&hash, counts, nr_unique_item);
+		odb_close(&hash);
+	}
+
+	odb_set_layout(ODB_LAYOUT_BUCKET);
+	remove(TEST_FILENAME);
+	free(counts);
+
+	return ret;
+}
+
+
+static void do_release_fd_test(void)
+{
+	if (release_fd_test(ODB_LAYOUT_CHAINED)) {
+		fprintf(stderr, "%s:%d failure for chained layout\n",
+		        __FILE__, __LINE__);
+		nr_error++;
+	}
+	if (release_fd_test(ODB_LAYOUT_BUCKET)) {
+		fprintf(stderr, "%s:%d failure for bucket layout\n",
+		        __FILE__, __LINE__);
+		nr_error++;
+	}
+}
+
+
+/* a frozen file reads back sorted and can be thawed for update */
+static int freeze_test(int nr_item, int nr_unique_item)
+{
+	unsigned int * counts = calloc(nr_unique_item + 1, sizeof(*counts));
+	unsigned long long total = 0;
+	odb_frozen_t frozen;
+	odb_frozen_iterator_t it;
+	odb_key_t key, last_key = 0;
+	odb_value_t value;
+	odb_t hash;
+	int ret = 0;
+	int i, rc;
+
+	rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR, sizeof(struct opd_header));
+	if (rc) {
+		fprintf(stderr, "%s", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0 ; i < nr_item ; ++i) {
+		key = (random() % nr_unique_item) + 1;
+		odb_update_node(&hash, key);
+		counts[key]++;
+	}
+	odb_close(&hash);
+
+	if (odb_freeze(TEST_FILENAME, sizeof(struct opd_header)) ||
+	    !odb_is_frozen(TEST_FILENAME, sizeof(struct opd_header)) ||
+	    odb_open(&hash, TEST_FILENAME, ODB_RDONLY,
+	             sizeof(struct opd_header)) != EINVAL ||
+	    odb_frozen_open(&frozen, TEST_FILENAME, sizeof(struct opd_header))) {
+		ret = 1;
+		goto out;
+	}
+
+	odb_frozen_get_iterator(&frozen, &it);
+	while (odb_frozen_next(&it, &key, &value)) {
+		if (key <= last_key || key > (odb_key_t)nr_unique_item ||
+		    value != counts[key])
+			ret = 1;
+		last_key = key;
+		total += value;
+	}
+	if (total != frozen.descr->total_count || total != (unsigned)nr_item)
+		ret = 1;
+	odb_frozen_close(&frozen);
+	if (ret)
+		goto out;
+
+	/* updating it thaws it */
+	rc = odb_open(&hash, TEST_FILENAME, ODB_RDWR, sizeof(struct opd_header));
+	if (rc) {
+		ret = 1;
+		goto out;
+	}
+	for (i = 0 ; i < nr_item ; ++i) {
+		key = (random() % nr_unique_item) + 1;
+		odb_update_node(&hash, key);
+		counts[key]++;
+	}
+	ret = odb_check_hash(&hash) ||
+		check_counts(&hash, counts, nr_unique_item);
+	odb_close(&hash);
+
+out:
+	remove(TEST_FILENAME);
+	free(counts);
+
+	return ret;
+}
+
+
+static void do_freeze_test(void)
+{
+	int i, j;
+
+	for (i = 1000; i <= 100000; i *= 10) {
+		for (j = 10 ; j <= i ; j *= 10) {
+			if (freeze_test(i, j)) {
+				fprintf(stderr, "%s:%d failure for %d %d\n",
+				       __FILE__, __LINE__, i, j);
+				nr_error++;
+			} else {
+				verbprintf("freeze_test() ok %d %d\n", i, j);
+			}
+		}
+	}
+}
+
+
+static void do_layout_test(void)
+{
+	if (layout_test(ODB_LAYOUT_CHAINED, ODB_LAYOUT_BUCKET)) {
+		fprintf(stderr, "%s:%d failure for chained layout\n",
+		        __FILE__, __LINE__);
+		nr_error++;
+	}
+	if (layout_test(ODB_LAYOUT_BUCKET, ODB_LAYOUT_CHAINED)) {
+		fprintf(stderr, "%s:%d failure for bucket layout\n",
+		        __FILE__, __LINE__);
+		nr_error++;
+	}
+}
+
+
 static int test(int nr_item, int nr_unique_item)
 {
 	int i;
@@ -118,10 +537,12 @@ static int test(int nr_item, int nr_unique_item)
 }
 
 
-static void do_test(void)
+static void do_test(enum odb_layout layout)
 {
 	int i, j;
 
+	odb_set_layout(layout);
+
 	for (i = 1000; i <= 100000; i *= 10) {
 		for (j = 100 ; j <= i / 10 ; j *= 10) {
 			if (test(i, j)) {
@@ -133,6 +554,8 @@ static void do_test(void)
 			}
 		}
 	}
+
+	odb_set_layout(ODB_LAYOUT_BUCKET);
 }
 
 
@@ -176,7 +599,20 @@ int main(int argc, char * argv[1])
 speed_test:
 	remove(TEST_FILENAME);
 
-	do_test();
+	do_test(ODB_LAYOUT_CHAINED);
+	do_test(ODB_LAYOUT_BUCKET);
+
+	do_layout_test();
+
+	do_batch_test(ODB_LAYOUT_CHAINED);
+	do_batch_test(ODB_LAYOUT_BUCKET);
+
+	do_growth_test(ODB_LAYOUT_CHAINED);
+	do_growth_test(ODB_LAYOUT_BUCKET);
+
+	do_release_fd_test();
+
+	do_freeze_test();
 
 	do_speed_test();
 
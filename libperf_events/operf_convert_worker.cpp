@@ -0,0 +1,199 @@
+/**
+ * @file libperf_events/operf_convert_worker.cpp
+ * Thread which logs a share of the converted samples into
+ * oprofile sample files on behalf of operf_read.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <iostream>
+#include "operf_convert_worker.h"
+#include "operf_stats.h"
+#include "cverb.h"
+
+using namespace std;
+
+extern verbose vconvert;
+
+
+operf_convert_worker::operf_convert_worker(int _index)
+	: index(_index), busy(false), stopping(false), started(false),
+	  sfiles(NULL), nr_records(0)
+{
+	pending = new batch_t;
+	pending->reserve(batch_size);
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	memset(&trans, 0, sizeof(trans));
+	trans.tgid = ~1U;
+	memset(stats, 0, sizeof(stats));
+}
+
+
+operf_convert_worker::~operf_convert_worker()
+{
+	if (started)
+		join();
+	delete pending;
+	for (size_t i = 0; i < queued.size(); i++)
+		delete queued[i];
+	for (size_t i = 0; i < free_batches.size(); i++)
+		delete free_batches[i];
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+
+int operf_convert_worker::start(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	sfiles = operf_sfile_table_new(stats);
+	// Signals are for the main thread of operf-read; see operf_drainer::start.
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	rc = pthread_create(&thread, NULL, _run, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!rc)
+		started = true;
+	return rc;
+}
+
+
+void operf_convert_worker::flush(void)
+{
+	if (pending->empty())
+		return;
+
+	pthread_mutex_lock(&lock);
+	// Don't let the parser run too far ahead of a worker.
+	while (queued.size() >= max_queued_batches)
+		pthread_cond_wait(&done_cond, &lock);
+	queued.push_back(pending);
+	if (free_batches.empty()) {
+		pending = new batch_t;
+		pending->reserve(batch_size);
+	} else {
+		pending = free_batches.back();
+		free_batches.pop_back();
+	}
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+
+void operf_convert_worker::wait_idle(void)
+{
+	flush();
+	pthread_mutex_lock(&lock);
+	while (!queued.empty() || busy)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+
+void operf_convert_worker::join(void)
+{
+	if (!started)
+		return;
+
+	flush();
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	started = false;
+
+	for (int i = 0; i < OPERF_MAX_STATS; i++)
+		operf_stats[i] += stats[i];
+	cverb << vconvert << "convert worker " << index << " logged " << dec
+	      << nr_records << " records" << endl;
+}
+
+
+void * operf_convert_worker::_run(void * arg)
+{
+	operf_convert_worker * worker = (operf_convert_worker *)arg;
+
+	operf_sfile_use_table(worker->sfiles);
+	worker->_convert();
+	operf_sfile_table_free(worker->sfiles);
+	worker->sfiles = NULL;
+	return NULL;
+}
+
+
+void operf_convert_worker::_convert(void)
+{
+	pthread_mutex_lock(&lock);
+	while (1) {
+		batch_t * batch;
+
+		while (queued.empty() && !stopping)
+			pthread_cond_wait(&work_cond, &lock);
+		if (queued.empty())
+			break;
+		batch = queued.front();
+		queued.pop_front();
+		busy = true;
+		pthread_mutex_unlock(&lock);
+
+		for (size_t i = 0; i < batch->size(); i++)
+			_log((*batch)[i]);
+		nr_records += batch->size();
+		batch->clear();
+
+		pthread_mutex_lock(&lock);
+		free_batches.push_back(batch);
+		busy = false;
+		pthread_cond_signal(&done_cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* This mirrors what __handle_sample_event and __handle_callchain do with
+ * the operf_transient in the serial case, so that the worker ends up with
+ * the same sfiles (and thus the same sample files) for the same records.
+ */
+void operf_convert_worker::_log(struct operf_convert_record const & rec)
+{
+	trans.image_name = rec.image_name;
+	trans.image_len = rec.image_len;
+	if (rec.relocate) {
+		memcpy(trans.app_filename, rec.app_name, rec.app_len);
+		trans.app_filename[rec.app_len] = '\0';
+		trans.app_len = rec.app_len;
+	}
+	trans.pc = rec.pc;
+	trans.start_addr = rec.start_addr;
+	trans.end_addr = rec.end_addr;
+	trans.cpu = rec.cpu;
+	trans.tid = rec.tid;
+	trans.tgid = rec.tgid;
+	trans.event = rec.event;
+	trans.count = rec.count;
+	trans.in_kernel = rec.in_kernel;
+	trans.is_anon = rec.is_anon;
+
+	if (rec.relocate)
+		trans.current = operf_sfile_find(&trans);
+	if (!trans.current)
+		return;
+
+	if (rec.is_arc)
+		operf_sfile_log_arc(&trans);
+	else
+		operf_sfile_log_sample(&trans);
+	trans.last = trans.current;
+	trans.last_pc = trans.pc;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file libperf_events/operf_convert_worker.h
+ * Thread which logs a share of the converted samples into
+ * oprofile sample files on behalf of operf_read.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_CONVERT_WORKER_H_
+#define OPERF_CONVERT_WORKER_H_
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include "op_config.h"
+#include "operf_sfile.h"
+
+/** A sample or callgraph arc whose mapping has already been resolved. */
+struct operf_convert_record {
+	/** both point to storage which outlives the conversion */
+	const char * image_name;
+	const char * app_name;
+	size_t image_len, app_len;
+	vma_t pc;
+	vma_t start_addr;
+	vma_t end_addr;
+	unsigned long cpu;
+	u32 tid;
+	u32 tgid;
+	int event;
+	unsigned long count;
+	/** true for a callgraph arc, false for a sample */
+	bool is_arc;
+	/** false if the sfile of the previous record applies again */
+	bool relocate;
+	bool in_kernel;
+	bool is_anon;
+};
+
+/**
+ * The PERF_RECORD_* stream is parsed by a single thread, which keeps the
+ * process and mapping state up to date and resolves each sample to an
+ * operf_convert_record.  Looking up the sfile and updating the sample
+ * file is then done by one of several operf_convert_worker threads.
+ *
+ * Each worker has its own operf_sfile table, so records for one sample
+ * file must always be posted to the same worker, in stream order.
+ */
+class operf_convert_worker {
+public:
+	operf_convert_worker(int index);
+	~operf_convert_worker();
+
+	/// return 0 on success, an errno value otherwise
+	int start(void);
+	/// queue a record; it's handed to the thread once a batch is full
+	void post(struct operf_convert_record const & rec) {
+		pending->push_back(rec);
+		if (pending->size() >= batch_size)
+			flush();
+	}
+	/// hand the records posted so far to the thread
+	void flush(void);
+	/// wait until the thread has logged all the records posted so far
+	void wait_idle(void);
+	/// log the remaining records, close the sample files and wait for
+	/// the thread; its statistics are added to operf_stats
+	void join(void);
+
+private:
+	typedef std::vector<struct operf_convert_record> batch_t;
+	static size_t const batch_size = 4096;
+	static size_t const max_queued_batches = 64;
+
+	static void * _run(void * arg);
+	void _convert(void);
+	void _log(struct operf_convert_record const & rec);
+
+	int index;
+	batch_t * pending;
+	/// protects all the members below up to started
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	std::deque<batch_t *> queued;
+	std::vector<batch_t *> free_batches;
+	bool busy;
+	bool stopping;
+	pthread_t thread;
+	bool started;
+	/// only used by the thread
+	struct operf_sfile_table * sfiles;
+	struct operf_transient trans;
+	unsigned long stats[OPERF_MAX_STATS];
+	u64 nr_records;
+};
+
+#endif /* OPERF_CONVERT_WORKER_H_ */
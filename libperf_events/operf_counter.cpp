@@ -24,6 +24,7 @@
 #include <iostream>
 #include <sstream>
 #include <stdlib.h>
+#include <time.h>
 #include "op_events.h"
 #include "operf_counter.h"
 #include "op_abi.h"
@@ -32,6 +33,9 @@
 #include "op_libiberty.h"
 #include "operf_stats.h"
 #include "op_pe_utils.h"
+#include "operf_drainer.h"
+#include "operf_ring_pacer.h"
+#include "operf_flight_recorder.h"
 
 
 using namespace std;
@@ -58,6 +62,8 @@ vector<string> event_names;
 
 static const char __op_magic[8] = {'O', 'P', 'F', 'I', 'L', 'E', '\0', '\0'};
 
+#define OP_PIPE_READ_BUF_SIZE (1024 * 1024)
+
 static bool _print_pp_progress(int fd)
 {
 	int msg;
@@ -67,92 +73,107 @@ static bool _print_pp_progress(int fd)
 		return false;
 }
 
-/* This function for reading an event from the sample data pipe must
- * be robust enough to handle the situation where the operf_record process
- * writes an event record to the pipe in multiple chunks.
+/* Reads event records from the sample data pipe in large chunks and hands
+ * them out in place, so the conversion makes one read() per chunk instead
+ * of two per record.  It must be robust enough to handle the situation where
+ * the operf_record process writes an event record to the pipe in multiple
+ * chunks: a record which straddles the end of the data read so far is moved
+ * to the front of the buffer before refilling it.
  */
-#define OP_PIPE_READ_OK 0
-#define OP_PIPE_CLOSED -1
-static int _get_perf_event_from_pipe(event_t * event, int sample_data_fd)
+class pipe_event_reader {
+public:
+	pipe_event_reader(int _fd, size_t _size)
+		: fd(_fd), size(_size), head(0), tail(0)
+	{ buf = (char *)xmalloc(size); }
+	~pipe_event_reader() { free(buf); }
+
+	/**
+	 * Return the next event record, or NULL once the pipe has been closed.
+	 * The record stays valid until the next call.  A record with a bogus
+	 * size is returned as is, for the caller to catch with is_header_valid().
+	 */
+	event_t * next(void);
+
+private:
+	bool _fill(size_t needed);
+
+	int fd;
+	char * buf;
+	size_t size;
+	/// unparsed data is buf[head] to buf[tail]
+	size_t head;
+	size_t tail;
+};
+
+
+event_t * pipe_event_reader::next(void)
+{
+	static size_t const pe_header_size = sizeof(perf_event_header);
+	perf_event_header * header;
+
+	while (1) {
+		if (!_fill(pe_header_size))
+			return NULL;
+		header = (perf_event_header *)(buf + head);
+		if (header->size < pe_header_size)
+			return (event_t *)header;
+		if (header->size == pe_header_size) {
+			/* This is technically a valid record -- it's just empty. I'm not
+			 * sure if this can happen (i.e., if the kernel ever creates empty
+			 * records), but we'll handle it just in case.
+			 */
+			head += pe_header_size;
+			continue;
+		}
+		if (!_fill(header->size))
+			return NULL;
+		// _fill may have moved the record.
+		header = (perf_event_header *)(buf + head);
+		head += header->size;
+		return (event_t *)header;
+	}
+}
+
+
+bool pipe_event_reader::_fill(size_t needed)
 {
-	static size_t pe_header_size = sizeof(perf_event_header);
-	size_t read_size = pe_header_size;
-	int rc = OP_PIPE_READ_OK;
-	char * evt = (char *)event;
 	ssize_t num_read;
-	perf_event_header * header = (perf_event_header *)event;
 
-	memset(header, '\0', pe_header_size);
+	if (tail - head >= needed)
+		return true;
 
-	/* A signal handler was setup for the operf_read process to handle interrupts
-	 * (i.e., from ctrl-C), so the read syscalls below may get interrupted.  But the
-	 * operf_read process should ignore the interrupt and continue processing
-	 * until there's no more data to read or until the parent operf process
-	 * forces us to stop.  So we must try the read operation again if it was
-	 * interrupted.
+	/* What's left is a partial record; if it's not worth refilling in
+	 * place, move it to the front.  A record is at most 64 KiB, which
+	 * always fits.
 	 */
-again:
-	errno = 0;
-	if ((num_read = read(sample_data_fd, header, read_size)) < 0) {
-		cverb << vdebug << "Read 1 of sample data pipe returned with " << strerror(errno) << endl;
-		if (errno == EINTR) {
-			goto again;
-		} else {
-			rc = OP_PIPE_CLOSED;
-			goto out;
-		}
-	} else if (num_read == 0) {
-		// Implies pipe has been closed on the write end, so return -1 to quit reading
-		rc = OP_PIPE_CLOSED;
-		goto out;
-	} else if (num_read != (ssize_t)read_size) {
-		header += num_read;
-		read_size -= num_read;
-		goto again;
+	if (head && (head + needed > size || size - tail < size / 2)) {
+		memmove(buf, buf + head, tail - head);
+		tail -= head;
+		head = 0;
 	}
 
-	read_size = header->size - pe_header_size;
-	if (read_size == 0)
-		/* This is technically a valid record -- it's just empty. I'm not
-		 * sure if this can happen (i.e., if the kernel ever creates empty
-		 * records), but we'll handle it just in case.
-		 */
-		goto again;
-
-	if (!header->size || (header->size < pe_header_size))
-		/* Bogus header size detected. In this case, we don't set rc to -1,
-		 * because the caller will catch this error when it calls is_header_valid().
-		 * I've seen such bogus stuff occur when profiling lots of processes at
-		 * a very high sampling frequency. This issue is still being investigated,
-		 * so for now, we'll just do our best to detect and handle gracefully.
+	while (tail - head < needed) {
+		/* A signal handler was setup for the operf_read process to handle interrupts
+		 * (i.e., from ctrl-C), so the read syscall below may get interrupted.  But the
+		 * operf_read process should ignore the interrupt and continue processing
+		 * until there's no more data to read or until the parent operf process
+		 * forces us to stop.  So we must try the read operation again if it was
+		 * interrupted.
 		 */
-		goto out;
-
-	evt += pe_header_size;
-
-again2:
-	if ((num_read = read(sample_data_fd, evt, read_size)) < 0) {
-		cverb << vdebug << "Read 2 of sample data pipe returned with " << strerror(errno) << endl;
-		if (errno == EINTR) {
-			goto again2;
-		} else {
-			rc = OP_PIPE_CLOSED;
-			if (errno == EFAULT)
-				cerr << "Size of event record: " << header->size << endl;
-			goto out;
+		num_read = read(fd, buf + tail, size - tail);
+		if (num_read < 0) {
+			if (errno == EINTR)
+				continue;
+			cverb << vdebug << "Read of sample data pipe returned with "
+			      << strerror(errno) << endl;
+			return false;
+		} else if (num_read == 0) {
+			// Implies pipe has been closed on the write end, so quit reading
+			return false;
 		}
-	} else if (num_read == 0) {
-		// Implies pipe has been closed on the write end, so return -1 to quit reading
-		rc = OP_PIPE_CLOSED;
-		goto out;
-	} else if (num_read != (ssize_t)read_size) {
-		evt += num_read;
-		read_size -= num_read;
-		goto again2;
+		tail += num_read;
 	}
-
-out:
-	return rc;
+	return true;
 }
 
 static event_t * _get_perf_event_from_file(struct mmap_info & info)
@@ -229,7 +250,14 @@ operf_counter::operf_counter(operf_event_t & evt,  bool enable_on_exec, bool do_
 #endif
 	attr.exclude_hv = evt.no_hv;
 	attr.config = evt.evt_code;
-	attr.sample_period = evt.count;
+	if (operf_options::sample_rate) {
+		// Let the kernel adjust the period to this many samples per second.
+		attr.freq = 1;
+		attr.sample_freq = operf_options::sample_rate;
+		attr.sample_type |= PERF_SAMPLE_PERIOD;
+	} else {
+		attr.sample_period = evt.count;
+	}
 	attr.inherit = inherit ? 1 : 0;
 	attr.enable_on_exec = enable_on_exec ? 1 : 0;
 	attr.disabled  = 1;
@@ -289,6 +317,17 @@ int operf_counter::perf_event_open(pid_t pid, int cpu, operf_record * rec, bool
 	return fd;
 }
 
+/* In --flight-recorder mode, a snapshot is saved on SIGUSR2, which operf
+ * passes on from the user, or when this file shows up in the session dir.
+ */
+#define FLIGHT_TRIGGER_FILE "flight_snapshot"
+static volatile bool flight_snapshot_requested;
+
+static void _flight_snapshot_handler(int sig __attribute__((unused)))
+{
+	flight_snapshot_requested = true;
+}
+
 operf_record::~operf_record()
 {
 	cverb << vrecord << "operf_record::~operf_record()" << endl;
@@ -300,6 +339,17 @@ operf_record::~operf_record()
 
 	if (poll_data)
 		delete[] poll_data;
+	for (size_t i = 0; i < drainers.size(); i++) {
+		if (drainers[i]->get_out_fd() != output_fd)
+			close(drainers[i]->get_out_fd());
+		delete drainers[i];
+	}
+	drainers.clear();
+	if (stop_drainers_pipe[0] != -1) {
+		close(stop_drainers_pipe[0]);
+		close(stop_drainers_pipe[1]);
+	}
+	pthread_mutex_destroy(&output_lock);
 	for (size_t i = 0; i < samples_array.size(); i++) {
 		struct mmap_data *md = &samples_array[i];
 		munmap(md->base, (num_mmap_pages + 1) * pagesize);
@@ -341,6 +391,9 @@ operf_record::operf_record(int out_fd, bool sys_wide, pid_t the_pid, bool pid_ru
 	write_to_file = out_fd_is_file;
 	opHeader.data_size = 0;
 	num_cpus = -1;
+	record_threads = 0;
+	stop_drainers_pipe[0] = stop_drainers_pipe[1] = -1;
+	pthread_mutex_init(&output_lock, NULL);
 
 	if (system_wide && (pid_to_profile != -1 || pid_started))
 		return;  // object is not valid
@@ -361,6 +414,19 @@ operf_record::operf_record(int out_fd, bool sys_wide, pid_t the_pid, bool pid_ru
 		      << strerror(errno) << endl;
 		_exit(EXIT_FAILURE);
 	}
+	if (operf_options::flight_recorder) {
+		memset(&sa, 0, sizeof(struct sigaction));
+		sa.sa_handler = _flight_snapshot_handler;
+		sigemptyset(&sa.sa_mask);
+		sigemptyset(&ss);
+		sigaddset(&ss, SIGUSR2);
+		sigprocmask(SIG_UNBLOCK, &ss, NULL);
+		if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+			cverb << vrecord << "operf_record ctor: sigaction failed; errno is: "
+			      << strerror(errno) << endl;
+			_exit(EXIT_FAILURE);
+		}
+	}
 	cverb << vrecord << "calling setup" << endl;
 	setup();
 }
@@ -475,6 +541,9 @@ int operf_record::_prepare_to_record_one_fd(int idx, int fd)
 	struct mmap_data md;
 	md.prev = 0;
 	md.mask = num_mmap_pages * pagesize - 1;
+	memset(&md.stats, 0, sizeof(md.stats));
+	md.stats.cpu = (size_t)idx < ring_cpus.size() ? ring_cpus[idx] : -1;
+	clock_gettime(CLOCK_MONOTONIC, &md.stats.last_drain);
 
 	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
 		perror("fcntl failed");
@@ -618,6 +687,12 @@ void operf_record::setup()
 	pagesize = sysconf(_SC_PAGE_SIZE);
 	// If profiling a process group, use a smaller mmap length to avoid EINVAL.
 	num_mmap_pages = profile_process_group ? 1 : (512 * 1024)/pagesize;
+	if (operf_options::ring_size) {
+		// The kernel wants a power of 2 number of data pages.
+		num_mmap_pages = 1;
+		while ((long)num_mmap_pages * pagesize < operf_options::ring_size * 1024L)
+			num_mmap_pages <<= 1;
+	}
 
 	/* To set up to profile an existing thread group, we need call perf_event_open
 	 * for each thread, and we need to pass cpu=-1 on the syscall.
@@ -630,6 +705,15 @@ void operf_record::setup()
 		throw runtime_error(int_str);
 	}
 
+	record_threads = operf_options::record_threads;
+	if (record_threads > 1 && (use_cpu_minus_one || track_new_forks)) {
+		cerr << "operf: --record-threads needs one ring buffer per cpu; "
+		     << "recording from a single thread." << endl;
+		record_threads = 0;
+	}
+	if (record_threads > num_cpus)
+		record_threads = num_cpus;
+
 	cverb << vrecord << "calling perf_event_open for pid " << pid_to_profile << " on "
 	      << num_cpus << " cpus" << endl;
 	FILE * online_cpus = fopen("/sys/devices/system/cpu/online", "r");
@@ -671,6 +755,7 @@ void operf_record::setup()
 				goto error;
 			}
 		}
+		ring_cpus.push_back(real_cpu);
 		size_t num_procs = profile_process_group ? procs.size() : 1;
 		/* To profile a parent and its children, the perf_events kernel subsystem
 		 * requires us to use cpu=-1 on the perf_event_open call for each of the
@@ -709,6 +794,8 @@ void operf_record::setup()
 	else
 		num_mmaps = num_cpus;
 	poll_data = new struct pollfd [num_mmaps];
+	if (!write_to_file)
+		op_splice_init(output_fd, num_mmap_pages * pagesize);
 	if ((rc = prepareToRecord()) < 0) {
 		err_msg = "Internal Error.  Perf event setup failed.";
 		goto error;
@@ -828,6 +915,7 @@ int operf_record::_start_recoding_new_thread(pid_t id)
 
 void operf_record::recordPerfData(void)
 {
+	operf_ring_pacer pacer;
 	bool disabled = false;
 	if (pid_started || system_wide)
 		record_process_info();
@@ -835,22 +923,32 @@ void operf_record::recordPerfData(void)
 		op_get_vsyscall_mapping(pid_to_profile, output_fd, this);
 
 	op_record_kernel_info(vmlinux_file, kernel_start, kernel_end, output_fd, this);
+	if (record_threads > 1) {
+		_record_with_drainers();
+		return;
+	}
+	if (operf_options::flight_recorder) {
+		_record_flight_recorder();
+		return;
+	}
 	cerr << "operf: Profiler started" << endl;
 	while (1) {
-		int prev = sample_reads;
 		pid_t pi;
 		ssize_t len;
 
+		op_splice_release();
 		for (size_t i = 0; i < samples_array.size(); i++) {
 			if (samples_array[i].base)
-				op_get_kernel_event_data(&samples_array[i], this);
+				pacer.drained(i, samples_array[i].mask + 1,
+				              op_get_kernel_event_data(&samples_array[i], this));
 		}
 		if (quit && disabled)
 			break;
 
-		if (prev == sample_reads) {
-			(void)poll(poll_data, poll_count, -1);
-		}
+		// Come back before a busy ring overflows, and to hand spliced
+		// ring space back once it's been read.
+		(void)poll(poll_data, poll_count,
+		           pacer.pass_done(op_splice_pending() ? 10 : -1));
 		if (!quit && track_new_forks && procs.size() > 1) {
 			len = read(read_comm_pipe, &pi, sizeof(pi));
 
@@ -874,6 +972,261 @@ void operf_record::recordPerfData(void)
 		}
 	}
 
+	operf_save_ring_stats(operf_options::session_dir, samples_array);
+	cverb << vdebug << "operf recording finished." << endl;
+}
+
+/* Replace the previous snapshot, if any, with what the flight recorder
+ * holds.  The header and the process and kernel info written when the
+ * recording started, which end at base, are kept.
+ */
+void operf_record::_write_flight_snapshot(operf_flight_recorder & recorder,
+                                          off_t base, unsigned int base_total)
+{
+	unsigned int total;
+
+	if (ftruncate(output_fd, base) < 0 ||
+	    lseek(output_fd, base, SEEK_SET) == (off_t)-1) {
+		string errmsg = "Internal error writing flight recorder snapshot: ";
+		errmsg += strerror(errno);
+		throw runtime_error(errmsg);
+	}
+	total = base_total + recorder.write(output_fd);
+	// Rewriting the header adds it to the total again.
+	opHeader.data_size = total;
+	write_op_header_info();
+	total_bytes_recorded = total;
+}
+
+/* With --flight-recorder, the rings are drained to memory instead, where
+ * only the last seconds of records are kept, and written to the output
+ * file on SIGUSR2 or once the trigger file shows up.
+ */
+void operf_record::_record_flight_recorder(void)
+{
+	operf_flight_recorder recorder(operf_options::flight_recorder);
+	operf_ring_pacer pacer;
+	string trigger = operf_options::session_dir + "/" + FLIGHT_TRIGGER_FILE;
+	off_t base = lseek(output_fd, 0, SEEK_CUR);
+	unsigned int base_total = total_bytes_recorded;
+	int nr_snapshots = 0;
+	bool disabled = false;
+
+	if (base == (off_t)-1) {
+		string errmsg = "Internal error doing lseek: ";
+		errmsg += strerror(errno);
+		throw runtime_error(errmsg);
+	}
+	unlink(trigger.c_str());
+	cerr << "operf: Profiler started; create " << trigger
+	     << " to save the last " << operf_options::flight_recorder
+	     << " seconds of samples" << endl;
+	while (1) {
+		for (size_t i = 0; i < samples_array.size(); i++) {
+			if (samples_array[i].base)
+				pacer.drained(i, samples_array[i].mask + 1,
+				              op_drain_ring(&samples_array[i], recorder));
+		}
+		if (quit && disabled)
+			break;
+
+		if (flight_snapshot_requested || !access(trigger.c_str(), F_OK)) {
+			flight_snapshot_requested = false;
+			unlink(trigger.c_str());
+			_write_flight_snapshot(recorder, base, base_total);
+			cerr << "operf: Saved flight recorder snapshot " << ++nr_snapshots << endl;
+		}
+		// Check for the trigger file every second even if nothing happens.
+		(void)poll(poll_data, poll_count, pacer.pass_done(1000));
+
+		if (quit) {
+			for (unsigned int i = 0; i < perfCounters.size(); i++)
+				ioctl(perfCounters[i].get_fd(), PERF_EVENT_IOC_DISABLE);
+			disabled = true;
+			cverb << vrecord << "operf_record::recordPerfData received signal to quit." << endl;
+		}
+	}
+
+	if (!nr_snapshots)
+		cerr << "operf: No flight recorder snapshot was saved" << endl;
+	operf_save_flight_stats(operf_options::session_dir, recorder.dropped());
+	operf_save_ring_stats(operf_options::session_dir, samples_array);
+	cverb << vdebug << "operf recording finished." << endl;
+}
+
+int operf_record::_create_segment_file(void)
+{
+	string tmpl = operf_options::session_dir + "/.operf_segment.XXXXXX";
+	char * fname = (char *)xmalloc(tmpl.length() + 1);
+	int fd;
+
+	strcpy(fname, tmpl.c_str());
+	fd = mkstemp(fname);
+	if (fd < 0) {
+		string errmsg = "Internal error: Could not create record segment file. errno is ";
+		errmsg += strerror(errno);
+		free(fname);
+		throw runtime_error(errmsg);
+	}
+	// Nobody else needs to see the segment; it goes away with the fd.
+	unlink(fname);
+	free(fname);
+	return fd;
+}
+
+void operf_record::_start_drainers(void)
+{
+	size_t nr_rings = samples_array.size();
+	pthread_mutex_t * lock = write_to_file ? NULL : &output_lock;
+
+	if (pipe(stop_drainers_pipe) < 0) {
+		string errmsg = "Internal error: Could not create pipe. errno is ";
+		errmsg += strerror(errno);
+		throw runtime_error(errmsg);
+	}
+	for (int i = 0; i < record_threads; i++) {
+		int fd = write_to_file ? _create_segment_file() : output_fd;
+		drainers.push_back(new operf_drainer(i, fd, lock, stop_drainers_pipe[0]));
+	}
+	/* Give each drainer a contiguous range of cpus: neighbouring cpu
+	 * numbers usually share a core or a package, which keeps a drainer's
+	 * rings and its pinned thread close together.
+	 */
+	for (size_t i = 0; i < nr_rings; i++) {
+		operf_drainer * d = drainers[(i * record_threads) / nr_rings];
+		d->add_ring(samples_array[i], poll_data[i].fd, ring_cpus[i]);
+	}
+	for (size_t i = 0; i < drainers.size(); i++) {
+		int rc = drainers[i]->start();
+		if (rc) {
+			string errmsg = "Internal error: Could not start record thread. errno is ";
+			errmsg += strerror(rc);
+			// Let the drainers already running exit before we bail out.
+			_stop_drainers();
+			throw runtime_error(errmsg);
+		}
+	}
+	cverb << vrecord << "Started " << drainers.size() << " record threads for "
+	      << nr_rings << " rings" << endl;
+}
+
+void operf_record::_stop_drainers(void)
+{
+	char stop = 1;
+	string errmsg;
+
+	if (write(stop_drainers_pipe[1], &stop, sizeof(stop)) < 0)
+		perror("Internal error on stop_drainers_pipe");
+	for (size_t i = 0; i < drainers.size(); i++) {
+		try {
+			drainers[i]->join();
+		} catch (runtime_error const & re) {
+			// Report the first failure, but join every thread first.
+			if (errmsg.empty())
+				errmsg = re.what();
+		}
+	}
+	if (!errmsg.empty())
+		throw runtime_error(errmsg);
+}
+
+/* Copy [from, to) of a drainer's segment file to the end of the output file. */
+void operf_record::_append_segment_range(int fd, off_t from, off_t to,
+                                         char * buf, size_t buf_size)
+{
+	while (from < to) {
+		size_t want = buf_size;
+		if ((off_t)want > to - from)
+			want = to - from;
+		ssize_t num = pread(fd, buf, want, from);
+		if (num < 0 && errno == EINTR)
+			continue;
+		if (num <= 0) {
+			string errmsg = "Internal error reading record segment file: ";
+			errmsg += num ? strerror(errno) : "unexpected end of file";
+			throw runtime_error(errmsg);
+		}
+		add_to_total(op_write_output(output_fd, buf, num));
+		from += num;
+	}
+}
+
+/* Merge the segment files of the drainers into the output file, slice by
+ * slice in the order they were drained in, so that a sample is about as
+ * close to the MMAP/COMM it depends on as when a single thread interleaves
+ * the rings.  operf_read::convertPerfData sees an ordinary stream of
+ * records; samples that precede the MMAP/COMM they depend on (because those
+ * records came in on another cpu's ring) are deferred and resolved the same
+ * way as then.
+ */
+void operf_record::_append_drainer_segments(void)
+{
+	size_t buf_size = 1024 * 1024;
+	char * buf = (char *)xmalloc(buf_size);
+	vector<size_t> next(drainers.size(), 0);
+	vector<off_t> pos(drainers.size(), 0);
+
+	try {
+		for (;;) {
+			operf_drainer::segment_slice const * first = NULL;
+			size_t first_drainer = 0;
+			for (size_t i = 0; i < drainers.size(); i++) {
+				vector<operf_drainer::segment_slice> const & slices =
+					drainers[i]->get_slices();
+				if (next[i] == slices.size())
+					continue;
+				operf_drainer::segment_slice const & slice = slices[next[i]];
+				if (!first || slice.start.tv_sec < first->start.tv_sec ||
+				    (slice.start.tv_sec == first->start.tv_sec &&
+				     slice.start.tv_nsec < first->start.tv_nsec)) {
+					first = &slice;
+					first_drainer = i;
+				}
+			}
+			if (!first)
+				break;
+			_append_segment_range(drainers[first_drainer]->get_out_fd(),
+			                      pos[first_drainer], first->end, buf, buf_size);
+			pos[first_drainer] = first->end;
+			next[first_drainer]++;
+		}
+	} catch (...) {
+		free(buf);
+		throw;
+	}
+	free(buf);
+}
+
+void operf_record::_record_with_drainers(void)
+{
+	_start_drainers();
+	cerr << "operf: Profiler started" << endl;
+
+	/* All the work happens in the drainers; we're just waiting for the
+	 * SIGUSR1 that tells us to stop, or for a drainer to fail.
+	 */
+	while (!quit) {
+		struct timespec ts_req;
+		ts_req.tv_sec = 0;
+		ts_req.tv_nsec = 100000000;
+		(void)nanosleep(&ts_req, NULL);
+	}
+	for (unsigned int i = 0; i < perfCounters.size(); i++)
+		ioctl(perfCounters[i].get_fd(), PERF_EVENT_IOC_DISABLE);
+	cverb << vrecord << "operf_record::recordPerfData received signal to quit." << endl;
+
+	_stop_drainers();
+	if (write_to_file) {
+		_append_drainer_segments();
+	} else {
+		for (size_t i = 0; i < drainers.size(); i++)
+			add_to_total(drainers[i]->get_bytes_written());
+	}
+	vector<struct mmap_data> rings;
+	for (size_t i = 0; i < drainers.size(); i++)
+		rings.insert(rings.end(), drainers[i]->get_rings().begin(),
+		             drainers[i]->get_rings().end());
+	operf_save_ring_stats(operf_options::session_dir, rings);
 	cverb << vdebug << "operf recording finished." << endl;
 }
 
@@ -900,6 +1253,46 @@ void operf_read::add_sample_id_to_opHeader(u64 sample_id)
 {
 	for (unsigned int i = 0; i < evts.size(); i++)
 		opHeader.h_attrs[i].ids.push_back(sample_id);
+	if (evts.size())
+		_add_sample_id(sample_id, 0);
+}
+
+size_t operf_read::_sample_id_slot(u64 id) const
+{
+	size_t mask = sample_id_table.size() - 1;
+	// Sample ids are mostly small consecutive numbers; spread them out.
+	size_t slot = (size_t)((id * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+	while (sample_id_table[slot].event >= 0 && sample_id_table[slot].id != id)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void operf_read::_add_sample_id(u64 id, int event)
+{
+	size_t slot;
+
+	if ((nr_sample_ids + 1) * 2 > sample_id_table.size()) {
+		vector<struct sample_id_slot> old;
+		struct sample_id_slot empty = { 0, -1 };
+		size_t new_size = sample_id_table.empty() ? 64 : sample_id_table.size() * 2;
+
+		old.swap(sample_id_table);
+		sample_id_table.resize(new_size, empty);
+		for (size_t i = 0; i < old.size(); i++) {
+			if (old[i].event >= 0)
+				sample_id_table[_sample_id_slot(old[i].id)] = old[i];
+		}
+	}
+
+	slot = _sample_id_slot(id);
+	if (sample_id_table[slot].event < 0) {
+		sample_id_table[slot].id = id;
+		sample_id_table[slot].event = event;
+		nr_sample_ids++;
+	} else if (event < sample_id_table[slot].event) {
+		sample_id_table[slot].event = event;
+	}
 }
 
 int operf_read::_read_header_info_with_ifstream(void)
@@ -959,6 +1352,7 @@ int operf_read::_read_header_info_with_ifstream(void)
 			message << "Perf header: id = " << hex << (unsigned long long)perf_id << endl;
 			cverb << vconvert << message.str();
 			opHeader.h_attrs[i].ids.push_back(perf_id);
+			_add_sample_id(perf_id, i);
 		}
 		istrm.seekg(next_f_attr, ios_base::beg);
 	}
@@ -1051,6 +1445,7 @@ int operf_read::_read_perf_header_from_pipe(void)
 			message << "Perf header: id = " << hex << (unsigned long long)perf_id << endl;
 			cverb << vconvert << message.str();
 			opHeader.h_attrs[i].ids.push_back(perf_id);
+			_add_sample_id(perf_id, i);
 		}
 
 	}
@@ -1073,14 +1468,14 @@ int operf_read::readPerfHeader(void)
 
 int operf_read::get_eventnum_by_perf_event_id(u64 id) const
 {
-	for (unsigned i = 0; i < evts.size(); i++) {
-		struct op_header_evt_info attr = opHeader.h_attrs[i];
-		for (unsigned j = 0; j < attr.ids.size(); j++) {
-			if (attr.ids[j] == id)
-				return i;
-		}
-	}
-	return -1;
+	int event;
+
+	if (sample_id_table.empty())
+		return -1;
+	event = sample_id_table[_sample_id_slot(id)].event;
+	if (event >= (int)evts.size())
+		return -1;
+	return event;
 }
 
 
@@ -1090,6 +1485,7 @@ unsigned int operf_read::convertPerfData(void)
 	struct mmap_info info;
 	bool error = false;
 	event_t * event = NULL;
+	pipe_event_reader * pipe_reader = NULL;
 
 	if (fcntl(post_profiling_pipe, F_SETFL, O_NONBLOCK) < 0) {
 		cerr << "Error: fcntl failed with errno:\n\t" << strerror(errno) << endl;
@@ -1114,13 +1510,13 @@ unsigned int operf_read::convertPerfData(void)
 			throw runtime_error("Error: Unable to mmap operf data file");
 		}
 	} else {
-		// Allocate way more than enough space for a really big event with a long callchain
-		event = (event_t *)xmalloc(65536);
-		memset(event, '\0', 65536);
+		pipe_reader = new pipe_event_reader(sample_data_fd, OP_PIPE_READ_BUF_SIZE);
 	}
 
 	for (int i = 0; i < OPERF_MAX_STATS; i++)
 		operf_stats[i] = 0;
+	if (operf_options::convert_threads > 1)
+		op_convert_workers_start(operf_options::convert_threads);
 
 	ostringstream message;
 	message << "Converting operf data to oprofile sample data format" << endl;
@@ -1138,7 +1534,8 @@ unsigned int operf_read::convertPerfData(void)
 			if (event == NULL)
 				break;
 		} else {
-			if (_get_perf_event_from_pipe(event, sample_data_fd) < 0)
+			event = pipe_reader->next();
+			if (event == NULL)
 				break;
 		}
 		rec_size = event->header.size;
@@ -1175,6 +1572,7 @@ unsigned int operf_read::convertPerfData(void)
 	first_time_processing = false;
 	if (!error)
 		op_reprocess_unresolved_events(opHeader.h_attrs[0].attr.sample_type, print_progress);
+	op_convert_workers_stop();
 
 	if (printed_progress_msg)
 		cerr << endl;
@@ -1191,6 +1589,6 @@ unsigned int operf_read::convertPerfData(void)
 	if (!inputFname.empty())
 		close(info.traceFD);
 	else
-		free(event);
+		delete pipe_reader;
 	return num_bytes;
 }
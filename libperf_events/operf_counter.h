@@ -23,6 +23,7 @@
 #include <sys/syscall.h>
 #include <stdint.h>
 #include <poll.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -37,6 +38,8 @@
 extern char * start_time_human_readable;
 
 class operf_record;
+class operf_drainer;
+class operf_flight_recorder;
 
 #define OP_BASIC_SAMPLE_FORMAT (PERF_SAMPLE_ID | PERF_SAMPLE_IP \
     | PERF_SAMPLE_TID)
@@ -104,6 +107,16 @@ private:
 	void write_op_header_info(void);
 	int _write_header_to_file(void);
 	int _write_header_to_pipe(void);
+	void _record_with_drainers(void);
+	void _record_flight_recorder(void);
+	void _write_flight_snapshot(operf_flight_recorder & recorder,
+	                            off_t base, unsigned int base_total);
+	void _start_drainers(void);
+	void _stop_drainers(void);
+	int _create_segment_file(void);
+	void _append_segment_range(int fd, off_t from, off_t to, char * buf,
+	                           size_t buf_size);
+	void _append_drainer_segments(void);
 	int output_fd;
 	int read_comm_pipe;
 	int write_comm_pipe;
@@ -132,12 +145,22 @@ private:
 	bool valid;
 	std::string vmlinux_file;
 	u64 kernel_start, kernel_end;
+	/* With --record-threads, the per-cpu rings are split into groups, each
+	 * drained by its own thread.  ring_cpus[i] is the cpu that samples_array[i]
+	 * records, or -1 if the ring is not bound to a cpu.
+	 */
+	int record_threads;
+	std::vector<int> ring_cpus;
+	std::vector<operf_drainer *> drainers;
+	int stop_drainers_pipe[2];
+	pthread_mutex_t output_lock;
 };
 
 class operf_read {
 public:
 	operf_read(std::vector<operf_event_t> & _evts)
-	: sample_data_fd(-1), inputFname(""), evts(_evts), cpu_type(CPU_NO_GOOD)
+	: sample_data_fd(-1), inputFname(""), evts(_evts), cpu_type(CPU_NO_GOOD),
+	  nr_sample_ids(0)
 	  { valid = syswide = false;
 	  write_comm_pipe = read_comm_pipe = 1;
 	  post_profiling_pipe = -1; }
@@ -167,6 +190,17 @@ private:
 	bool valid;
 	bool syswide;
 	op_cpu cpu_type;
+	/* Open addressing hash of all the sample ids in opHeader, giving
+	 * the first event each one belongs to; an empty slot has event -1.
+	 */
+	struct sample_id_slot {
+		u64 id;
+		int event;
+	};
+	std::vector<struct sample_id_slot> sample_id_table;
+	size_t nr_sample_ids;
+	void _add_sample_id(u64 id, int event);
+	size_t _sample_id_slot(u64 id) const;
 	int _read_header_info_with_ifstream(void);
 	int _read_perf_header_from_file(void);
 	int _read_perf_header_from_pipe(void);
@@ -0,0 +1,203 @@
+/**
+ * @file libperf_events/operf_drainer.cpp
+ * Thread which drains a subset of the perf_events ring buffers
+ * on behalf of operf_record.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <iostream>
+#include "operf_drainer.h"
+#include "operf_utils.h"
+#include "cverb.h"
+
+using namespace std;
+
+extern volatile bool quit;
+extern verbose vrecord;
+
+/** the passes of a drainer are merged into slices this long at least, in
+ * milliseconds, to bound the memory used by the slices of a long session
+ */
+#define SEGMENT_SLICE_MS 50
+
+
+operf_drainer::operf_drainer(int _index, int _out_fd, pthread_mutex_t * _out_lock,
+                             int stop_fd)
+	: index(_index), out_fd(_out_fd), out_lock(_out_lock), bytes_written(0),
+	  started(false)
+{
+	struct pollfd pfd;
+	pfd.fd = stop_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	poll_data.push_back(pfd);
+}
+
+
+operf_drainer::~operf_drainer()
+{
+	if (started)
+		pthread_join(thread, NULL);
+}
+
+
+void operf_drainer::add_ring(struct mmap_data const & md, int fd, int cpu)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rings.push_back(md);
+	poll_data.push_back(pfd);
+	if (cpu >= 0)
+		cpus.push_back(cpu);
+}
+
+
+int operf_drainer::start(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	/* The record process is stopped by a SIGUSR1 and the main thread must
+	 * be the one to see it, so the drainers run with all signals blocked.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	rc = pthread_create(&thread, NULL, _run, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!rc)
+		started = true;
+	return rc;
+}
+
+
+void operf_drainer::join(void)
+{
+	if (!started)
+		return;
+	pthread_join(thread, NULL);
+	started = false;
+	cverb << vrecord << "drainer " << index << " wrote " << dec
+	      << bytes_written << " bytes from " << rings.size() << " rings" << endl;
+	if (!error.empty())
+		throw runtime_error(error);
+}
+
+
+void * operf_drainer::_run(void * arg)
+{
+	operf_drainer * drainer = (operf_drainer *)arg;
+
+	try {
+		drainer->_record();
+	} catch (runtime_error const & re) {
+		drainer->error = re.what();
+		// Make the main thread stop the whole session.
+		quit = true;
+	}
+	return NULL;
+}
+
+
+void operf_drainer::_pin_to_cpus(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t mask;
+
+	if (cpus.empty())
+		return;
+	CPU_ZERO(&mask);
+	for (size_t i = 0; i < cpus.size(); i++)
+		CPU_SET(cpus[i], &mask);
+	// On Linux, pid 0 is the calling thread rather than the whole process.
+	if (sched_setaffinity(0, sizeof(mask), &mask) < 0)
+		cverb << vrecord << "drainer " << index << ": sched_setaffinity failed: "
+		      << strerror(errno) << endl;
+#endif
+}
+
+
+void operf_drainer::_drain_rings(bool & splice_pending)
+{
+	if (out_lock) {
+		pthread_mutex_lock(out_lock);
+		OP_perf_utils::op_splice_release();
+		pthread_mutex_unlock(out_lock);
+	}
+	for (size_t i = 0; i < rings.size(); i++) {
+		int n;
+		if (!rings[i].base)
+			continue;
+		if (out_lock)
+			pthread_mutex_lock(out_lock);
+		try {
+			n = OP_perf_utils::op_drain_ring(&rings[i], out_fd);
+		} catch (...) {
+			if (out_lock)
+				pthread_mutex_unlock(out_lock);
+			throw;
+		}
+		if (out_lock)
+			pthread_mutex_unlock(out_lock);
+		bytes_written += n;
+		pacer.drained(i, rings[i].mask + 1, n);
+	}
+	splice_pending = false;
+	if (out_lock) {
+		pthread_mutex_lock(out_lock);
+		splice_pending = OP_perf_utils::op_splice_pending();
+		pthread_mutex_unlock(out_lock);
+	}
+}
+
+
+void operf_drainer::_record(void)
+{
+	bool stopping = false;
+
+	_pin_to_cpus();
+	while (1) {
+		bool splice_pending;
+		struct timespec start;
+		u64 start_bytes = bytes_written;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		_drain_rings(splice_pending);
+		if (!out_lock && bytes_written != start_bytes) {
+			if (slices.empty() ||
+			    (start.tv_sec - slices.back().start.tv_sec) * 1000 +
+			    (start.tv_nsec - slices.back().start.tv_nsec) / 1000000 >=
+			    SEGMENT_SLICE_MS) {
+				segment_slice slice;
+				slice.start = start;
+				slices.push_back(slice);
+			}
+			slices.back().end = bytes_written;
+		}
+		if (stopping)
+			break;
+		/* The stop pipe is never read, so once it is written to every
+		 * drainer sees it; operf_record disables the counters first so
+		 * the final pass above is complete.  The pacer wakes us up before
+		 * a busy ring overflows.  While spliced data is unread, wake up
+		 * now and then to hand the ring space back (see op_splice_release).
+		 */
+		(void)poll(&poll_data[0], poll_data.size(),
+		           pacer.pass_done(splice_pending ? 10 : -1));
+		if (poll_data[0].revents & (POLLIN | POLLHUP))
+			stopping = true;
+	}
+}
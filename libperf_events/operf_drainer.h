@@ -0,0 +1,92 @@
+/**
+ * @file libperf_events/operf_drainer.h
+ * Thread which drains a subset of the perf_events ring buffers
+ * on behalf of operf_record.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_DRAINER_H_
+#define OPERF_DRAINER_H_
+
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "operf_event.h"
+#include "operf_ring_pacer.h"
+
+/**
+ * An operf_drainer owns a group of the per-cpu ring buffers set up by
+ * operf_record and copies their contents out from its own thread, which
+ * is pinned to the cpus of that group.
+ *
+ * When the record output is a file, each drainer writes to a private,
+ * unlinked segment file that operf_record merges into the output file
+ * once recording has stopped, slice by slice in the order they were
+ * drained in.  When the record output is the sample
+ * data pipe, drainers share it and serialize their writes with
+ * out_lock so that records from different rings never interleave.
+ */
+class operf_drainer {
+public:
+	/// the part of the segment file drained from a given time on
+	struct segment_slice {
+		/// when the first pass of the slice started
+		struct timespec start;
+		/// the segment file offset the slice ends at
+		off_t end;
+	};
+
+	/**
+	 * @param index  drainer number, used for diagnostics only
+	 * @param out_fd  fd the ring contents are written to
+	 * @param out_lock  if non-NULL, held around each write to out_fd
+	 * @param stop_fd  read end of a pipe which becomes readable when
+	 *  the drainer must do a final pass over its rings and exit
+	 */
+	operf_drainer(int index, int out_fd, pthread_mutex_t * out_lock,
+	              int stop_fd);
+	~operf_drainer();
+
+	/// hand over a ring; cpu is the one it records, or -1 if unknown
+	void add_ring(struct mmap_data const & md, int fd, int cpu);
+	/// return 0 on success, an errno value otherwise
+	int start(void);
+	/// wait for the thread; throw runtime_error if it failed
+	void join(void);
+
+	int get_out_fd(void) const { return out_fd; }
+	u64 get_bytes_written(void) const { return bytes_written; }
+	size_t get_nr_rings(void) const { return rings.size(); }
+	/// the rings as drained so far, with their statistics
+	std::vector<struct mmap_data> const & get_rings(void) const { return rings; }
+	/// the slices of the segment file, in order
+	std::vector<segment_slice> const & get_slices(void) const { return slices; }
+
+private:
+	static void * _run(void * arg);
+	void _record(void);
+	void _pin_to_cpus(void);
+	void _drain_rings(bool & splice_pending);
+
+	int index;
+	int out_fd;
+	pthread_mutex_t * out_lock;
+	std::vector<struct mmap_data> rings;
+	std::vector<struct pollfd> poll_data;
+	std::vector<int> cpus;
+	operf_ring_pacer pacer;
+	std::vector<segment_slice> slices;
+	u64 bytes_written;
+	pthread_t thread;
+	bool started;
+	std::string error;
+};
+
+#endif /* OPERF_DRAINER_H_ */
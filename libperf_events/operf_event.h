@@ -15,6 +15,7 @@
 #define OPERF_EVENT_H_
 
 #include <limits.h>
+#include <time.h>
 #include <linux/perf_event.h>
 #include <vector>
 #include "op_types.h"
@@ -93,10 +94,27 @@ typedef union event_union {
 	struct throttle_event throttle;
 } event_t;
 
+/* Drain latencies are counted in power of 2 millisecond buckets: bucket
+ * i counts those under 2^i ms, the last one all the longer ones.
+ */
+#define OPERF_DRAIN_LATENCY_BUCKETS 12
+
+/* What the recorder learns about a ring buffer while draining it. */
+struct ring_stats {
+	int cpu;	/* -1 if the ring isn't bound to a cpu */
+	u64 lost;	/* samples the kernel had no room for */
+	u64 throttles;	/* PERF_RECORD_THROTTLE records */
+	u64 high_water;	/* most bytes in use in the ring at one drain */
+	/* time since the previous drain, for the drains which found data */
+	unsigned long drain_latency[OPERF_DRAIN_LATENCY_BUCKETS];
+	struct timespec last_drain;
+};
+
 struct mmap_data {
 	void *base;
 	u64 mask;
 	u64 prev;
+	struct ring_stats stats;
 };
 
 struct ip_callchain {
@@ -0,0 +1,210 @@
+/**
+ * @file libperf_events/operf_event_queue.cpp
+ * Sample events whose processing is deferred until the end of the
+ * conversion.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include "operf_event_queue.h"
+#include "operf_utils.h"
+#include "op_libiberty.h"
+#include "cverb.h"
+
+using namespace std;
+
+extern verbose vconvert;
+
+/** events are much smaller, their size is 16 bits */
+#define CHUNK_SIZE (1024 * 1024)
+
+
+operf_event_queue::operf_event_queue(size_t _memory_limit)
+	: memory_limit(_memory_limit), nr_events(0), spill_fd(-1),
+	  spill_size(0), spill_failed(false)
+{
+}
+
+
+operf_event_queue::~operf_event_queue()
+{
+	clear();
+}
+
+
+void operf_event_queue::push(event_t const * event)
+{
+	size_t size = event->header.size;
+
+	if (chunks.empty() || CHUNK_SIZE - chunks.back().used < size) {
+		chunk new_chunk;
+		if (memory_limit && !spill_failed &&
+		    chunks.size() * CHUNK_SIZE >= memory_limit)
+			spill();
+		new_chunk.data = (char *)xmalloc(CHUNK_SIZE);
+		new_chunk.used = 0;
+		chunks.push_back(new_chunk);
+	}
+
+	memcpy(chunks.back().data + chunks.back().used, event, size);
+	chunks.back().used += size;
+	nr_events++;
+}
+
+
+static int write_all(int fd, char const * buf, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t nr = pwrite(fd, buf, size, offset);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += nr;
+		size -= nr;
+		offset += nr;
+	}
+
+	return 0;
+}
+
+
+void operf_event_queue::spill(void)
+{
+	off_t end = spill_size;
+	int err = 0;
+	size_t i;
+
+	if (spill_fd < 0) {
+		string name = operf_options::session_dir + "/deferred.XXXXXX";
+		char * tmpl = xstrdup(name.c_str());
+		spill_fd = mkstemp(tmpl);
+		if (spill_fd < 0)
+			err = errno;
+		else
+			unlink(tmpl);
+		free(tmpl);
+	}
+
+	/* what's past spill_size is ignored, so a failed write leaves the
+	 * file consistent with the chunks still in memory */
+	for (i = 0; !err && i < chunks.size(); ++i) {
+		err = write_all(spill_fd, chunks[i].data, chunks[i].used, end);
+		end += chunks[i].used;
+	}
+
+	if (err) {
+		cerr << "operf: unable to write deferred samples to "
+		     << operf_options::session_dir << ": " << strerror(err)
+		     << ", keeping them in memory" << endl;
+		spill_failed = true;
+		return;
+	}
+
+	spill_size = end;
+	cverb << vconvert << "Deferred samples: wrote " << dec << chunks.size()
+	      << " chunks to disk" << endl;
+	for (i = 0; i < chunks.size(); ++i)
+		free(chunks[i].data);
+	chunks.clear();
+}
+
+
+void operf_event_queue::clear(void)
+{
+	for (size_t i = 0; i < chunks.size(); ++i)
+		free(chunks[i].data);
+	chunks.clear();
+	if (spill_fd >= 0)
+		close(spill_fd);
+	spill_fd = -1;
+	spill_size = 0;
+	nr_events = 0;
+}
+
+
+/* call func for the whole events at the start of buf */
+int operf_event_queue::replay_buffer(char * buf, size_t size,
+                                     size_t * consumed,
+                                     int (*func)(event_t *, void *),
+                                     void * data)
+{
+	size_t pos = 0;
+	int rc = 0;
+
+	while (rc >= 0 && size - pos >= sizeof(struct perf_event_header)) {
+		event_t * event = (event_t *)(buf + pos);
+		if (event->header.size < sizeof(struct perf_event_header) ||
+		    event->header.size > size - pos)
+			break;
+		pos += event->header.size;
+		rc = func(event, data);
+	}
+
+	*consumed = pos;
+	return rc;
+}
+
+
+int operf_event_queue::replay_spilled(int (*func)(event_t *, void *),
+                                      void * data)
+{
+	char * buf = (char *)xmalloc(CHUNK_SIZE);
+	off_t offset = 0;
+	size_t have = 0;
+	size_t consumed;
+	int rc = 0;
+
+	while (rc >= 0 && offset < spill_size) {
+		size_t want = CHUNK_SIZE - have;
+		ssize_t nr;
+		if ((off_t)want > spill_size - offset)
+			want = spill_size - offset;
+		nr = pread(spill_fd, buf + have, want, offset);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0) {
+			cerr << "operf: unable to read deferred samples: "
+			     << (nr ? strerror(errno) : "unexpected end of file")
+			     << endl;
+			rc = -1;
+			break;
+		}
+		offset += nr;
+		have += nr;
+		rc = replay_buffer(buf, have, &consumed, func, data);
+		memmove(buf, buf + consumed, have - consumed);
+		have -= consumed;
+	}
+	free(buf);
+
+	return rc;
+}
+
+
+int operf_event_queue::replay(int (*func)(event_t * event, void * data),
+                              void * data)
+{
+	size_t consumed;
+	int rc = 0;
+
+	if (spill_fd >= 0)
+		rc = replay_spilled(func, data);
+
+	for (size_t i = 0; rc >= 0 && i < chunks.size(); ++i)
+		rc = replay_buffer(chunks[i].data, chunks[i].used, &consumed,
+		                   func, data);
+
+	clear();
+	return rc;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file libperf_events/operf_event_queue.h
+ * Sample events whose processing is deferred until the end of the
+ * conversion.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_EVENT_QUEUE_H_
+#define OPERF_EVENT_QUEUE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+#include "operf_event.h"
+#include "utility.h"
+
+/**
+ * A FIFO of copies of perf events. The events are packed in large
+ * chunks instead of being allocated one by one. Once the chunks use
+ * more than the memory limit, they are written to a temporary file in
+ * the session directory, and read back in chunk sized batches.
+ */
+class operf_event_queue : noncopyable {
+public:
+	/// a memory_limit of zero keeps all the events in memory
+	operf_event_queue(size_t memory_limit);
+	~operf_event_queue();
+
+	/// append a copy of event
+	void push(event_t const * event);
+
+	/// the number of events queued
+	size_t size(void) const { return nr_events; }
+
+	/**
+	 * Call func for each event, in the order they were pushed, and
+	 * empty the queue. The event is only valid during the call. Once
+	 * func returns a negative value it isn't called anymore, and that
+	 * value is returned; else 0 is returned.
+	 */
+	int replay(int (*func)(event_t * event, void * data), void * data);
+
+private:
+	struct chunk {
+		char * data;
+		size_t used;
+	};
+
+	/// write the chunks to the spill file and free them
+	void spill(void);
+	/// return the memory of the chunks, close the spill file
+	void clear(void);
+	int replay_buffer(char * buf, size_t size, size_t * consumed,
+	                  int (*func)(event_t *, void *), void * data);
+	int replay_spilled(int (*func)(event_t *, void *), void * data);
+
+	std::vector<chunk> chunks;
+	size_t memory_limit;
+	size_t nr_events;
+	/// -1 until events are spilled
+	int spill_fd;
+	/// the bytes of events in the spill file
+	off_t spill_size;
+	/// the spill file couldn't be used, keep everything in memory
+	bool spill_failed;
+};
+
+#endif /* OPERF_EVENT_QUEUE_H_ */
@@ -0,0 +1,289 @@
+/**
+ * @file libperf_events/operf_flight_recorder.cpp
+ * Keep the perf_events records of the last few seconds in memory, to be
+ * saved on demand.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include "operf_flight_recorder.h"
+#include "operf_utils.h"
+#include "op_libiberty.h"
+
+using namespace std;
+
+/** a ring is drained in a single block, so this is just the usual size */
+#define BLOCK_SIZE (1024 * 1024)
+/** how many blocks a window is split in, at most */
+#define WINDOW_BLOCKS 16
+/** the size of the records kept from dropped blocks, at most */
+#define STATE_LIMIT (16 * 1024 * 1024)
+
+
+static unsigned long elapsed_ms(struct timespec const & from,
+                                struct timespec const & to)
+{
+	return (to.tv_sec - from.tv_sec) * 1000 +
+		(to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+
+operf_flight_recorder::operf_flight_recorder(unsigned int window)
+	: state_size(0), next_seq(0), nr_dropped(0), window_ms(window * 1000)
+{
+	spare.data = NULL;
+	spare.size = 0;
+}
+
+
+operf_flight_recorder::~operf_flight_recorder()
+{
+	for (size_t i = 0; i < blocks.size(); ++i)
+		free(blocks[i].data);
+	free(spare.data);
+}
+
+
+void operf_flight_recorder::add(struct iovec const * iov, int nr_iov)
+{
+	struct timespec now;
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < nr_iov; ++i)
+		size += iov[i].iov_len;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	expire(now);
+
+	/* All the data goes to the same block, so that the records split
+	 * across the end of the ring are whole again. */
+	if (blocks.empty() || blocks.back().size - blocks.back().used < size ||
+	    elapsed_ms(blocks.back().start, now) >= window_ms / WINDOW_BLOCKS) {
+		block b = spare;
+		if (b.size < size || b.size < BLOCK_SIZE) {
+			free(b.data);
+			b.size = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+			b.data = (char *)xmalloc(b.size);
+		}
+		spare.data = NULL;
+		spare.size = 0;
+		b.start = now;
+		b.used = 0;
+		blocks.push_back(b);
+	}
+
+	block & b = blocks.back();
+	for (i = 0; i < nr_iov; ++i) {
+		memcpy(b.data + b.used, iov[i].iov_base, iov[i].iov_len);
+		b.used += iov[i].iov_len;
+	}
+}
+
+
+void operf_flight_recorder::expire(struct timespec const & now)
+{
+	// The records of a block are older than its successor's start.
+	while (blocks.size() > 1 &&
+	       elapsed_ms(blocks[1].start, now) >= window_ms) {
+		keep_state(blocks.front());
+		free(spare.data);
+		spare = blocks.front();
+		blocks.pop_front();
+	}
+}
+
+
+void operf_flight_recorder::keep(kept_record & kept, char const * data,
+                                 size_t size)
+{
+	state_size -= kept.data.size();
+	kept.data.assign(data, size);
+	kept.seq = ++next_seq;
+	state_size += size;
+}
+
+
+void operf_flight_recorder::forget(map<u32, process_state>::iterator it)
+{
+	process_state & proc = it->second;
+	map<u64, kept_record>::const_iterator mmap;
+
+	state_size -= proc.comm.data.size() + proc.fork.data.size();
+	for (mmap = proc.mmaps.begin(); mmap != proc.mmaps.end(); ++mmap)
+		state_size -= mmap->second.data.size();
+	if (!proc.fork.data.empty()) {
+		map<u32, process_state>::iterator parent =
+			processes.find(proc.ppid);
+		if (parent != processes.end() && parent->second.nr_children)
+			parent->second.nr_children--;
+	}
+	processes.erase(it);
+}
+
+
+void operf_flight_recorder::release(u32 pid)
+{
+	for (;;) {
+		map<u32, process_state>::iterator it = processes.find(pid);
+		if (it == processes.end() || !it->second.exited ||
+		    it->second.nr_children)
+			return;
+		bool forked = !it->second.fork.data.empty();
+		pid = it->second.ppid;
+		forget(it);
+		// the parent may have been kept for this child only
+		if (!forked)
+			return;
+	}
+}
+
+
+void operf_flight_recorder::keep_state(block const & b)
+{
+	size_t pos = 0;
+
+	while (b.used - pos >= sizeof(struct perf_event_header)) {
+		event_t const * event = (event_t const *)(b.data + pos);
+		char const * data = b.data + pos;
+		size_t size = event->header.size;
+		if (size < sizeof(event->header) || size > b.used - pos)
+			break;
+		pos += size;
+
+		switch (event->header.type) {
+		case PERF_RECORD_COMM: {
+			process_state & proc = processes[event->comm.pid];
+			// the COMM of the process tells more than a thread's
+			event_t const * kept =
+				(event_t const *)proc.comm.data.data();
+			if (event->comm.pid == event->comm.tid ||
+			    proc.comm.data.empty() ||
+			    kept->comm.pid != kept->comm.tid)
+				keep(proc.comm, data, size);
+			break;
+		}
+		case PERF_RECORD_MMAP:
+			keep(processes[event->mmap.pid].mmaps[event->mmap.start],
+			     data, size);
+			break;
+		case PERF_RECORD_FORK: {
+			// threads share the state of their process
+			if (event->fork.pid == event->fork.ppid)
+				break;
+			map<u32, process_state>::iterator it =
+				processes.find(event->fork.pid);
+			// a pid reused once the process it was given to exited
+			if (it != processes.end() && it->second.exited) {
+				unsigned int nr_children = it->second.nr_children;
+				forget(it);
+				processes[event->fork.pid].nr_children = nr_children;
+			}
+			process_state & proc = processes[event->fork.pid];
+			if (!proc.fork.data.empty()) {
+				map<u32, process_state>::iterator parent =
+					processes.find(proc.ppid);
+				if (parent != processes.end() &&
+				    parent->second.nr_children)
+					parent->second.nr_children--;
+			}
+			proc.ppid = event->fork.ppid;
+			processes[proc.ppid].nr_children++;
+			keep(proc.fork, data, size);
+			break;
+		}
+		case PERF_RECORD_EXIT: {
+			// the EXIT of a thread has the pid of its process
+			if (event->fork.pid != event->fork.tid)
+				break;
+			map<u32, process_state>::iterator it =
+				processes.find(event->fork.pid);
+			if (it == processes.end())
+				break;
+			it->second.exited = true;
+			release(event->fork.pid);
+			break;
+		}
+		}
+	}
+
+	limit_state();
+}
+
+
+/* Drop the records of the processes least recently heard of, down to
+ * some room below the limit so that it isn't done for each block.
+ */
+void operf_flight_recorder::limit_state(void)
+{
+	if (state_size <= STATE_LIMIT)
+		return;
+
+	vector<pair<u64, u32> > by_age;
+	map<u32, process_state>::const_iterator it;
+	for (it = processes.begin(); it != processes.end(); ++it) {
+		process_state const & proc = it->second;
+		u64 seq = max(proc.comm.seq, proc.fork.seq);
+		map<u64, kept_record>::const_iterator mmap;
+		for (mmap = proc.mmaps.begin(); mmap != proc.mmaps.end(); ++mmap)
+			seq = max(seq, mmap->second.seq);
+		by_age.push_back(make_pair(seq, it->first));
+	}
+	sort(by_age.begin(), by_age.end());
+
+	for (size_t i = 0; i < by_age.size() &&
+	     state_size > STATE_LIMIT / 4 * 3; ++i) {
+		map<u32, process_state>::iterator proc =
+			processes.find(by_age[i].second);
+		nr_dropped += proc->second.mmaps.size() +
+			!proc->second.comm.data.empty() +
+			!proc->second.fork.data.empty();
+		forget(proc);
+	}
+}
+
+
+u64 operf_flight_recorder::write(int fd)
+{
+	struct timespec now;
+	u64 total = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	expire(now);
+
+	// the kept records go in the order they were recorded in
+	vector<pair<u64, string const *> > kept;
+	map<u32, process_state>::const_iterator it;
+	for (it = processes.begin(); it != processes.end(); ++it) {
+		process_state const & proc = it->second;
+		if (!proc.comm.data.empty())
+			kept.push_back(make_pair(proc.comm.seq, &proc.comm.data));
+		if (!proc.fork.data.empty())
+			kept.push_back(make_pair(proc.fork.seq, &proc.fork.data));
+		map<u64, kept_record>::const_iterator mmap;
+		for (mmap = proc.mmaps.begin(); mmap != proc.mmaps.end(); ++mmap)
+			kept.push_back(make_pair(mmap->second.seq,
+			                         &mmap->second.data));
+	}
+	sort(kept.begin(), kept.end());
+
+	string state;
+	state.reserve(state_size);
+	for (size_t i = 0; i < kept.size(); ++i)
+		state += *kept[i].second;
+	if (!state.empty())
+		total += OP_perf_utils::op_write_output(fd, &state[0], state.size());
+	for (size_t i = 0; i < blocks.size(); ++i)
+		total += OP_perf_utils::op_write_output(fd, blocks[i].data,
+		                                        blocks[i].used);
+	return total;
+}
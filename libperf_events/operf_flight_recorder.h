@@ -0,0 +1,106 @@
+/**
+ * @file libperf_events/operf_flight_recorder.h
+ * Keep the perf_events records of the last few seconds in memory, to be
+ * saved on demand.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_FLIGHT_RECORDER_H_
+#define OPERF_FLIGHT_RECORDER_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "op_types.h"
+#include "utility.h"
+
+/**
+ * The records drained from the rings are copied to blocks tagged with
+ * the time they were started at, and a block is dropped once the next
+ * one is older than the window. Samples can't be converted without the
+ * COMM, MMAP and FORK records which came before them though, so those
+ * are kept from the dropped blocks: the newest COMM and FORK of each
+ * process and its newest MMAP at each address. A process is forgotten
+ * once its EXIT is dropped too, and the processes it forked are gone.
+ * Past a limit, the records of the processes least recently heard of
+ * are dropped and counted.
+ */
+class operf_flight_recorder : noncopyable {
+public:
+	/// keep the records of the last window seconds
+	operf_flight_recorder(unsigned int window);
+	~operf_flight_recorder();
+
+	/**
+	 * Append a copy of the data in iov, which must be made of whole
+	 * records once put together, and drop the records out of the window.
+	 */
+	void add(struct iovec const * iov, int nr_iov);
+
+	/**
+	 * Write the records kept from the dropped blocks, then the records
+	 * of the window, to fd. Return the number of bytes written.
+	 */
+	u64 write(int fd);
+
+	/// the number of records dropped to stay within the limit
+	u64 dropped(void) const { return nr_dropped; }
+
+private:
+	struct block {
+		struct timespec start;
+		char * data;
+		size_t used;
+		size_t size;
+	};
+
+	/// a record kept from a dropped block, seq orders them
+	struct kept_record {
+		kept_record() : seq(0) {}
+		u64 seq;
+		std::string data;
+	};
+
+	/// the records kept for a process
+	struct process_state {
+		process_state() : ppid(0), nr_children(0), exited(false) {}
+		kept_record comm;
+		kept_record fork;
+		/// the newest MMAP at each start address
+		std::map<u64, kept_record> mmaps;
+		/// the parent, if fork is set
+		u32 ppid;
+		/// the kept processes forked from this one
+		unsigned int nr_children;
+		bool exited;
+	};
+
+	void expire(struct timespec const & now);
+	void keep_state(block const & b);
+	void keep(kept_record & kept, char const * data, size_t size);
+	/// forget pid if it exited and its children are gone
+	void release(u32 pid);
+	void forget(std::map<u32, process_state>::iterator it);
+	void limit_state(void);
+
+	std::deque<block> blocks;
+	/// the records the samples of the window may depend on, by pid
+	std::map<u32, process_state> processes;
+	/// the total size of the kept records
+	size_t state_size;
+	u64 next_seq;
+	u64 nr_dropped;
+	/// a dropped block, reused for the next one
+	block spare;
+	unsigned int window_ms;
+};
+
+#endif /* OPERF_FLIGHT_RECORDER_H_ */
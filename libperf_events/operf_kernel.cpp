@@ -16,6 +16,8 @@
 #include <sstream>
 #include <unistd.h>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
 #include "operf_kernel.h"
 #include "operf_sfile.h"
 #include "op_list.h"
@@ -33,6 +35,23 @@ static struct operf_kernel_image vmlinux_image;
 
 using namespace std;
 
+/* The modules, sorted by start address, for operf_find_kernel_image().
+ * Modules are only added while processing the kernel's MMAP records at
+ * the start of the profile, so the array is kept sorted on insertion.
+ */
+static vector<struct operf_kernel_image *> sorted_modules;
+
+/* Kernel samples tend to come in runs from the same module.  Each
+ * converter thread has its own last hit; see operf_convert_worker.
+ */
+static __thread struct operf_kernel_image * last_module;
+
+
+static bool module_start_less(vma_t pc, struct operf_kernel_image const * image)
+{
+	return pc < image->start;
+}
+
 void operf_create_vmlinux(char const * name, char const * arg)
 {
 	/* vmlinux is *not* on the list of modules */
@@ -77,6 +96,13 @@ void operf_create_module(char const * name, vma_t start, vma_t end)
 	image->start = start;
 	image->end = end;
 	list_add(&image->list, &modules);
+	/* Insert after modules with the same start address so that, like the
+	 * walk of the (most recent first) modules list used to, a lookup finds
+	 * the most recently added one.
+	 */
+	sorted_modules.insert(upper_bound(sorted_modules.begin(), sorted_modules.end(),
+	                                  start, module_start_less),
+	                      image);
 }
 
 void operf_free_modules_list(void)
@@ -84,6 +110,8 @@ void operf_free_modules_list(void)
 	struct list_head * pos;
 	struct list_head * pos2;
 	struct operf_kernel_image * image;
+	sorted_modules.clear();
+	last_module = NULL;
 	list_for_each_safe(pos, pos2, &modules) {
 		image = list_entry(pos, struct operf_kernel_image, list);
 		free(image->name);
@@ -103,7 +131,7 @@ void operf_free_modules_list(void)
  */
 struct operf_kernel_image * operf_find_kernel_image(vma_t pc)
 {
-	struct list_head * pos;
+	vector<struct operf_kernel_image *>::iterator it;
 	struct operf_kernel_image * image = &vmlinux_image;
 
 	if (no_vmlinux)
@@ -112,10 +140,19 @@ struct operf_kernel_image * operf_find_kernel_image(vma_t pc)
 	if (image->start <= pc && image->end > pc)
 		return image;
 
-	list_for_each(pos, &modules) {
-		image = list_entry(pos, struct operf_kernel_image, list);
-		if (image->start <= pc && image->end > pc)
-			return image;
+	image = last_module;
+	if (image && image->start <= pc && image->end > pc)
+		return image;
+
+	// The last module starting at or below pc is the only candidate.
+	it = upper_bound(sorted_modules.begin(), sorted_modules.end(), pc,
+	                 module_start_less);
+	if (it == sorted_modules.begin())
+		return NULL;
+	image = *--it;
+	if (image->end > pc) {
+		last_module = image;
+		return image;
 	}
 
 	return NULL;
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 extern operf_read operfRead;
 extern op_cpu cpu_type;
@@ -128,14 +129,80 @@ static void fill_header(struct opd_header * header, unsigned long counter,
 	header->cg_to_anon_start = cg_to_anon_start;
 }
 
+/* The number of nodes in the file of the previous session which mangled
+ * replaces, or zero. The same binaries are often profiled again, so this
+ * is a good guess of the size the new file needs.
+ */
+static odb_node_nr_t previous_session_size(char const * mangled)
+{
+	static char const current[] = "/current/";
+	size_t dir_len = strlen(op_samples_current_dir);
+	odb_node_nr_t nr_node;
+	string previous;
+
+	if (dir_len < strlen(current) ||
+	    strcmp(op_samples_current_dir + dir_len - strlen(current), current) ||
+	    strncmp(mangled, op_samples_current_dir, dir_len))
+		return 0;
+
+	/* appending to the current session, the file has its size */
+	if (!access(mangled, F_OK))
+		return 0;
+
+	previous.assign(op_samples_current_dir, dir_len - strlen(current));
+	previous += "/previous/";
+	previous += mangled + dir_len;
+	if (odb_get_node_count(previous.c_str(), sizeof(struct opd_header),
+	                       &nr_node))
+		return 0;
+
+	return nr_node;
+}
+
+
+/* fill the header of a sample file just opened */
+static void setup_header(odb_t * file, struct operf_sfile const * last,
+                         struct operf_sfile const * sf, int counter)
+{
+	char const * binary;
+	vma_t last_start = 0;
+	time_t mtime;
+
+	if (!sf->kernel) {
+		binary = sf->image_name;
+		mtime = op_get_mtime(binary);
+	} else {
+		binary = sf->kernel->name;
+
+		if (binary) {
+			if (strncmp(KALL_SYM_FILE, binary,
+				    strlen(KALL_SYM_FILE)) == 0 )
+			  /* The Kallsyms file is not a real file.  op_get_mtime() may
+			   * return different values for each call.
+			   */
+				mtime = 0;
+			else
+				mtime = op_get_mtime(binary);
+		} else {
+			mtime = 0;
+		}
+	}
+
+	if (last && last->is_anon)
+		last_start = last->start_addr;
+
+	fill_header((struct opd_header *)odb_get_data(file), counter,
+		    sf->is_anon ? sf->start_addr : 0, last_start,
+		    !!sf->kernel, last ? !!last->kernel : 0, mtime);
+}
+
+
 int operf_open_sample_file(odb_t *file, struct operf_sfile *last,
                          struct operf_sfile * sf, int counter, int cg)
 {
 	char * mangled;
-	char const * binary;
-	vma_t last_start = 0;
+	odb_node_nr_t size_hint;
 	int err;
-	time_t mtime;
 
 	mangled = mangle_filename(last, sf, counter, cg);
 
@@ -155,14 +222,19 @@ int operf_open_sample_file(odb_t *file, struct operf_sfile *last,
 	if (sf != last)
 		operf_sfile_get(last);
 
+	size_hint = previous_session_size(mangled);
+
 retry:
-	err = odb_open(file, mangled, ODB_RDWR, sizeof(struct opd_header));
+	operf_sfile_lock_odb();
+	err = odb_open_hint(file, mangled, ODB_RDWR, sizeof(struct opd_header),
+	                    size_hint);
+	operf_sfile_unlock_odb();
 
 	/* This should never happen unless someone is clearing out sample data dir. */
 	if (err) {
 		if (err == EMFILE) {
-			if (operf_sfile_lru_clear()) {
-				cerr << "LRU cleared but odb_open() fails for " << mangled << endl;
+			if (operf_sfile_release_fds()) {
+				cerr << "sample file descriptors released but odb_open() fails for " << mangled << endl;
 				abort();
 			}
 			goto retry;
@@ -176,37 +248,69 @@ retry:
 		goto out;
 	}
 
-	if (!sf->kernel) {
-		binary = sf->image_name;
-		mtime = op_get_mtime(binary);
-	} else {
-		binary = sf->kernel->name;
+	setup_header(file, last, sf, counter);
 
-		if (binary) {
-			if (strncmp(KALL_SYM_FILE, binary,
-				    strlen(KALL_SYM_FILE)) == 0 )
-			  /* The Kallsyms file is not a real file.  op_get_mtime() may
-			   * return different values for each call.
-			   */
-				mtime = 0;
-			else
-				mtime = op_get_mtime(binary);
-		} else {
-			mtime = 0;
-		}
+out:
+	operf_sfile_put(sf);
+	if (sf != last)
+		operf_sfile_put(last);
+	free(mangled);
+	return err;
+}
+
+
+int operf_write_sample_file(struct operf_sfile * last, struct operf_sfile * sf,
+                            int counter, int cg, odb_update_t * updates,
+                            size_t nr)
+{
+	char * mangled;
+	odb_node_nr_t size_hint;
+	odb_t file;
+	int err;
+
+	mangled = mangle_filename(last, sf, counter, cg);
+
+	if (!mangled)
+		return EINVAL;
+
+	cverb << vsfile << "Writing " << dec << nr << " keys to \""
+	      << mangled << "\"" << endl;
+
+	err = create_path(mangled);
+	if (err) {
+		cerr << "operf: create path for " << mangled << " failed: " << strerror(err) << endl;
+		goto out;
 	}
 
-	if (last && last->is_anon)
-		last_start = last->start_addr;
+	/* a new file is created with room for all the keys at once */
+	size_hint = previous_session_size(mangled);
+	if (size_hint < nr)
+		size_hint = nr;
 
-	fill_header((struct opd_header *)odb_get_data(file), counter,
-		    sf->is_anon ? sf->start_addr : 0, last_start,
-		    !!sf->kernel, last ? !!last->kernel : 0, mtime);
+	/* Closed right away, it doesn't count against the sample file budget. */
+	odb_init(&file);
+	do {
+		operf_sfile_lock_odb();
+		err = odb_open_hint(&file, mangled, ODB_RDWR,
+		                    sizeof(struct opd_header), size_hint);
+		operf_sfile_unlock_odb();
+	} while (err == EINTR);
+
+	if (err) {
+		cerr << "operf: open of " << mangled << " failed: " << strerror(err) << endl;
+		goto out;
+	}
+
+	setup_header(&file, last, sf, counter);
+	err = odb_update_nodes(&file, updates, nr);
+	if (err)
+		cerr << "operf: update of " << mangled << " failed" << endl;
+
+	operf_sfile_lock_odb();
+	odb_close(&file);
+	operf_sfile_unlock_odb();
 
 out:
-	operf_sfile_put(sf);
-	if (sf != last)
-		operf_sfile_put(last);
 	free(mangled);
 	return err;
 }
@@ -32,5 +32,19 @@ struct operf_sfile;
 int operf_open_sample_file(odb_t *file, struct operf_sfile *last,
                          struct operf_sfile * sf, int counter, int cg);
 
+/*
+ * operf_write_sample_file - add counts to a sample file
+ * @param updates  the keys and counts to add, used as scratch space
+ * @param nr  number of updates
+ *
+ * The other parameters are as for operf_open_sample_file. The sample
+ * file is opened, updated with odb_update_nodes() then closed again.
+ *
+ * Returns 0 on success.
+ */
+int operf_write_sample_file(struct operf_sfile * last, struct operf_sfile * sf,
+                            int counter, int cg, odb_update_t * updates,
+                            size_t nr);
+
 
 #endif /* OPERF_MANGLING_H_ */
@@ -32,7 +32,8 @@ using namespace OP_perf_utils;
 operf_process_info::operf_process_info(pid_t tgid, const char * appname,
                                        bool app_arg_is_fullname, bool is_valid)
 : pid(tgid), valid(is_valid), appname_valid(false), look_for_appname_match(false),
-  forked(false), appname_is_fullname(NOT_FULLNAME), num_app_chars_matched(-1)
+  forked(false), appname_is_fullname(NOT_FULLNAME), num_app_chars_matched(-1),
+  intervals_valid(false), intervals_overlap(false)
 {
 	_appname = "";
 	set_appname(appname, app_arg_is_fullname);
@@ -217,16 +218,87 @@ void operf_process_info::find_best_match_appname_all_mappings(void)
 
 }
 
+void operf_process_info::build_intervals(void)
+{
+	map<u64, struct operf_mmap *>::iterator it;
+
+	intervals[0].clear();
+	intervals[1].clear();
+	intervals_overlap = false;
+	for (it = mmappings.begin(); it != mmappings.end(); it++) {
+		vector<struct mapping_interval> & v = intervals[it->second->is_hypervisor];
+		struct mapping_interval interval;
+		interval.start_addr = it->second->start_addr;
+		interval.max_end_addr = it->second->end_addr;
+		interval.mapping = it->second;
+		if (!v.empty()) {
+			if (v.back().max_end_addr >= interval.start_addr)
+				intervals_overlap = true;
+			if (v.back().max_end_addr > interval.max_end_addr)
+				interval.max_end_addr = v.back().max_end_addr;
+		}
+		v.push_back(interval);
+	}
+	for (int i = 0; i < NR_RECENT_HITS; i++)
+		recent_hits[i] = NULL;
+	intervals_valid = true;
+}
+
 const struct operf_mmap * operf_process_info::find_mapping_for_sample(u64 sample_addr, bool hypervisor_sample)
 {
-	map<u64, struct operf_mmap *>::iterator it = mmappings.begin();
-	while (it != mmappings.end()) {
-		if (sample_addr >= it->second->start_addr && sample_addr <= it->second->end_addr &&
-				it->second->is_hypervisor == hypervisor_sample)
-			return it->second;
-		it++;
+	vector<struct mapping_interval> const & v = intervals[hypervisor_sample];
+	struct operf_mmap * found;
+	size_t lo, hi;
+
+	if (!intervals_valid)
+		build_intervals();
+
+	if (!intervals_overlap) {
+		for (int i = 0; i < NR_RECENT_HITS && recent_hits[i]; i++) {
+			found = recent_hits[i];
+			if (sample_addr >= found->start_addr && sample_addr <= found->end_addr &&
+			    found->is_hypervisor == hypervisor_sample) {
+				for (; i > 0; i--)
+					recent_hits[i] = recent_hits[i - 1];
+				recent_hits[0] = found;
+				return found;
+			}
+		}
+	}
+
+	// hi = number of mappings starting at or below sample_addr
+	lo = 0;
+	hi = v.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (v[mid].start_addr <= sample_addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!hi || v[hi - 1].max_end_addr < sample_addr)
+		return NULL;
+
+	/* The first of those containing sample_addr is the one where
+	 * max_end_addr reaches sample_addr.
+	 */
+	lo = 0;
+	hi--;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (v[mid].max_end_addr >= sample_addr)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	found = v[lo].mapping;
+
+	if (!intervals_overlap) {
+		for (int i = NR_RECENT_HITS - 1; i > 0; i--)
+			recent_hits[i] = recent_hits[i - 1];
+		recent_hits[0] = found;
 	}
-	return NULL;
+	return found;
 }
 
 /**
@@ -270,6 +342,7 @@ void operf_process_info::process_hypervisor_mapping(u64 ip)
 				if (curr_end <= ip)
 					_mmap->end_addr = ip;
 			}
+			mappings_changed_recursive();
 			break;
 		}
 		it++;
@@ -372,6 +445,7 @@ void operf_process_info::try_disassociate_from_parent(char * app_shortname)
 		if (mmappings_from_parent[cur->start_addr]) {
 			mmappings_from_parent[cur->start_addr] = false;
 			mmappings.erase(it++);
+			mappings_changed();
 		} else {
 			process_mapping(cur, false);
 			it++;
@@ -384,6 +458,18 @@ void operf_process_info::try_disassociate_from_parent(char * app_shortname)
 	forked = false;
 }
 
+
+void operf_process_info::mappings_changed_recursive(void)
+{
+	mappings_changed();
+	std::vector<operf_process_info *>::iterator it = forked_processes.begin();
+	while (it != forked_processes.end()) {
+		(*it)->mappings_changed_recursive();
+		it++;
+	}
+}
+
+
 /* This function adds a new mapping to the current operf_process_info
  * and then calls the same function on each of its forked children.
  * If do_self==true, it means this function is being called by a parent
@@ -408,6 +494,7 @@ void operf_process_info::set_new_mapping_recursive(struct operf_mmap * mapping,
 		mmappings_from_parent[mapping->start_addr] = false;
 	}
 	mmappings[mapping->start_addr] = mapping;
+	mappings_changed();
 	std::vector<operf_process_info *>::iterator it = forked_processes.begin();
 	while (it != forked_processes.end()) {
 		operf_process_info * fp = *it;
@@ -15,6 +15,7 @@
 #define OPERF_PROCESS_INFO_H_
 
 #include <map>
+#include <vector>
 #include <limits.h>
 #include "op_types.h"
 #include "cverb.h"
@@ -101,6 +102,30 @@ private:
 	 */
 	std::vector<operf_process_info *> forked_processes;
 	operf_process_info * parent_of_fork;
+	/* find_mapping_for_sample() is the slow path for most samples, so it
+	 * uses a sorted copy of mmappings, split into normal and hypervisor
+	 * mappings, which is rebuilt on the next lookup after mmappings (or a
+	 * mapping's address range) changes.  To return the same mapping as a
+	 * walk of mmappings when mappings overlap, each entry also records the
+	 * highest end address up to and including it.  When no mappings overlap,
+	 * a few recent hits are checked before searching.
+	 */
+	struct mapping_interval {
+		u64 start_addr;
+		u64 max_end_addr;
+		struct operf_mmap * mapping;
+	};
+	enum { NR_RECENT_HITS = 4 };
+	std::vector<struct mapping_interval> intervals[2];
+	bool intervals_valid;
+	bool intervals_overlap;
+	struct operf_mmap * recent_hits[NR_RECENT_HITS];
+	void mappings_changed(void) { intervals_valid = false; }
+	/* A mapping we share with our forked processes changed its bounds,
+	 * so their intervals are stale too.
+	 */
+	void mappings_changed_recursive(void);
+	void build_intervals(void);
 	void set_new_mapping_recursive(struct operf_mmap * mapping, bool do_self);
 	int get_num_matching_chars(std::string mapped_filename, std::string & basename);
 	void find_best_match_appname_all_mappings(void);
@@ -0,0 +1,63 @@
+/**
+ * @file libperf_events/operf_ring_pacer.cpp
+ * Choose when the perf_events ring buffers are drained next from the
+ * rate they fill up at.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include "operf_ring_pacer.h"
+
+/** past this many milliseconds, leave it to the kernel to wake us up */
+#define MAX_TIMEOUT 1000
+
+
+operf_ring_pacer::operf_ring_pacer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &last_pass);
+}
+
+
+void operf_ring_pacer::drained(size_t ring, size_t size, u64 bytes)
+{
+	if (ring >= rings.size()) {
+		struct ring_rate unused = { 0, 0, 0.0 };
+		rings.resize(ring + 1, unused);
+	}
+	rings[ring].size = size;
+	rings[ring].bytes += bytes;
+}
+
+
+int operf_ring_pacer::pass_done(int max_timeout)
+{
+	struct timespec now;
+	double elapsed;
+	double timeout = MAX_TIMEOUT;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - last_pass.tv_sec) * 1000.0 +
+		(now.tv_nsec - last_pass.tv_nsec) / 1000000.0;
+	last_pass = now;
+	if (elapsed < 0.001)
+		elapsed = 0.001;
+
+	for (size_t i = 0; i < rings.size(); ++i) {
+		struct ring_rate & ring = rings[i];
+		/* a moving average, so that one burst doesn't keep us
+		 * polling for long */
+		ring.rate = (3 * ring.rate + ring.bytes / elapsed) / 4;
+		ring.bytes = 0;
+		if (ring.rate > 0 && ring.size / 4 / ring.rate < timeout)
+			timeout = ring.size / 4 / ring.rate;
+	}
+
+	if (max_timeout >= 0 && timeout > max_timeout)
+		return max_timeout;
+	if (timeout >= MAX_TIMEOUT)
+		return -1;
+	return timeout < 1 ? 1 : (int)timeout;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file libperf_events/operf_ring_pacer.h
+ * Choose when the perf_events ring buffers are drained next from the
+ * rate they fill up at.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_RING_PACER_H_
+#define OPERF_RING_PACER_H_
+
+#include <time.h>
+#include <vector>
+#include "op_types.h"
+
+/**
+ * The kernel wakes up the reader of a ring once it's half full, its
+ * wakeup watermark can't be changed once the ring is set up. On an idle
+ * cpu that's rare, which is what we want, but a busy ring can overflow
+ * before the reader gets to it. So the reader also wakes up by itself in
+ * time to drain the busiest ring when it's about a quarter full, from the
+ * rate each ring filled up at during the last passes over them.
+ */
+class operf_ring_pacer {
+public:
+	operf_ring_pacer(void);
+
+	/// account for the bytes just drained from ring, whose size is size
+	void drained(size_t ring, size_t size, u64 bytes);
+
+	/**
+	 * Call after each pass over the rings. Return the poll() timeout
+	 * to use before the next pass, -1 if no ring is busy. The timeout
+	 * is at most max_timeout, unless that is -1.
+	 */
+	int pass_done(int max_timeout);
+
+private:
+	struct ring_rate {
+		size_t size;
+		/// bytes drained since the last pass
+		u64 bytes;
+		/// average bytes per millisecond
+		double rate;
+	};
+
+	std::vector<ring_rate> rings;
+	struct timespec last_pass;
+};
+
+#endif /* OPERF_RING_PACER_H_ */
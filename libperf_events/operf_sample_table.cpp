@@ -0,0 +1,180 @@
+/**
+ * @file libperf_events/operf_sample_table.cpp
+ * Sample counts aggregated in memory before they are written to
+ * the sample files, for operf --write-behind.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "operf_sample_table.h"
+#include "op_libiberty.h"
+
+/** the size of the chunks blocks are carved from */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+/** the size of a new table */
+#define MIN_ORDER 4
+
+struct operf_arena_chunk {
+	struct operf_arena_chunk * next;
+	/* keep the blocks following it aligned like odb_update_t */
+	odb_update_t data[0];
+};
+
+
+void operf_arena_init(struct operf_arena * arena)
+{
+	memset(arena, '\0', sizeof(struct operf_arena));
+}
+
+
+void operf_arena_reset(struct operf_arena * arena)
+{
+	while (arena->chunks) {
+		struct operf_arena_chunk * next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+	operf_arena_init(arena);
+}
+
+
+static struct operf_arena_chunk *
+new_chunk(struct operf_arena * arena, size_t size)
+{
+	struct operf_arena_chunk * chunk;
+
+	chunk = (operf_arena_chunk *)xmalloc(sizeof(struct operf_arena_chunk) + size);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk;
+}
+
+
+static odb_update_t * arena_alloc(struct operf_arena * arena, unsigned int order)
+{
+	size_t size = sizeof(odb_update_t) << order;
+	void * block;
+
+	arena->used += size;
+
+	if (arena->free_list[order]) {
+		block = arena->free_list[order];
+		arena->free_list[order] = *(void **)block;
+	} else if (size > ARENA_CHUNK_SIZE / 4) {
+		/* large tables are rare, don't waste a chunk on them */
+		block = new_chunk(arena, size)->data;
+	} else {
+		if ((size_t)(arena->end - arena->pos) < size) {
+			arena->pos = (char *)new_chunk(arena, ARENA_CHUNK_SIZE)->data;
+			arena->end = arena->pos + ARENA_CHUNK_SIZE;
+		}
+		block = arena->pos;
+		arena->pos += size;
+	}
+
+	memset(block, '\0', size);
+	return (odb_update_t *)block;
+}
+
+
+static void arena_free(struct operf_arena * arena, odb_update_t * block,
+                       unsigned int order)
+{
+	arena->used -= sizeof(odb_update_t) << order;
+	*(void **)block = arena->free_list[order];
+	arena->free_list[order] = block;
+}
+
+
+static inline odb_update_t *
+find_slot(odb_update_t * slots, unsigned int order, odb_key_t key)
+{
+	size_t mask = ((size_t)1 << order) - 1;
+	size_t pos = (key * 0x9e3779b97f4a7c15ULL) >> (64 - order);
+
+	while (slots[pos].offset && slots[pos].key != key)
+		pos = (pos + 1) & mask;
+
+	return &slots[pos];
+}
+
+
+static void grow(struct operf_sample_table * table, struct operf_arena * arena)
+{
+	unsigned int order = table->order ? table->order + 1 : MIN_ORDER;
+	odb_update_t * slots = arena_alloc(arena, order);
+	size_t i;
+
+	for (i = 0; table->order && i < ((size_t)1 << table->order); ++i) {
+		if (table->slots[i].offset)
+			*find_slot(slots, order, table->slots[i].key) = table->slots[i];
+	}
+
+	if (table->slots)
+		arena_free(arena, table->slots, table->order);
+	table->slots = slots;
+	table->order = order;
+}
+
+
+bool operf_sample_table_add(struct operf_sample_table * table,
+                            struct operf_arena * arena,
+                            odb_key_t key, odb_value_t count)
+{
+	odb_update_t * slot;
+
+	if (!count)
+		return true;
+
+	if (!table->order || (table->nr_used + 1) * 2 > (1U << table->order))
+		grow(table, arena);
+
+	slot = find_slot(table->slots, table->order, key);
+	if (!slot->offset) {
+		slot->key = key;
+		table->nr_used++;
+	} else if (slot->offset + count < slot->offset) {
+		return false;
+	}
+	slot->offset += count;
+
+	return true;
+}
+
+
+size_t operf_sample_table_compact(struct operf_sample_table * table)
+{
+	size_t nr = 0;
+	size_t i;
+
+	for (i = 0; table->order && i < ((size_t)1 << table->order); ++i) {
+		if (table->slots[i].offset)
+			table->slots[nr++] = table->slots[i];
+	}
+
+	return nr;
+}
+
+
+void operf_sample_table_clear(struct operf_sample_table * table)
+{
+	if (table->slots)
+		memset(table->slots, '\0', sizeof(odb_update_t) << table->order);
+	table->nr_used = 0;
+	table->nr_records = 0;
+	table->nr_kernel = 0;
+}
+
+
+void operf_sample_table_release(struct operf_sample_table * table,
+                                struct operf_arena * arena)
+{
+	if (table->slots)
+		arena_free(arena, table->slots, table->order);
+	operf_sample_table_init(table);
+}
@@ -0,0 +1,93 @@
+/**
+ * @file libperf_events/operf_sample_table.h
+ * Sample counts aggregated in memory before they are written to
+ * the sample files, for operf --write-behind.
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 15, 2026
+ */
+
+#ifndef OPERF_SAMPLE_TABLE_H_
+#define OPERF_SAMPLE_TABLE_H_
+
+#include <stddef.h>
+#include "odb.h"
+
+/** blocks are 1 << order odb_update_t, up to this order */
+#define OPERF_ARENA_MAX_ORDER 32
+
+struct operf_arena_chunk;
+
+/**
+ * The memory of all the operf_sample_table of a converter thread.
+ * Blocks are carved from large chunks and a block given back is kept on
+ * a free list for its size, so growing tables recycle each other's
+ * blocks. operf_arena_reset() frees everything at once, which is what a
+ * checkpoint does once all tables are written.
+ */
+struct operf_arena {
+	struct operf_arena_chunk * chunks;
+	char * pos;
+	char * end;
+	void * free_list[OPERF_ARENA_MAX_ORDER];
+	/** bytes of the blocks in use */
+	size_t used;
+};
+
+void operf_arena_init(struct operf_arena * arena);
+
+/** free all blocks, any table using them must be initialized again */
+void operf_arena_reset(struct operf_arena * arena);
+
+/**
+ * The sample counts of one sample file not written yet: an open
+ * addressing hash table of odb_update_t, at most half full, where a zero
+ * offset marks a free slot.
+ */
+struct operf_sample_table {
+	odb_update_t * slots;
+	/** there are 1 << order slots, slots is NULL if order is zero */
+	unsigned int order;
+	unsigned int nr_used;
+	/**
+	 * the records the counts add up, and how many of them are kernel
+	 * samples, for the statistics if the table can't be written. The
+	 * caller keeps them, clearing the table resets them.
+	 */
+	unsigned long nr_records;
+	unsigned long nr_kernel;
+};
+
+static inline void operf_sample_table_init(struct operf_sample_table * table)
+{
+	table->slots = NULL;
+	table->order = 0;
+	table->nr_used = 0;
+	table->nr_records = 0;
+	table->nr_kernel = 0;
+}
+
+/**
+ * Add count to the count of key. Return false, doing nothing, if that
+ * count would wrap: the table must be written and cleared first.
+ */
+bool operf_sample_table_add(struct operf_sample_table * table,
+                            struct operf_arena * arena,
+                            odb_key_t key, odb_value_t count);
+
+/**
+ * Move the used slots to the start of table->slots and return their
+ * number. The table must be cleared or released before it's used again.
+ */
+size_t operf_sample_table_compact(struct operf_sample_table * table);
+
+/** empty the table, keeping its slots */
+void operf_sample_table_clear(struct operf_sample_table * table);
+
+/** empty the table and give its slots back to arena */
+void operf_sample_table_release(struct operf_sample_table * table,
+                                struct operf_arena * arena);
+
+#endif /* OPERF_SAMPLE_TABLE_H_ */
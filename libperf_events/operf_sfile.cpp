@@ -14,6 +14,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <iostream>
 #include <sstream>
 
@@ -25,15 +28,81 @@
 #include "operf_mangling.h"
 #include "operf_stats.h"
 #include "op_libiberty.h"
+#include "op_fileio.h"
 
 #define HASH_SIZE 2048
 #define HASH_BITS (HASH_SIZE - 1)
 
-/** All sfiles are hashed into these lists */
-static struct list_head hashes[HASH_SIZE];
+/** the combiner has 1 << COMBINER_ORDER entries */
+#define COMBINER_ORDER 8
 
-/** All sfiles are on this list. */
-static LIST_HEAD(lru_list);
+/**
+ * A count for key in the sample file of event for current, or in its
+ * arcs file to last if is_cg. last is also given for a sample, it goes
+ * in the header of a new sample file.
+ */
+struct operf_count {
+	struct operf_sfile * current;
+	struct operf_sfile * last;
+	odb_key_t key;
+	odb_value_t count;
+	/** the records count adds up, and how many are kernel samples */
+	unsigned long nr_records;
+	unsigned long nr_kernel;
+	short event;
+	short is_cg;
+};
+
+/**
+ * The sfiles of one converter thread.  The conversion process uses
+ * default_table; each converter worker thread (see operf_convert_worker)
+ * has its own, so that sfiles are never shared between threads.
+ */
+struct operf_sfile_table {
+	/** All sfiles are hashed into these lists */
+	struct list_head hashes[HASH_SIZE];
+	/** All sfiles are on this list. */
+	struct list_head lru_list;
+	/** where the statistics for samples logged through this table go */
+	unsigned long * stats;
+	/** the memory of the operf_sfile pending tables, see --write-behind */
+	struct operf_arena arena;
+	/** when to write the pending tables next, zero if not known yet */
+	time_t next_checkpoint;
+	/** counts logged to the pending tables */
+	unsigned long nr_pending;
+	/** sample files mapped, and those of them with a file descriptor */
+	unsigned long nr_mapped;
+	unsigned long nr_fds;
+	/** if non zero, lower than max_fds after running out of descriptors */
+	unsigned long max_fds;
+	unsigned long budget_stats[OPERF_SFILE_MAX_BUDGET_STATS];
+	/** the id of the next sfile created */
+	unsigned long next_id;
+	/**
+	 * Hot loops log the same sample or arc over and over, the
+	 * combiner adds them up before they go to the sample files. It's
+	 * direct mapped, an entry whose count is zero is free.
+	 */
+	struct operf_count combiner[1 << COMBINER_ORDER];
+};
+
+static struct operf_sfile_table default_table;
+static __thread struct operf_sfile_table * sfiles = &default_table;
+
+/** libodb keeps a process wide list of open sample files */
+static pthread_mutex_t odb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** the budget of each table, see operf_sfile_set_budget() */
+static unsigned long max_fds;
+static unsigned long max_mapped;
+/** descriptors left to the rest of operf, and the smallest budget */
+#define RESERVED_FDS 64
+#define MIN_BUDGET 16
+/** the number of least recently used sfiles eviction chooses from */
+#define EVICT_WINDOW 8
+
+unsigned long operf_sfile_budget_stats[OPERF_SFILE_MAX_BUDGET_STATS];
 
 
 static unsigned long
@@ -119,14 +188,49 @@ do_match(struct operf_sfile const * sf, struct operf_kernel_image const * ki,
 
 }
 
-int
-operf_sfile_equal(struct operf_sfile const * sf, struct operf_sfile const * sf2)
+
+static void init_cg_table(struct operf_cg_table * table)
+{
+	table->slots = NULL;
+	table->order = 0;
+	table->nr_used = 0;
+}
+
+
+static size_t cg_table_size(struct operf_cg_table const * table)
+{
+	return table->order ? (size_t)1 << table->order : 0;
+}
+
+
+static struct operf_cg_slot *
+find_cg_slot(struct operf_cg_table * table, unsigned long id)
 {
-	return do_match(sf, sf2->kernel,
-	                sf2->is_anon,
-	                sf2->image_name, sf2->image_len,
-	                sf2->app_filename, sf2->app_len,
-	                sf2->tgid, sf2->tid, sf2->cpu);
+	size_t mask = cg_table_size(table) - 1;
+	size_t pos = ((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> (64 - table->order);
+
+	while (table->slots[pos].entry && table->slots[pos].id != id)
+		pos = (pos + 1) & mask;
+
+	return &table->slots[pos];
+}
+
+
+/* move the entries of table to 1 << order new slots */
+static void resize_cg_table(struct operf_cg_table * table, unsigned int order)
+{
+	struct operf_cg_slot * old_slots = table->slots;
+	size_t old_size = cg_table_size(table);
+	size_t i;
+
+	table->slots = (operf_cg_slot *)xcalloc((size_t)1 << order,
+	                                        sizeof(struct operf_cg_slot));
+	table->order = order;
+	for (i = 0; i < old_size; ++i) {
+		if (old_slots[i].entry)
+			*find_cg_slot(table, old_slots[i].id) = old_slots[i];
+	}
+	free(old_slots);
 }
 
 
@@ -141,6 +245,7 @@ create_sfile(unsigned long hash, struct operf_transient const * trans,
 	sf = (operf_sfile *)xmalloc(sizeof(struct operf_sfile));
 
 	sf->hashval = hash;
+	sf->id = sfiles->next_id++;
 	sf->tid = trans->tid;
 	sf->tgid = trans->tgid;
 	sf->cpu = 0;
@@ -152,9 +257,17 @@ create_sfile(unsigned long hash, struct operf_transient const * trans,
 	sf->is_anon = trans->is_anon;
 	sf->start_addr = trans->start_addr;
 	sf->end_addr = trans->end_addr;
-
-	for (i = 0 ; i < op_nr_events ; ++i)
+	sf->evicted = false;
+	/* trans->app_filename is overwritten by the next sample, and the
+	 * sample files are opened later, once counts leave the combiner,
+	 * after an eviction or with --write-behind */
+	sf->image_name = op_xstrndup(sf->image_name, sf->image_len);
+	sf->app_filename = op_xstrndup(sf->app_filename, sf->app_len);
+
+	for (i = 0 ; i < op_nr_events ; ++i) {
 		odb_init(&sf->files[i]);
+		operf_sample_table_init(&sf->pending[i]);
+	}
 
 	// TODO:  handle extended
 	/*
@@ -164,8 +277,7 @@ create_sfile(unsigned long hash, struct operf_transient const * trans,
 		*/
 	sf->ext_files = NULL;
 
-	for (i = 0; i < CG_HASH_SIZE; ++i)
-		list_init(&sf->cg_hash[i]);
+	init_cg_table(&sf->cg);
 
 	if (operf_options::separate_cpu)
 		sf->cpu = trans->cpu;
@@ -193,13 +305,13 @@ struct operf_sfile * operf_sfile_find(struct operf_transient const * trans)
 				message << "Lost kernel sample " << std::hex << trans->pc << std::endl;;
 				cout << message.str();
 			}
-			operf_stats[OPERF_LOST_KERNEL]++;
+			sfiles->stats[OPERF_LOST_KERNEL]++;
 			return NULL;
 		}
 	}
 
 	hash = sfile_hash(trans, ki);
-	list_for_each(pos, &hashes[hash]) {
+	list_for_each(pos, &sfiles->hashes[hash]) {
 		sf = list_entry(pos, struct operf_sfile, hash);
 		if (do_match(sf, ki,
 		             trans->is_anon,
@@ -211,7 +323,7 @@ struct operf_sfile * operf_sfile_find(struct operf_transient const * trans)
 		}
 	}
 	sf = create_sfile(hash, trans, ki);
-	list_add(&sf->hash, &hashes[hash]);
+	list_add(&sf->hash, &sfiles->hashes[hash]);
 
 
 lru:
@@ -225,27 +337,211 @@ void operf_sfile_dup(struct operf_sfile * to, struct operf_sfile * from)
 	size_t i;
 
 	memcpy(to, from, sizeof (struct operf_sfile));
+	to->image_name = op_xstrndup(from->image_name, from->image_len);
+	to->app_filename = op_xstrndup(from->app_filename, from->app_len);
 
-	for (i = 0 ; i < op_nr_events ; ++i)
+	for (i = 0 ; i < op_nr_events ; ++i) {
 		odb_init(&to->files[i]);
+		operf_sample_table_init(&to->pending[i]);
+	}
 
 	// TODO: handle extended
 	//opd_ext_operf_sfile_dup(to, from);
 
-	for (i = 0; i < CG_HASH_SIZE; ++i)
-		list_init(&to->cg_hash[i]);
+	init_cg_table(&to->cg);
 
 	list_init(&to->hash);
 	list_init(&to->lru);
 }
 
-static odb_t * get_file(struct operf_transient const * trans, int is_cg)
+/* the sfile holding the files for c: c->current for a sample, the cg
+ * entry of c->current for c->last for an arc */
+static struct operf_sfile * get_owner(struct operf_count const * c)
+{
+	struct operf_sfile * sf = c->current;
+	struct operf_sfile * last = c->last;
+	struct operf_cg_slot * slot;
+
+	if (c->event >= (int)op_nr_events) {
+		fprintf(stderr, "%s: Invalid counter %d\n", __FUNCTION__,
+			c->event);
+		abort();
+	}
+
+	if (!c->is_cg)
+		return sf;
+
+	/* Need to look for the right 'to'. An sfile equal to 'last' is
+	 * 'last', so its id is enough.
+	 */
+	if ((sf->cg.nr_used + 1) * 2 > cg_table_size(&sf->cg))
+		resize_cg_table(&sf->cg, sf->cg.order ? sf->cg.order + 1 : 2);
+
+	slot = find_cg_slot(&sf->cg, last->id);
+	if (!slot->entry) {
+		slot->id = last->id;
+		slot->entry = (operf_cg_entry *)xmalloc(sizeof(struct operf_cg_entry));
+		operf_sfile_dup(&slot->entry->to, last);
+		sf->cg.nr_used++;
+	}
+
+	return &slot->entry->to;
+}
+
+
+typedef void (*operf_file_func)(odb_t * file, void * data);
+
+/* call func for the sample files of sf and of its callgraph entries */
+static void
+for_each_file(struct operf_sfile * sf, operf_file_func func, void * data)
+{
+	size_t i, j;
+
+	for (i = 0; i < op_nr_events; ++i)
+		func(&sf->files[i], data);
+
+	for (i = 0; i < cg_table_size(&sf->cg); ++i) {
+		struct operf_cg_entry * cg = sf->cg.slots[i].entry;
+		if (!cg)
+			continue;
+		for (j = 0; j < op_nr_events; ++j)
+			func(&cg->to.files[j], data);
+	}
+}
+
+
+/* The counts are per odb_t opened by the table. A file opened by two
+ * tables shares its mapping and descriptor so they can be a bit off then.
+ */
+static void close_file(odb_t * file)
+{
+	if (odb_open_count(file)) {
+		sfiles->nr_mapped--;
+		if (odb_has_fd(file) && sfiles->nr_fds)
+			sfiles->nr_fds--;
+	}
+	odb_close(file);
+}
+
+
+static void close_one_file(odb_t * file, void * data __attribute__((unused)))
+{
+	close_file(file);
+}
+
+
+static void release_fd(odb_t * file, void * data __attribute__((unused)))
+{
+	if (odb_release_fd(file)) {
+		sfiles->nr_fds--;
+		sfiles->budget_stats[OPERF_SFILE_FD_RELEASES]++;
+	}
+}
+
+
+static void add_mapped_size(odb_t * file, void * size)
+{
+	*(size_t *)size += odb_get_mapped_size(file);
+}
+
+
+static bool in_use(struct operf_sfile const * sf, struct operf_count const * c)
+{
+	return sf == c->current || sf == c->last;
+}
+
+
+/* Close the descriptors of the least recently used sample files until
+ * at most nr_fds are left. The files stay mapped so this is cheap, a
+ * descriptor is only needed again to grow the file.
+ */
+static void release_fds(struct operf_count const * c, unsigned long nr_fds)
 {
-	struct operf_sfile * sf = trans->current;
-	struct operf_sfile * last = trans->last;
-	struct operf_cg_entry * cg;
 	struct list_head * pos;
-	unsigned long hash;
+
+	list_for_each(pos, &sfiles->lru_list) {
+		struct operf_sfile * sf = list_entry(pos, struct operf_sfile, lru);
+		if (sfiles->nr_fds <= nr_fds)
+			break;
+		if (!in_use(sf, c))
+			for_each_file(sf, release_fd, NULL);
+	}
+}
+
+
+/* Close the sample files of one of the least recently used sfiles, the
+ * one with the smallest files: they are the cheapest to map again if
+ * it's used later, and closing any file counts the same against the
+ * budget. return false if there was nothing to close.
+ */
+static bool evict_sfile(struct operf_count const * c)
+{
+	struct operf_sfile * victim = NULL;
+	size_t victim_size = 0;
+	struct list_head * pos;
+	int nr_candidates = 0;
+
+	list_for_each(pos, &sfiles->lru_list) {
+		struct operf_sfile * sf = list_entry(pos, struct operf_sfile, lru);
+		size_t size;
+		if (in_use(sf, c))
+			continue;
+		size = 0;
+		for_each_file(sf, add_mapped_size, &size);
+		if (!size)
+			continue;
+		if (!victim || size < victim_size) {
+			victim = sf;
+			victim_size = size;
+		}
+		if (++nr_candidates == EVICT_WINDOW)
+			break;
+	}
+
+	if (!victim)
+		return false;
+
+	operf_sfile_lock_odb();
+	for_each_file(victim, close_one_file, NULL);
+	operf_sfile_unlock_odb();
+	victim->evicted = true;
+	sfiles->budget_stats[OPERF_SFILE_EVICTIONS]++;
+	/* sfiles without open files would slow down the next evictions */
+	list_del(&victim->lru);
+	list_add_tail(&victim->lru, &sfiles->lru_list);
+
+	return true;
+}
+
+
+/* account for a sample file just opened for c, then enforce the budget */
+static void account_open(odb_t * file, struct operf_count const * c)
+{
+	unsigned long fd_budget;
+
+	sfiles->nr_mapped++;
+	if (odb_has_fd(file))
+		sfiles->nr_fds++;
+	if (c->current->evicted) {
+		sfiles->budget_stats[OPERF_SFILE_REOPENS]++;
+		c->current->evicted = false;
+	}
+
+	if (!max_mapped)
+		operf_sfile_share_budget(1);
+	fd_budget = sfiles->max_fds ? sfiles->max_fds : max_fds;
+
+	/* leave some room so that this isn't done for each open */
+	if (sfiles->nr_fds > fd_budget)
+		release_fds(c, fd_budget - fd_budget / 4);
+
+	while (sfiles->nr_mapped > max_mapped && evict_sfile(c))
+		;
+}
+
+
+static odb_t * get_file(struct operf_count const * c)
+{
 	odb_t * file;
 
 	// TODO: handle extended
@@ -254,44 +550,213 @@ static odb_t * get_file(struct operf_transient const * trans, int is_cg)
 		return opd_ext_operf_sfile_get(trans, is_cg);
 	 */
 
-	if (trans->event >= (int)op_nr_events) {
-		fprintf(stderr, "%s: Invalid counter %d\n", __FUNCTION__,
-			trans->event);
+	file = &get_owner(c)->files[c->event];
+
+	if (!odb_open_count(file)) {
+		operf_open_sample_file(file, c->last, c->current, c->event,
+		                       c->is_cg);
+		/* Error is logged by opd_open_sample_file */
+		if (!odb_open_count(file))
+			return NULL;
+		account_open(file, c);
+	}
+
+	return file;
+}
+
+
+/* count nr_records records whose counts add up to count as lost to a
+ * sample file open failure; samples were counted when they were logged */
+static void lost_samplefile(bool is_cg, unsigned long count,
+                            unsigned long nr_records, unsigned long nr_kernel)
+{
+	sfiles->stats[OPERF_LOST_SAMPLEFILE] += nr_records;
+	sfiles->budget_stats[OPERF_SFILE_LOST_COUNT] += count;
+	if (is_cg)
+		return;
+	sfiles->stats[OPERF_SAMPLES] -= nr_records;
+	sfiles->stats[OPERF_KERNEL] -= nr_kernel;
+	sfiles->stats[OPERF_PROCESS] -= nr_records - nr_kernel;
+}
+
+
+/* write the pending table of event for sf, or for its arcs to cg_to if
+ * it's not NULL, then clear it */
+static void write_pending_table(struct operf_sfile * sf,
+                                struct operf_sfile * cg_to, int event)
+{
+	struct operf_sfile * owner = cg_to ? cg_to : sf;
+	struct operf_sample_table * table = &owner->pending[event];
+	unsigned long count = 0;
+	size_t nr, i;
+
+	nr = operf_sample_table_compact(table);
+	if (!nr)
+		return;
+
+	if (operf_write_sample_file(owner, sf, event, !!cg_to,
+	                            table->slots, nr)) {
+		for (i = 0; i < nr; ++i)
+			count += table->slots[i].offset;
+		lost_samplefile(!!cg_to, count, table->nr_records,
+		                table->nr_kernel);
+	}
+
+	operf_sample_table_clear(table);
+}
+
+
+/* same as above for all events, the tables are released */
+static void write_pending(struct operf_sfile * sf, struct operf_sfile * cg_to)
+{
+	struct operf_sfile * owner = cg_to ? cg_to : sf;
+	size_t i;
+
+	for (i = 0; i < op_nr_events; ++i) {
+		write_pending_table(sf, cg_to, i);
+		operf_sample_table_release(&owner->pending[i], &sfiles->arena);
+	}
+}
+
+
+/* add c to the pending table of its file, instead of the file */
+static void log_pending(struct operf_count const * c)
+{
+	struct operf_sfile * owner = get_owner(c);
+	struct operf_sample_table * table = &owner->pending[c->event];
+
+	if (!operf_sample_table_add(table, &sfiles->arena, c->key, c->count)) {
+		write_pending_table(c->current, c->is_cg ? owner : NULL,
+		                    c->event);
+		operf_sample_table_add(table, &sfiles->arena, c->key, c->count);
+	}
+	table->nr_records += c->nr_records;
+	table->nr_kernel += c->nr_kernel;
+}
+
+
+/* write behind if it's time for a checkpoint */
+static void check_checkpoint(void)
+{
+	/* don't look at the time for each sample */
+	if (!operf_options::checkpoint_interval ||
+	    ++sfiles->nr_pending % 4096)
+		return;
+	if (!sfiles->next_checkpoint)
+		sfiles->next_checkpoint = time(NULL) + operf_options::checkpoint_interval;
+	else if (time(NULL) >= sfiles->next_checkpoint)
+		operf_sfile_checkpoint();
+}
+
+
+/* add c to its sample file, or to its pending table with --write-behind */
+static void log_count(struct operf_count const * c)
+{
+	odb_t * file;
+	int err;
+
+	if (operf_options::write_behind) {
+		log_pending(c);
+		return;
+	}
+
+	file = get_file(c);
+	if (!file) {
+		lost_samplefile(c->is_cg, c->count, c->nr_records, c->nr_kernel);
+		return;
+	}
+
+	err = odb_update_node_with_offset(file, c->key, c->count);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", __FUNCTION__, strerror(err));
 		abort();
 	}
+}
 
-	file = &sf->files[trans->event];
 
-	if (!is_cg)
-		goto open;
+static bool same_target(struct operf_count const * lhs,
+                        struct operf_count const * rhs)
+{
+	return lhs->key == rhs->key && lhs->current == rhs->current &&
+		lhs->event == rhs->event && lhs->is_cg == rhs->is_cg &&
+		(!lhs->is_cg || lhs->last == rhs->last);
+}
 
-	hash = last->hashval & (CG_HASH_SIZE - 1);
 
-	/* Need to look for the right 'to'. Since we're looking for
-	 * 'last', we use its hash.
-	 */
-	list_for_each(pos, &sf->cg_hash[hash]) {
-		cg = list_entry(pos, struct operf_cg_entry, hash);
-		if (operf_sfile_equal(last, &cg->to)) {
-			file = &cg->to.files[trans->event];
-			goto open;
-		}
+static struct operf_count * combiner_entry(struct operf_count const * c)
+{
+	uint64_t hash = c->key ^ ((uintptr_t)c->current >> 4) ^ c->event;
+
+	if (c->is_cg)
+		hash ^= (uintptr_t)c->last >> 2;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	return &sfiles->combiner[hash >> (64 - COMBINER_ORDER)];
+}
+
+
+/* add c to the combiner, logging the count it replaces if any */
+static void combine(struct operf_count const * c)
+{
+	struct operf_count * entry = combiner_entry(c);
+	struct operf_count old;
+
+	if (entry->count && same_target(entry, c) &&
+	    entry->count + c->count > entry->count) {
+		entry->count += c->count;
+		entry->nr_records += c->nr_records;
+		entry->nr_kernel += c->nr_kernel;
+		return;
 	}
 
-	cg = (operf_cg_entry *)xmalloc(sizeof(struct operf_cg_entry));
-	operf_sfile_dup(&cg->to, last);
-	list_add(&cg->hash, &sf->cg_hash[hash]);
-	file = &cg->to.files[trans->event];
+	old = *entry;
+	*entry = *c;
+	if (old.count)
+		log_count(&old);
 
-open:
-	if (!odb_open_count(file))
-		operf_open_sample_file(file, last, sf, trans->event, is_cg);
+	if (operf_options::write_behind)
+		check_checkpoint();
+}
 
-	/* Error is logged by opd_open_sample_file */
-	if (!odb_open_count(file))
-		return NULL;
 
-	return file;
+/* log all the counts of the combiner */
+static void flush_combiner(void)
+{
+	size_t i;
+
+	for (i = 0; i < (1 << COMBINER_ORDER); ++i) {
+		struct operf_count old = sfiles->combiner[i];
+		if (!old.count)
+			continue;
+		sfiles->combiner[i].count = 0;
+		log_count(&old);
+	}
+}
+
+
+void operf_sfile_checkpoint(void)
+{
+	struct list_head * pos;
+	size_t used;
+	size_t i;
+
+	flush_combiner();
+	used = sfiles->arena.used;
+
+	list_for_each(pos, &sfiles->lru_list) {
+		struct operf_sfile * sf = list_entry(pos, struct operf_sfile, lru);
+		write_pending(sf, NULL);
+		for (i = 0; i < cg_table_size(&sf->cg); ++i) {
+			struct operf_cg_entry * cg = sf->cg.slots[i].entry;
+			if (cg)
+				write_pending(sf, &cg->to);
+		}
+	}
+
+	operf_arena_reset(&sfiles->arena);
+	if (operf_options::checkpoint_interval)
+		sfiles->next_checkpoint = time(NULL) + operf_options::checkpoint_interval;
+	cverb << vsfile << "checkpoint wrote " << dec << used
+	      << " bytes of pending counts" << endl;
 }
 
 
@@ -330,13 +795,9 @@ verbose_arc(struct operf_transient const * trans, vma_t from, vma_t to)
 
 void  operf_sfile_log_arc(struct operf_transient const * trans)
 {
-	int err;
 	vma_t from = trans->pc;
 	vma_t to = trans->last_pc;
-	uint64_t key;
-	odb_t * file;
-
-	file = get_file(trans, 1);
+	struct operf_count c;
 
 	/* absolute value -> offset */
 	if (trans->current->kernel)
@@ -354,37 +815,31 @@ void  operf_sfile_log_arc(struct operf_transient const * trans)
 	if (cverb << varcs)
 		verbose_arc(trans, from, to);
 
-	if (!file) {
-		operf_stats[OPERF_LOST_SAMPLEFILE]++;
-		return;
-	}
-
 	/* Possible narrowings to 32-bit value only. */
-	key = to & (0xffffffff);
-	key |= ((uint64_t)from) << 32;
-
-	err = odb_update_node(file, key);
-	if (err) {
-		fprintf(stderr, "%s: %s\n", __FUNCTION__, strerror(err));
-		abort();
-	}
-
+	c.key = to & (0xffffffff);
+	c.key |= ((uint64_t)from) << 32;
+
+	c.current = trans->current;
+	c.last = trans->last;
+	c.count = trans->count;
+	c.nr_records = 1;
+	c.nr_kernel = 0;
+	c.event = trans->event;
+	c.is_cg = 1;
+	combine(&c);
 }
 
 void operf_sfile_log_sample(struct operf_transient const * trans)
 {
-	operf_sfile_log_sample_count(trans, 1);
+	operf_sfile_log_sample_count(trans, trans->count);
 }
 
 
 void operf_sfile_log_sample_count(struct operf_transient const * trans,
                             unsigned long int count)
 {
-	int err;
 	vma_t pc = trans->pc;
-	odb_t * file;
-
-	file = get_file(trans, 0);
+	struct operf_count c;
 
 	/* absolute value -> offset */
 	if (trans->current->kernel)
@@ -394,22 +849,24 @@ void operf_sfile_log_sample_count(struct operf_transient const * trans,
 
 	if (cverb << vsfile)
 		verbose_sample(trans, pc);
-	if (!file) {
-		operf_stats[OPERF_LOST_SAMPLEFILE]++;
-		return;
-	}
-	err = odb_update_node_with_offset(file,
-					  (odb_key_t)pc,
-					  count);
-	if (err) {
-		fprintf(stderr, "%s: %s\n", __FUNCTION__, strerror(err));
-		abort();
-	}
-	operf_stats[OPERF_SAMPLES]++;
+
+	c.current = trans->current;
+	c.last = trans->last;
+	c.key = (odb_key_t)pc;
+	c.count = count;
+	c.nr_records = 1;
+	c.nr_kernel = trans->in_kernel ? 1 : 0;
+	c.event = trans->event;
+	c.is_cg = 0;
+
+	/* taken back by lost_samplefile() if the sample file can't be
+	 * opened once the count leaves the combiner */
+	sfiles->stats[OPERF_SAMPLES]++;
 	if (trans->in_kernel)
-		operf_stats[OPERF_KERNEL]++;
+		sfiles->stats[OPERF_KERNEL]++;
 	else
-		operf_stats[OPERF_PROCESS]++;
+		sfiles->stats[OPERF_PROCESS]++;
+	combine(&c);
 }
 
 
@@ -418,8 +875,10 @@ static int close_sfile(struct operf_sfile * sf, void * data __attribute__((unuse
 	size_t i;
 
 	/* it's OK to close a non-open odb file */
+	operf_sfile_lock_odb();
 	for (i = 0; i < op_nr_events; ++i)
-		odb_close(&sf->files[i]);
+		close_file(&sf->files[i]);
+	operf_sfile_unlock_odb();
 
 	// TODO: handle extended
 	//opd_ext_operf_sfile_close(sf);
@@ -433,6 +892,9 @@ static void kill_sfile(struct operf_sfile * sf)
 	close_sfile(sf, NULL);
 	list_del(&sf->hash);
 	list_del(&sf->lru);
+	free((char *)sf->image_name);
+	free((char *)sf->app_filename);
+	free(sf->cg.slots);
 }
 
 
@@ -463,22 +925,26 @@ for_one_sfile(struct operf_sfile * sf, operf_sfile_func func, void * data)
 {
 	size_t i;
 	int free_sf = func(sf, data);
-
-	for (i = 0; i < CG_HASH_SIZE; ++i) {
-		struct list_head * pos;
-		struct list_head * pos2;
-		list_for_each_safe(pos, pos2, &sf->cg_hash[i]) {
-			struct operf_cg_entry * cg =
-				list_entry(pos, struct operf_cg_entry, hash);
-			if (free_sf || func(&cg->to, data)) {
-				kill_sfile(&cg->to);
-				list_del(&cg->hash);
-				free(cg);
-			}
+	bool removed = false;
+
+	for (i = 0; i < cg_table_size(&sf->cg); ++i) {
+		struct operf_cg_entry * cg = sf->cg.slots[i].entry;
+		if (cg && (free_sf || func(&cg->to, data))) {
+			write_pending(sf, &cg->to);
+			kill_sfile(&cg->to);
+			free(cg);
+			sf->cg.slots[i].entry = NULL;
+			sf->cg.nr_used--;
+			removed = true;
 		}
 	}
 
+	/* the probe sequences of the remaining entries may have gaps */
+	if (removed && !free_sf)
+		resize_cg_table(&sf->cg, sf->cg.order);
+
 	if (free_sf) {
+		write_pending(sf, NULL);
 		kill_sfile(sf);
 		free(sf);
 	}
@@ -490,7 +956,10 @@ static void for_each_sfile(operf_sfile_func func, void * data)
 	struct list_head * pos;
 	struct list_head * pos2;
 
-	list_for_each_safe(pos, pos2, &lru_list) {
+	/* the combiner may hold counts for any sfile */
+	flush_combiner();
+
+	list_for_each_safe(pos, pos2, &sfiles->lru_list) {
 		struct operf_sfile * sf = list_entry(pos, struct operf_sfile, lru);
 		for_one_sfile(sf, func, data);
 	}
@@ -515,44 +984,74 @@ static int _release_resources(struct operf_sfile *sf  __attribute__((unused)), v
 
 void operf_sfile_close_files(void)
 {
-	for_each_sfile(_release_resources, NULL);
-}
+	size_t i;
 
+	for_each_sfile(_release_resources, NULL);
+	operf_arena_reset(&sfiles->arena);
 
-static int always_true(struct operf_sfile * sf __attribute__((unused)), void * data __attribute__((unused)))
-{
-	return 1;
+	operf_sfile_lock_odb();
+	for (i = 0; i < OPERF_SFILE_MAX_BUDGET_STATS; ++i) {
+		operf_sfile_budget_stats[i] += sfiles->budget_stats[i];
+		sfiles->budget_stats[i] = 0;
+	}
+	operf_sfile_unlock_odb();
 }
 
 
-#define LRU_AMOUNT 256
-
-/*
- * Clear out older sfiles. Note the current sfiles we're using
- * will not be present in this list, due to operf_sfile_get/put() pairs
- * around the caller of this.
- */
-int operf_sfile_lru_clear(void)
+int operf_sfile_release_fds(void)
 {
+	unsigned long nr_fds = sfiles->nr_fds;
 	struct list_head * pos;
-	struct list_head * pos2;
-	int amount = LRU_AMOUNT;
 
-	if (list_empty(&lru_list))
-		return 1;
-
-	list_for_each_safe(pos, pos2, &lru_list) {
-		struct operf_sfile * sf;
-		if (!--amount)
-			break;
-		sf = list_entry(pos, struct operf_sfile, lru);
-		for_one_sfile(sf, (operf_sfile_func)always_true, NULL);
+	/* the sfiles being opened aren't on the list, see
+	 * operf_open_sample_file() */
+	list_for_each(pos, &sfiles->lru_list) {
+		struct operf_sfile * sf = list_entry(pos, struct operf_sfile, lru);
+		for_each_file(sf, release_fd, NULL);
 	}
 
+	if (nr_fds == sfiles->nr_fds)
+		return 1;
+
+	/* other descriptors use up what's left, don't get there again */
+	sfiles->max_fds = nr_fds / 2 > MIN_BUDGET ? nr_fds / 2 : MIN_BUDGET;
+	cverb << vsfile << "out of file descriptors, sample file budget now "
+	      << dec << sfiles->max_fds << endl;
 	return 0;
 }
 
 
+void operf_sfile_set_budget(unsigned long fds, unsigned long mapped)
+{
+	max_fds = fds > MIN_BUDGET ? fds : MIN_BUDGET;
+	max_mapped = mapped > MIN_BUDGET ? mapped : MIN_BUDGET;
+}
+
+
+void operf_sfile_share_budget(unsigned int nr_tables)
+{
+	struct rlimit rlim;
+	unsigned long fds = 1024;
+	unsigned long mapped;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY)
+		fds = rlim.rlim_cur;
+	fds = fds > RESERVED_FDS ? fds - RESERVED_FDS : 0;
+
+	/* each sample file is a mapping, leave half of them to the rest
+	 * of the process */
+	mapped = op_read_long_from_file("/proc/sys/vm/max_map_count", 0);
+	if (!mapped)
+		mapped = 65530;
+	mapped /= 2;
+
+	operf_sfile_set_budget(fds / nr_tables, mapped / nr_tables);
+	cverb << vsfile << "sample file budget of " << dec << nr_tables
+	      << " tables: " << max_fds << " descriptors, " << max_mapped
+	      << " mappings each" << endl;
+}
+
+
 void operf_sfile_get(struct operf_sfile * sf)
 {
 	if (sf)
@@ -563,14 +1062,70 @@ void operf_sfile_get(struct operf_sfile * sf)
 void operf_sfile_put(struct operf_sfile * sf)
 {
 	if (sf)
-		list_add_tail(&sf->lru, &lru_list);
+		list_add_tail(&sf->lru, &sfiles->lru_list);
 }
 
 
-void operf_sfile_init(void)
+static void init_table(struct operf_sfile_table * table, unsigned long * stats)
 {
 	size_t i = 0;
 
 	for (; i < HASH_SIZE; ++i)
-		list_init(&hashes[i]);
+		list_init(&table->hashes[i]);
+	list_init(&table->lru_list);
+	table->stats = stats;
+	operf_arena_init(&table->arena);
+	table->next_checkpoint = 0;
+	table->nr_pending = 0;
+	table->nr_mapped = 0;
+	table->nr_fds = 0;
+	table->max_fds = 0;
+	table->next_id = 1;
+	memset(table->budget_stats, '\0', sizeof(table->budget_stats));
+	memset(table->combiner, '\0', sizeof(table->combiner));
+}
+
+
+void operf_sfile_init(void)
+{
+	init_table(&default_table, operf_stats);
+}
+
+
+struct operf_sfile_table * operf_sfile_table_new(unsigned long * stats)
+{
+	struct operf_sfile_table * table;
+
+	table = (operf_sfile_table *)xmalloc(sizeof(struct operf_sfile_table));
+	init_table(table, stats);
+	return table;
+}
+
+
+void operf_sfile_table_free(struct operf_sfile_table * table)
+{
+	struct operf_sfile_table * old = sfiles;
+
+	sfiles = table;
+	operf_sfile_close_files();
+	sfiles = old;
+	free(table);
+}
+
+
+void operf_sfile_use_table(struct operf_sfile_table * table)
+{
+	sfiles = table ? table : &default_table;
+}
+
+
+void operf_sfile_lock_odb(void)
+{
+	pthread_mutex_lock(&odb_lock);
+}
+
+
+void operf_sfile_unlock_odb(void)
+{
+	pthread_mutex_unlock(&odb_lock);
 }
@@ -19,27 +19,49 @@
 #include "op_types.h"
 #include "op_list.h"
 #include "operf_process_info.h"
+#include "operf_sample_table.h"
 
 #include <sys/types.h>
 
 struct operf_transient;
 struct operf_kernel_image;
+struct operf_sfile_table;
+struct operf_cg_entry;
 
-#define CG_HASH_SIZE 16
 #define INVALID_IMAGE "INVALID IMAGE"
 
 #define VMA_SHIFT 13
 
+/** an arc table slot, entry is NULL if the slot is free */
+struct operf_cg_slot {
+	/** the id of the sfile the arcs go to */
+	unsigned long id;
+	struct operf_cg_entry * entry;
+};
+
+/**
+ * The arcs from an sfile: an open addressing hash table of the sfiles
+ * the arcs go to, keyed on their id. It's at most half full.
+ */
+struct operf_cg_table {
+	struct operf_cg_slot * slots;
+	/** there are 1 << order slots, slots is NULL if order is zero */
+	unsigned int order;
+	unsigned int nr_used;
+};
+
 /**
  * Each set of sample files (where a set is over the physical counter
  * types) will have one of these for it. We match against the
  * descriptions here to find which sample DB file we need to modify.
  *
- * cg files are stored in the hash.
+ * cg files are stored in the arc table.
  */
 struct operf_sfile {
 	/** hash value for this sfile */
 	unsigned long hashval;
+	/** identifies the sfile in arc tables, never reused by its table */
+	unsigned long id;
 	const char * image_name;
 	const char * app_filename;
 	size_t image_len, app_len;
@@ -61,20 +83,22 @@ struct operf_sfile {
 	struct list_head lru;
 	/** true if this file should be ignored in profiles */
 	int ignored;
+	/** true once its sample files were closed to stay within budget */
+	bool evicted;
 	/** opened sample files */
 	odb_t files[OP_MAX_EVENTS];
+	/** counts not written to files yet, with --write-behind */
+	struct operf_sample_table pending[OP_MAX_EVENTS];
 	/** extended sample files */
 	odb_t * ext_files;
-	/** hash table of opened cg sample files */
-	struct list_head cg_hash[CG_HASH_SIZE];
+	/** opened cg sample files */
+	struct operf_cg_table cg;
 };
 
 /** a call-graph entry */
 struct operf_cg_entry {
 	/** where arc is to */
 	struct operf_sfile to;
-	/** next in the hash slot */
-	struct list_head hash;
 };
 
 /**
@@ -103,6 +127,8 @@ struct operf_transient {
 	vma_t end_addr;
 	u64 pgoff;
 	bool cg;
+	/** how many samples the current one stands for, see __sample_weight() */
+	unsigned long count;
 	// TODO: handle extended
 	//void * ext;
 };
@@ -117,11 +143,48 @@ void operf_sfile_sync_files(void);
 /** close sample files */
 void operf_sfile_close_files(void);
 
-/** clear out a certain amount of LRU entries
- * return non-zero if the lru is already empty */
-int operf_sfile_lru_clear(void);
+/**
+ * With --write-behind, write the counts kept in memory to the sample
+ * files and free the memory holding them. This is done for all sfiles
+ * at once every --write-behind seconds and when they are closed.
+ */
+void operf_sfile_checkpoint(void);
+
+/**
+ * Close the file descriptors of all the sample files of the calling
+ * thread's sfile table, which stay mapped, and lower the number of them
+ * the table can have. For when opening a sample file fails with EMFILE.
+ * return non-zero if there was no descriptor to close
+ */
+int operf_sfile_release_fds(void);
+
+/**
+ * Set how many sample files each sfile table keeps: at most max_fds of
+ * them with a file descriptor and max_mapped mapped. Past these limits
+ * the sample files of the least recently used sfiles lose their
+ * descriptor, respectively are closed, preferring the smaller ones.
+ */
+void operf_sfile_set_budget(unsigned long max_fds, unsigned long max_mapped);
+
+/** set the budget to a share of the process limits for nr_tables tables */
+void operf_sfile_share_budget(unsigned int nr_tables);
 
-/** remove a sfile from the lru list, protecting it from operf_sfile_lru_clear() */
+/**
+ * what was done to keep the sample files within budget, and the count
+ * lost when a sample file couldn't be opened anyway
+ */
+enum {
+	OPERF_SFILE_EVICTIONS,	/**< sfiles whose sample files were closed */
+	OPERF_SFILE_REOPENS,	/**< sample files opened again after that */
+	OPERF_SFILE_FD_RELEASES,/**< descriptors closed, keeping the mapping */
+	OPERF_SFILE_LOST_COUNT,	/**< weighted count of OPERF_LOST_SAMPLEFILE */
+	OPERF_SFILE_MAX_BUDGET_STATS
+};
+
+/** the budget statistics of the sfile tables whose files were closed */
+extern unsigned long operf_sfile_budget_stats[];
+
+/** remove a sfile from the lru list, protecting it from eviction */
 void operf_sfile_get(struct operf_sfile * sf);
 
 /** add this sfile to lru list */
@@ -133,17 +196,39 @@ void operf_sfile_put(struct operf_sfile * sf);
  */
 struct operf_sfile * operf_sfile_find(struct operf_transient const * trans);
 
-/** Log the sample in a previously located sfile. */
+/** Log trans->count samples in a previously located sfile. */
 void operf_sfile_log_sample(struct operf_transient const * trans);
 
 /** Log the event/cycle count in a previously located sfile */
 void operf_sfile_log_sample_count(struct operf_transient const * trans,
                             unsigned long int count);
 
-/** Log a callgraph arc. */
+/** Log trans->count times a callgraph arc. */
 void operf_sfile_log_arc(struct operf_transient const * trans);
 
 /** initialise hashes */
 void operf_sfile_init(void);
 
+/**
+ * Allocate an empty set of sfile hashes and LRU list.  Samples logged
+ * through it are counted in stats, an array of OPERF_MAX_STATS entries.
+ */
+struct operf_sfile_table * operf_sfile_table_new(unsigned long * stats);
+
+/** close all sample files of a table and free it */
+void operf_sfile_table_free(struct operf_sfile_table * table);
+
+/**
+ * Make the calling thread use table for all the operf_sfile functions
+ * above; NULL selects the table set up by operf_sfile_init().
+ */
+void operf_sfile_use_table(struct operf_sfile_table * table);
+
+/**
+ * Serialize odb_open() and odb_close(), whose list of open sample files
+ * is shared by all threads.
+ */
+void operf_sfile_lock_odb(void);
+void operf_sfile_unlock_odb(void);
+
 #endif /* OPD_SFILE_H */
@@ -17,11 +17,16 @@
 #include <fcntl.h>
 #include <iostream>
 #include <errno.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
 
 #include "operf_stats.h"
+#include "operf_sfile.h"
 #include "op_get_time.h"
 
 unsigned long operf_stats[OPERF_MAX_STATS];
+struct operf_period_stats operf_period_stats[OP_MAX_NUM_EVENTS];
 
 /**
  * operf_print_stats - print out latest statistics to operf.log
@@ -31,6 +36,12 @@ using namespace std;
 static string create_stats_dir(string const & cur_sampledir);
 static void write_throttled_event_files(vector< operf_event_t> const & events,
                                         string const & stats_dir);
+static void print_ring_stats(FILE * fp, string const & sessiondir,
+                             string const & stats_dir);
+static void print_flight_stats(FILE * fp, string const & sessiondir);
+
+#define RING_STATS_FILE "/ring_stats"
+#define FLIGHT_STATS_FILE "/flight_stats"
 
 static void _write_stats_file(string const & stats_filename, unsigned long lost_sample_count)
 {
@@ -77,6 +88,11 @@ void operf_print_stats(string sessiondir, char * starttime, bool throttled,
 	fprintf(fp, "Nr. lost kernel samples: %lu\n", operf_stats[OPERF_LOST_KERNEL]);
 	fprintf(fp, "Nr. samples lost due to sample file open failure: %lu\n",
 		operf_stats[OPERF_LOST_SAMPLEFILE]);
+	// differs with weighted samples, see --sample-rate
+	if (operf_sfile_budget_stats[OPERF_SFILE_LOST_COUNT] !=
+	    operf_stats[OPERF_LOST_SAMPLEFILE])
+		fprintf(fp, "Weighted count of samples lost due to sample file open failure: %lu\n",
+		        operf_sfile_budget_stats[OPERF_SFILE_LOST_COUNT]);
 	fprintf(fp, "Nr. samples lost due to no permanent mapping: %lu\n",
 		operf_stats[OPERF_LOST_NO_MAPPING]);
 	fprintf(fp, "Nr. user context kernel samples lost due to no app info available: %lu\n",
@@ -89,6 +105,20 @@ void operf_print_stats(string sessiondir, char * starttime, bool throttled,
 	       operf_stats[OPERF_LOST_INVALID_HYPERV_ADDR]);
 	fprintf(fp, "Nr. samples lost reported by perf_events kernel: %lu\n",
 	       operf_stats[OPERF_RECORD_LOST_SAMPLE]);
+	fprintf(fp, "Nr. sample file evictions: %lu\n",
+	       operf_sfile_budget_stats[OPERF_SFILE_EVICTIONS]);
+	fprintf(fp, "Nr. evicted sample files opened again: %lu\n",
+	       operf_sfile_budget_stats[OPERF_SFILE_REOPENS]);
+	fprintf(fp, "Nr. sample file descriptors released: %lu\n",
+	       operf_sfile_budget_stats[OPERF_SFILE_FD_RELEASES]);
+	for (size_t i = 0; i < events.size(); i++) {
+		if (operf_period_stats[i].nr_samples)
+			fprintf(fp, "Average sample period of %s: %llu\n", events[i].name,
+			        (unsigned long long)(operf_period_stats[i].total /
+			                             operf_period_stats[i].nr_samples));
+	}
+	print_flight_stats(fp, sessiondir);
+	print_ring_stats(fp, sessiondir, stats_dir_valid ? stats_dir : "");
 
 	if (operf_stats[OPERF_RECORD_LOST_SAMPLE]) {
 		fprintf(stderr, "\n\n * * * ATTENTION: The kernel lost %lu samples. * * *\n",
@@ -120,6 +150,152 @@ void operf_print_stats(string sessiondir, char * starttime, bool throttled,
 	fclose(fp);
 };
 
+void operf_save_ring_stats(string const & sessiondir,
+                           vector<struct mmap_data> const & rings)
+{
+	string filename = sessiondir + RING_STATS_FILE;
+	FILE * fp = fopen(filename.c_str(), "w");
+
+	if (!fp) {
+		cerr << "Unable to write to ring statistics file " << filename << endl;
+		return;
+	}
+	for (size_t i = 0; i < rings.size(); i++) {
+		struct ring_stats const & stats = rings[i].stats;
+		fprintf(fp, "%d %llu %llu %llu %llu", stats.cpu,
+		        (unsigned long long)rings[i].mask + 1,
+		        (unsigned long long)stats.lost,
+		        (unsigned long long)stats.throttles,
+		        (unsigned long long)stats.high_water);
+		for (int j = 0; j < OPERF_DRAIN_LATENCY_BUCKETS; j++)
+			fprintf(fp, " %lu", stats.drain_latency[j]);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+}
+
+
+void operf_save_flight_stats(string const & sessiondir, u64 dropped)
+{
+	string filename = sessiondir + FLIGHT_STATS_FILE;
+	FILE * fp = fopen(filename.c_str(), "w");
+
+	if (!fp) {
+		cerr << "Unable to write to flight recorder statistics file "
+		     << filename << endl;
+		return;
+	}
+	fprintf(fp, "%llu\n", (unsigned long long)dropped);
+	fclose(fp);
+}
+
+
+static void print_flight_stats(FILE * fp, string const & sessiondir)
+{
+	string filename = sessiondir + FLIGHT_STATS_FILE;
+	FILE * in = fopen(filename.c_str(), "r");
+	unsigned long long dropped;
+
+	// No such file unless the recorder ran in --flight-recorder mode.
+	if (!in)
+		return;
+	if (fscanf(in, "%llu", &dropped) == 1)
+		fprintf(fp, "Nr. flight recorder process records dropped: %llu\n",
+		        dropped);
+	fclose(in);
+	unlink(filename.c_str());
+}
+
+
+static string latency_bucket_name(int bucket)
+{
+	ostringstream name;
+
+	if (bucket < OPERF_DRAIN_LATENCY_BUCKETS - 1)
+		name << "<" << (1 << bucket);
+	else
+		name << ">=" << (1 << (bucket - 1));
+	return name.str();
+}
+
+
+/* Write what operf_save_ring_stats() left behind to a directory per ring,
+ * named after its cpu, in the stats dir, and a line per ring to operf.log.
+ */
+static void print_ring_stats(FILE * fp, string const & sessiondir,
+                             string const & stats_dir)
+{
+	string filename = sessiondir + RING_STATS_FILE;
+	FILE * in = fopen(filename.c_str(), "r");
+	struct ring_stats stats;
+	unsigned long long size, lost, throttles, high_water;
+	unsigned long long worst_size = 0, worst_high_water = 0;
+	string worst_ring;
+
+	// No such file if the recorder failed, or wasn't run by this operf.
+	if (!in)
+		return;
+	fprintf(fp, "\n-- Sample ring statistics --\n");
+	for (int i = 0; fscanf(in, "%d %llu %llu %llu %llu", &stats.cpu, &size,
+	                       &lost, &throttles, &high_water) == 5; i++) {
+		ostringstream name;
+		int j;
+		for (j = 0; j < OPERF_DRAIN_LATENCY_BUCKETS; j++) {
+			if (fscanf(in, "%lu", &stats.drain_latency[j]) != 1)
+				break;
+		}
+		if (j < OPERF_DRAIN_LATENCY_BUCKETS)
+			break;
+
+		if (stats.cpu >= 0)
+			name << "cpu" << stats.cpu;
+		else
+			name << "ring" << i;
+		fprintf(fp, "%s: size %llu KB, high water %llu%%, lost samples %llu, "
+		        "throttled %llu times\n", name.str().c_str(), size / 1024,
+		        high_water * 100 / size, lost, throttles);
+		fprintf(fp, "%s: drain latency (ms)", name.str().c_str());
+		for (j = 0; j < OPERF_DRAIN_LATENCY_BUCKETS; j++) {
+			if (stats.drain_latency[j])
+				fprintf(fp, " %s:%lu", latency_bucket_name(j).c_str(),
+				        stats.drain_latency[j]);
+		}
+		fprintf(fp, "%s\n", high_water ? "" : " none");
+		if (high_water * worst_size >= worst_high_water * size) {
+			worst_high_water = high_water;
+			worst_size = size;
+			worst_ring = name.str();
+		}
+
+		if (stats_dir.empty())
+			continue;
+		string ring_dir = stats_dir + "/" + name.str();
+		if (mkdir(ring_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) &&
+		    errno != EEXIST) {
+			cerr << "Error trying to create " << ring_dir << endl;
+			continue;
+		}
+		_write_stats_file(ring_dir + "/" + stats_filenames[OPERF_RECORD_LOST_SAMPLE], lost);
+		_write_stats_file(ring_dir + "/throttled_records", throttles);
+		_write_stats_file(ring_dir + "/ring_size", size);
+		_write_stats_file(ring_dir + "/ring_high_water", high_water);
+		ofstream latency_file((ring_dir + "/drain_latency").c_str());
+		for (j = 0; j < OPERF_DRAIN_LATENCY_BUCKETS; j++)
+			latency_file << latency_bucket_name(j) << "ms "
+			             << stats.drain_latency[j] << endl;
+	}
+	fclose(in);
+	unlink(filename.c_str());
+
+	// A ring that got this full was about to lose samples, if it didn't.
+	if (worst_size && worst_high_water * 4 >= worst_size * 3) {
+		fprintf(stderr, "\nWARNING: The sample ring %s was %llu%% full at times.\n",
+		        worst_ring.c_str(), worst_high_water * 100 / worst_size);
+		fprintf(stderr, "Use the '--ring-size' option to give the rings more room.\n");
+	}
+}
+
+
 static void write_throttled_event_files(vector< operf_event_t> const & events,
                                         string const & stats_dir)
 {
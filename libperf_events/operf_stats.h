@@ -19,7 +19,28 @@
 
 extern unsigned long operf_stats[];
 
+/** with --sample-rate, the periods of the converted samples of each event */
+struct operf_period_stats {
+	u64 total;
+	u64 nr_samples;
+};
+extern struct operf_period_stats operf_period_stats[];
+
 void operf_print_stats(std::string sampledir, char * starttime, bool throttled,
                        std::vector< operf_event_t> const & events);
 
+/**
+ * Called by the recorder once it's done, to hand the statistics of the
+ * rings over to operf_print_stats, which runs in the conversion process.
+ */
+void operf_save_ring_stats(std::string const & sessiondir,
+                           std::vector<struct mmap_data> const & rings);
+
+/**
+ * Called by the recorder in --flight-recorder mode, to hand the number
+ * of process records it dropped to stay within its limit over to
+ * operf_print_stats.
+ */
+void operf_save_flight_stats(std::string const & sessiondir, u64 dropped);
+
 #endif /* OPERF_STATS_H */
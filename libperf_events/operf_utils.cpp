@@ -17,12 +17,18 @@
 #include <errno.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <cverb.h>
 #include <iostream>
 #include <sstream>
+#include <deque>
 #include "operf_counter.h"
 #include "operf_utils.h"
 #ifdef HAVE_LIBPFM
@@ -33,6 +39,9 @@
 #include "file_manip.h"
 #include "operf_kernel.h"
 #include "operf_sfile.h"
+#include "operf_convert_worker.h"
+#include "operf_event_queue.h"
+#include "operf_flight_recorder.h"
 #include "op_fileio.h"
 #include "op_libiberty.h"
 #include "operf_stats.h"
@@ -61,10 +70,42 @@ bool throttled;
 size_t mmap_size;
 size_t pg_sz;
 
-static list<event_t *> unresolved_events;
+/* Samples which can't be processed until all the others are, see
+ * op_reprocess_unresolved_events(). Past 256 MB they go to disk.
+ */
+static operf_event_queue unresolved_events(256 * 1024 * 1024);
 static struct operf_transient trans;
 static bool sfile_init_done;
 
+/* When converting with worker threads, trans.current only tells whether a
+ * sample can be logged; the sfile itself is looked up by the worker that
+ * the sample is posted to.  Samples are sharded by tgid when sample files
+ * are separated by thread, and otherwise by application name, since that
+ * is part of every sample file name.
+ */
+static vector<operf_convert_worker *> convert_workers;
+static struct operf_sfile worker_sfile;
+static map<string, unsigned int> convert_app_shards;
+static map<string, unsigned int>::const_iterator trans_app_shard;
+static bool trans_relocated;
+
+/* Ring data handed to the sample data pipe with vmsplice(2) is referenced
+ * by the pipe, not copied into it.  The kernel must not reuse that part of
+ * the ring until the operf-read process has consumed it, so the update of
+ * data_tail is deferred: each spliced chunk is queued with the position in
+ * the pipe stream at which it ends, and op_splice_release() hands the ring
+ * space back once FIONREAD shows the reader has gone past that position.
+ */
+struct spliced_chunk {
+	u64 stream_end;
+	struct perf_event_mmap_page * pc;
+	u64 ring_pos;
+};
+static int splice_pipe = -1;
+static bool splice_enabled;
+static u64 splice_stream_written;
+static deque<struct spliced_chunk> spliced_chunks;
+
 static inline void update_trans_last(struct operf_transient * trans)
 {
 	trans->last = trans->current;
@@ -84,6 +125,15 @@ static inline void clear_trans(struct operf_transient * trans)
 	trans->cur_procinfo = NULL;
 }
 
+/* Wait until the workers have caught up with the parser, e.g. before
+ * changing state they read.
+ */
+static void __sync_convert_workers(void)
+{
+	for (size_t i = 0; i < convert_workers.size(); i++)
+		convert_workers[i]->wait_idle();
+}
+
 static void __handle_fork_event(event_t * event)
 {
 	if (cverb << vconvert)
@@ -348,6 +398,8 @@ static void __handle_mmap_event(event_t * event)
 					     << endl << "< < < < < > > > > >" << endl << endl;
 				}
 			} else {
+				// The workers look up kernel images in operf_sfile_find().
+				__sync_convert_workers();
 				operf_create_module(mapping->filename,
 				                    mapping->start_addr,
 				                    mapping->end_addr);
@@ -426,15 +478,13 @@ static struct operf_transient * __get_operf_trans(struct sample_data * data, boo
 				data->ip <= kernel_mmap->end_addr) {
 			op_mmap = kernel_mmap;
 		} else {
+			// Only the last module starting at or below ip can hold it.
 			map<u64, struct operf_mmap *>::iterator it;
-			it = kernel_modules.begin();
-			while (it != kernel_modules.end()) {
-				if (data->ip >= it->second->start_addr &&
-						data->ip <= it->second->end_addr) {
+			it = kernel_modules.upper_bound(data->ip);
+			if (it != kernel_modules.begin()) {
+				--it;
+				if (data->ip <= it->second->end_addr)
 					op_mmap = it->second;
-					break;
-				}
-				it++;
 			}
 		} if (!op_mmap) {
 			if ((kernel_mmap->start_addr == 0ULL) &&
@@ -498,6 +548,72 @@ out:
 	return retval;
 }
 
+static struct operf_sfile * __find_sfile(void)
+{
+	if (convert_workers.empty())
+		return operf_sfile_find(&trans);
+
+	// Same check as operf_sfile_find(), done here so trans.current is right.
+	if (trans.in_kernel && !operf_find_kernel_image(trans.pc)) {
+		if (cverb << vsfile) {
+			ostringstream message;
+			message << "Lost kernel sample " << std::hex << trans.pc << std::endl;
+			cout << message.str();
+		}
+		operf_stats[OPERF_LOST_KERNEL]++;
+		return NULL;
+	}
+
+	trans_app_shard = convert_app_shards.find(trans.app_filename);
+	if (trans_app_shard == convert_app_shards.end()) {
+		unsigned int shard = convert_app_shards.size() % convert_workers.size();
+		trans_app_shard = convert_app_shards.insert(
+			pair<string, unsigned int>(trans.app_filename, shard)).first;
+	}
+	trans_relocated = true;
+	return &worker_sfile;
+}
+
+
+static void __log_sample_or_arc(bool is_arc)
+{
+	struct operf_convert_record rec;
+	unsigned int shard;
+
+	if (convert_workers.empty()) {
+		if (is_arc)
+			operf_sfile_log_arc(&trans);
+		else
+			operf_sfile_log_sample(&trans);
+		return;
+	}
+
+	rec.image_name = trans.image_name;
+	rec.image_len = trans.image_len;
+	rec.app_name = trans_app_shard->first.c_str();
+	rec.app_len = trans_app_shard->first.size();
+	rec.pc = trans.pc;
+	rec.start_addr = trans.start_addr;
+	rec.end_addr = trans.end_addr;
+	rec.cpu = trans.cpu;
+	rec.tid = trans.tid;
+	rec.tgid = trans.tgid;
+	rec.event = trans.event;
+	rec.count = trans.count;
+	rec.is_arc = is_arc;
+	rec.relocate = trans_relocated;
+	rec.in_kernel = trans.in_kernel;
+	rec.is_anon = trans.is_anon;
+	trans_relocated = false;
+
+	if (operf_options::separate_thread)
+		shard = trans.tgid % convert_workers.size();
+	else
+		shard = trans_app_shard->second;
+	convert_workers[shard]->post(rec);
+}
+
+
 static void __handle_callchain(u64 * array, struct sample_data * data)
 {
 	bool in_kernel = false;
@@ -528,8 +644,8 @@ static void __handle_callchain(u64 * array, struct sample_data * data)
 				continue;
 			}
 			if (data->ip && __get_operf_trans(data, false, in_kernel)) {
-				if ((trans.current = operf_sfile_find(&trans))) {
-					operf_sfile_log_arc(&trans);
+				if ((trans.current = __find_sfile())) {
+					__log_sample_or_arc(true);
 					update_trans_last(&trans);
 				}
 			} else {
@@ -590,6 +706,31 @@ static int __handle_throttle_event(event_t * event)
 	return rc;
 }
 
+/* With --sample-rate, the kernel picks the period of each sample, and a
+ * sample stands for period / count samples of the count of its event, the
+ * one which opreport & co. multiply the sample counts with.  What doesn't
+ * make a whole count is carried over to the next sample of the event, so
+ * no events go missing from the profile.
+ */
+static unsigned long __sample_weight(struct sample_data const * data,
+                                     u64 sample_type)
+{
+	static u64 remainder[OP_MAX_NUM_EVENTS];
+	u64 count, total;
+
+	if (!(sample_type & PERF_SAMPLE_PERIOD))
+		return 1;
+
+	operf_period_stats[trans.event].total += data->period;
+	operf_period_stats[trans.event].nr_samples++;
+	count = operfRead.get_event_by_counter(trans.event)->count;
+	if (!count)
+		return 1;
+	total = remainder[trans.event] + data->period;
+	remainder[trans.event] = total % count;
+	return total / count;
+}
+
 static int __handle_sample_event(event_t * event, u64 sample_type)
 {
 	struct sample_data data;
@@ -637,6 +778,11 @@ static int __handle_sample_event(event_t * event, u64 sample_type)
 		data.cpu = *p;
 		array++;
 	}
+	// So is PERF_SAMPLE_PERIOD (see --sample-rate).
+	if (sample_type & PERF_SAMPLE_PERIOD) {
+		data.period = *array;
+		array++;
+	}
 	if (event->header.misc == PERF_RECORD_MISC_KERNEL) {
 		in_kernel = true;
 	} else if (event->header.misc == PERF_RECORD_MISC_USER) {
@@ -735,9 +881,7 @@ static int __handle_sample_event(event_t * event, u64 sample_type)
 		 * each with a unique address range.  So we'll stick the event on
 		 * the unresolved_events list to be re-processed later.
 		 */
-		event_t * ev = (event_t *)xmalloc(event->header.size);
-		memcpy(ev, event, event->header.size);
-		unresolved_events.push_back(ev);
+		unresolved_events.push(event);
 		if (cverb << vconvert)
 			cout << "Deferring processing of hypervisor sample." << endl;
 		goto out;
@@ -775,7 +919,7 @@ static int __handle_sample_event(event_t * event, u64 sample_type)
 
 find_trans:
 	if (!found_trans && __get_operf_trans(&data, hypervisor, in_kernel)) {
-		trans.current = operf_sfile_find(&trans);
+		trans.current = __find_sfile();
 		found_trans = true;
 	}
 
@@ -784,8 +928,13 @@ find_trans:
 	 * the cracks, or if it's a sample from an anon region we couldn't find
 	 */
 	if (found_trans && trans.current) {
+		trans.count = __sample_weight(&data, sample_type);
+		// Not a whole count of the event yet, see __sample_weight().
+		if (!trans.count)
+			goto done;
+
 		/* log the sample or arc */
-		operf_sfile_log_sample(&trans);
+		__log_sample_or_arc(false);
 
 		update_trans_last(&trans);
 		if (sample_type & PERF_SAMPLE_CALLCHAIN)
@@ -793,11 +942,8 @@ find_trans:
 		goto done;
 	}
 
-	if (first_time_processing) {
-		event_t * ev = (event_t *)malloc(event->header.size);
-		memcpy(ev, event, event->header.size);
-		unresolved_events.push_back(ev);
-	}
+	if (first_time_processing)
+		unresolved_events.push(event);
 
 out:
 	clear_trans(&trans);
@@ -867,11 +1013,37 @@ int OP_perf_utils::op_write_event(event_t * event, u64 sample_type)
 	}
 }
 
+struct reprocess_state {
+	u64 sample_type;
+	bool print_progress;
+	int num_recs;
+};
+
+
+static int reprocess_event(event_t * evt, void * data)
+{
+	struct reprocess_state * state = (struct reprocess_state *)data;
+	int rc;
+
+	// This is just a sanity check, since all events in this queue
+	// are unresolved sample events.
+	if (evt->header.type != PERF_RECORD_SAMPLE)
+		return 0;
+
+	rc = __handle_sample_event(evt, state->sample_type);
+	state->num_recs++;
+	if ((state->num_recs % 1000000 == 0) && state->print_progress)
+		cerr << ".";
+	return rc;
+}
+
+
 void OP_perf_utils::op_reprocess_unresolved_events(u64 sample_type, bool print_progress)
 {
-	int num_recs = 0;
+	struct reprocess_state state = { sample_type, print_progress, 0 };
 
-	cverb << vconvert << "Reprocessing samples" << endl;
+	cverb << vconvert << "Reprocessing " << dec << unresolved_events.size()
+	      << " samples" << endl;
 
 	map<pid_t, operf_process_info *>::iterator procs = process_map.begin();
 	for (; procs != process_map.end(); procs++) {
@@ -886,24 +1058,7 @@ void OP_perf_utils::op_reprocess_unresolved_events(u64 sample_type, bool print_p
 		// The appname may not be accurate, but it's the best we can do now.
 		procs->second->set_appname_valid();
 	}
-	list<event_t *>::const_iterator it = unresolved_events.begin();
-	int data_error = 0;
-	for (; it != unresolved_events.end(); it++) {
-		event_t * evt = (*it);
-		if (data_error < 0) {
-			free(evt);
-			continue;
-		}
-		// This is just a sanity check, since all events in this list
-		// are unresolved sample events.
-		if (evt->header.type == PERF_RECORD_SAMPLE) {
-			data_error = __handle_sample_event(evt, sample_type);
-			free(evt);
-			num_recs++;
-			if ((num_recs % 1000000 == 0) && print_progress)
-				cerr << ".";
-		}
-	}
+	unresolved_events.replay(reprocess_event, &state);
 }
 
 void OP_perf_utils::op_release_resources(void)
@@ -924,6 +1079,52 @@ void OP_perf_utils::op_release_resources(void)
 
 }
 
+void OP_perf_utils::op_convert_workers_start(int nr_workers)
+{
+	struct rlimit rlim;
+
+	/* Each worker keeps its own sample files open, within its share
+	 * of the descriptors and mappings.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	for (int i = 0; i < nr_workers; i++) {
+		operf_convert_worker * worker = new operf_convert_worker(i);
+		int rc = worker->start();
+		if (rc) {
+			delete worker;
+			cverb << vconvert << "Unable to start convert worker: " << strerror(rc) << endl;
+			break;
+		}
+		convert_workers.push_back(worker);
+	}
+	// One worker is no better than converting in this thread.
+	if (convert_workers.size() == 1)
+		op_convert_workers_stop();
+	operf_sfile_share_budget(convert_workers.size() + 1);
+	cverb << vconvert << "Converting with " << dec << convert_workers.size()
+	      << " worker threads" << endl;
+}
+
+void OP_perf_utils::op_convert_workers_stop(void)
+{
+	for (size_t i = 0; i < convert_workers.size(); i++) {
+		convert_workers[i]->join();
+		delete convert_workers[i];
+	}
+	convert_workers.clear();
+	convert_app_shards.clear();
+	trans_app_shard = convert_app_shards.end();
+	/* The parser's trans.current and trans.last are &worker_sfile, which
+	 * must not be used from now on.
+	 */
+	clear_trans(&trans);
+	trans.current = trans.last = NULL;
+}
+
 void OP_perf_utils::op_perfrecord_sigusr1_handler(int sig __attribute__((unused)),
 		siginfo_t * siginfo __attribute__((unused)),
 		void *u_context __attribute__((unused)))
@@ -1010,6 +1211,87 @@ int OP_perf_utils::op_write_output(int output, void *buf, size_t size)
 		buf = (char *)buf + ret;
 		sum  += ret;
 	}
+	if (output == splice_pipe)
+		splice_stream_written += sum;
+	return sum;
+}
+
+void OP_perf_utils::op_splice_init(int output, size_t pipe_size)
+{
+	struct stat st;
+
+	if (fstat(output, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return;
+	/* vmsplice uses one pipe buffer slot per chunk however small, so ask
+	 * for a pipe that can hold about one ring's worth of data.  This can
+	 * fail for non-root users (see /proc/sys/fs/pipe-max-size); splicing
+	 * still works with the default size.
+	 */
+	int cur_size = fcntl(output, F_GETPIPE_SZ);
+	if (cur_size >= 0 && (size_t)cur_size < pipe_size &&
+	    fcntl(output, F_SETPIPE_SZ, pipe_size) < 0)
+		cverb << vrecord << "Unable to resize sample data pipe: "
+		      << strerror(errno) << endl;
+	splice_pipe = output;
+	splice_enabled = true;
+	splice_stream_written = 0;
+	cverb << vrecord << "Using vmsplice for sample data pipe" << endl;
+}
+
+bool OP_perf_utils::op_splice_pending(void)
+{
+	return !spliced_chunks.empty();
+}
+
+void OP_perf_utils::op_splice_release(void)
+{
+	int unread;
+
+	if (spliced_chunks.empty())
+		return;
+	if (ioctl(splice_pipe, FIONREAD, &unread) < 0)
+		return;
+
+	u64 consumed = splice_stream_written - unread;
+	while (!spliced_chunks.empty() &&
+	       spliced_chunks.front().stream_end <= consumed) {
+		struct spliced_chunk const & chunk = spliced_chunks.front();
+		chunk.pc->data_tail = chunk.ring_pos;
+		spliced_chunks.pop_front();
+	}
+}
+
+/* Splice as much of the nr_iov entries of iov as possible into splice_pipe
+ * and return the number of bytes spliced; iov and nr_iov are left describing
+ * whatever was not spliced.  On any error other than EINTR, splicing is
+ * turned off for the rest of the session and the caller writes the rest.
+ */
+static size_t _splice_to_pipe(struct iovec *& iov, int & nr_iov)
+{
+	size_t sum = 0;
+
+	while (nr_iov) {
+		ssize_t ret = vmsplice(splice_pipe, iov, nr_iov, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			cverb << vrecord << "vmsplice failed; falling back to write: "
+			      << strerror(errno) << endl;
+			splice_enabled = false;
+			break;
+		}
+		sum += ret;
+		while (nr_iov && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr_iov--;
+		}
+		if (nr_iov) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	splice_stream_written += sum;
 	return sum;
 }
 
@@ -1412,46 +1694,158 @@ void OP_perf_utils::op_record_kernel_info(string vmlinux_file, u64 start_addr, u
 		_record_module_info(output_fd, pr);
 }
 
-void OP_perf_utils::op_get_kernel_event_data(struct mmap_data *md, operf_record * pr)
+/* Account for the records between md->prev and head before they are handed
+ * over.  Records are 8 byte aligned, as is the ring size, so neither a
+ * header nor the u64 of a lost record straddle the end of the ring.
+ * The high water mark is measured from data_tail rather than md->prev: ring
+ * space still referenced by spliced chunks is in use as far as the kernel
+ * is concerned.
+ */
+static void _update_ring_stats(struct mmap_data * md, unsigned char * data,
+                               uint64_t head)
 {
 	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)md->base;
-	int out_fd = pr->out_fd();
+	struct ring_stats * stats = &md->stats;
+	struct timespec now;
+	u64 latency;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency = (now.tv_sec - stats->last_drain.tv_sec) * 1000000000ULL +
+		now.tv_nsec - stats->last_drain.tv_nsec;
+	stats->last_drain = now;
+	if (head <= md->prev)
+		return;
 
-	uint64_t head = pc->data_head;
-	// Comment in perf_event.h says "User-space reading the @data_head value should issue
-	// an rmb(), on SMP capable platforms, after reading this value."
-	rmb();
+	while (bucket < OPERF_DRAIN_LATENCY_BUCKETS - 1 &&
+	       latency >= (1000000ULL << bucket))
+		bucket++;
+	stats->drain_latency[bucket]++;
+	if (head - pc->data_tail > stats->high_water)
+		stats->high_water = head - pc->data_tail;
+
+	for (uint64_t pos = md->prev; pos < head; ) {
+		struct perf_event_header * header =
+			(struct perf_event_header *)&data[pos & md->mask];
+		if (header->size < sizeof(*header))
+			break;
+		if (header->type == PERF_RECORD_LOST)
+			stats->lost += *(u64 *)&data[(pos + offsetof(struct lost_event, lost)) & md->mask];
+		else if (header->type == PERF_RECORD_THROTTLE)
+			stats->throttles++;
+		pos += header->size;
+	}
+}
 
-	uint64_t old = md->prev;
+/* Point chunks at the data between md->prev and the head of the ring, in
+ * two chunks if it wraps around the end of the ring.  Return the number of
+ * chunks, 0 if the ring is empty.
+ */
+static int _get_ring_data(struct mmap_data * md, struct iovec * chunks,
+                          uint64_t * head)
+{
+	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)md->base;
 	unsigned char *data = ((unsigned char *)md->base) + pagesize;
+	uint64_t old = md->prev;
 	uint64_t size;
-	void *buf;
+	int nr_iov = 0;
 	int64_t diff;
 
-	if (old == head)
-		return;
+	*head = pc->data_head;
+	// Comment in perf_event.h says "User-space reading the @data_head value should issue
+	// an rmb(), on SMP capable platforms, after reading this value."
+	rmb();
+
+	_update_ring_stats(md, data, *head);
+	if (old == *head)
+		return 0;
 
-	diff = head - old;
+	diff = *head - old;
 	if (diff < 0) {
 		throw runtime_error("ERROR: event buffer wrapped, which should NEVER happen.");
 	}
 
-	if (old != head)
-		sample_reads++;
-
-	size = head - old;
+	size = *head - old;
 
-	if ((old & md->mask) + size != (head & md->mask)) {
-		buf = &data[old & md->mask];
+	if ((old & md->mask) + size != (*head & md->mask)) {
 		size = md->mask + 1 - (old & md->mask);
+		chunks[nr_iov].iov_base = &data[old & md->mask];
+		chunks[nr_iov++].iov_len = size;
 		old += size;
-		pr->add_to_total(op_write_output(out_fd, buf, size));
 	}
 
-	buf = &data[old & md->mask];
-	size = head - old;
-	old += size;
-	pr->add_to_total(op_write_output(out_fd, buf, size));
-	md->prev = old;
-	pc->data_tail = old;
+	size = *head - old;
+	chunks[nr_iov].iov_base = &data[old & md->mask];
+	chunks[nr_iov++].iov_len = size;
+	return nr_iov;
+}
+
+int OP_perf_utils::op_drain_ring(struct mmap_data *md, int out_fd)
+{
+	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)md->base;
+	uint64_t head;
+	uint64_t size;
+	struct iovec chunks[2];
+	struct iovec * iov = chunks;
+	int nr_iov;
+	size_t spliced = 0;
+
+	/* Release first so the ring stats see the data_tail the kernel will */
+	if (splice_enabled && out_fd == splice_pipe)
+		op_splice_release();
+	nr_iov = _get_ring_data(md, chunks, &head);
+	if (!nr_iov)
+		return 0;
+
+	if (splice_enabled && out_fd == splice_pipe)
+		spliced = _splice_to_pipe(iov, nr_iov);
+	for (int i = 0; i < nr_iov; i++)
+		op_write_output(out_fd, iov[i].iov_base, iov[i].iov_len);
+
+	size = head - md->prev;
+	md->prev = head;
+	/* Anything written behind spliced data, even from another ring, sits
+	 * in the pipe after it, so its ring space is handed back in order too.
+	 */
+	if (spliced || !spliced_chunks.empty()) {
+		struct spliced_chunk chunk;
+		chunk.stream_end = splice_stream_written;
+		chunk.pc = pc;
+		chunk.ring_pos = head;
+		spliced_chunks.push_back(chunk);
+	} else {
+		pc->data_tail = head;
+	}
+	return size;
+}
+
+int OP_perf_utils::op_drain_ring(struct mmap_data *md,
+                                 operf_flight_recorder & recorder)
+{
+	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)md->base;
+	uint64_t head;
+	uint64_t size;
+	struct iovec chunks[2];
+	int nr_iov;
+
+	nr_iov = _get_ring_data(md, chunks, &head);
+	if (!nr_iov)
+		return 0;
+
+	recorder.add(chunks, nr_iov);
+	size = head - md->prev;
+	md->prev = head;
+	pc->data_tail = head;
+	return size;
+}
+
+int OP_perf_utils::op_get_kernel_event_data(struct mmap_data *md, operf_record * pr)
+{
+	int num = op_drain_ring(md, pr->out_fd());
+
+	if (num) {
+		sample_reads++;
+		pr->add_to_total(num);
+	}
+	return num;
 }
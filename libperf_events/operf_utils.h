@@ -32,6 +32,13 @@ extern int mmap_pages_mult;
 extern std::string session_dir;
 extern bool separate_cpu;
 extern bool separate_thread;
+extern int record_threads;
+extern int convert_threads;
+extern bool write_behind;
+extern int checkpoint_interval;
+extern int ring_size;
+extern int flight_recorder;
+extern int sample_rate;
 }
 
 extern bool no_vmlinux;
@@ -65,6 +72,7 @@ static inline size_t align_64bit(u64 x)
 }
 
 class operf_record;
+class operf_flight_recorder;
 namespace OP_perf_utils {
 typedef struct vmlinux_info {
 	std::string image_name;
@@ -72,7 +80,12 @@ typedef struct vmlinux_info {
 } vmlinux_info_t;
 void op_record_kernel_info(std::string vmlinux_file, u64 start_addr, u64 end_addr,
                            int output_fd, operf_record * pr);
-void op_get_kernel_event_data(struct mmap_data *md, operf_record * pr);
+int op_get_kernel_event_data(struct mmap_data *md, operf_record * pr);
+int op_drain_ring(struct mmap_data *md, int out_fd);
+int op_drain_ring(struct mmap_data *md, operf_flight_recorder & recorder);
+void op_splice_init(int output, size_t pipe_size);
+bool op_splice_pending(void);
+void op_splice_release(void);
 void op_perfrecord_sigusr1_handler(int sig __attribute__((unused)),
 		siginfo_t * siginfo __attribute__((unused)),
 		void *u_context __attribute__((unused)));
@@ -85,6 +98,8 @@ int op_read_from_stream(std::ifstream & is, char * buf, std::streamsize sz);
 int op_mmap_trace_file(struct mmap_info & info, bool init);
 void op_reprocess_unresolved_events(u64 sample_type, bool print_progress);
 void op_release_resources(void);
+void op_convert_workers_start(int nr_workers);
+void op_convert_workers_stop(void);
 }
 
 // The rmb() macros were borrowed from perf.h in the kernel tree
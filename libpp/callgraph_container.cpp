@@ -389,24 +389,22 @@ symbol_collection const & arc_recorder::get_symbols() const
 
 void callgraph_container::populate(list<inverted_profile> const & iprofiles,
    extra_images const & extra, bool debug_info, double threshold,
-   bool merge_lib, string_filter const & sym_filter)
+   bool merge_lib, string_filter const & sym_filter, int jobs)
 {
 	this->extra_found_images = extra;
 	// non callgraph samples container, we record sample at symbol level
 	// not at vma level.
 	profile_container pc(debug_info, false, extra_found_images);
 
-	list<inverted_profile>::const_iterator it;
-	list<inverted_profile>::const_iterator const end = iprofiles.end();
-	for (it = iprofiles.begin(); it != end; ++it) {
-		// populate_caller_image take care about empty sample filename
-		populate_for_image(pc, *it, sym_filter, 0);
-	}
+	// populate_caller_image take care about empty sample filename
+	populate_for_images(pc, iprofiles, sym_filter, 0, jobs);
 
 	add_symbols(pc);
 
 	total_count = pc.samples_count();
 
+	list<inverted_profile>::const_iterator it;
+	list<inverted_profile>::const_iterator const end = iprofiles.end();
 	for (it = iprofiles.begin(); it != end; ++it) {
 		for (size_t i = 0; i < it->groups.size(); ++i) {
 			populate(it->groups[i], it->image,
@@ -20,15 +20,39 @@
 #include "populate.h"
 
 #include "image_errors.h"
+#include "op_exception.h"
 #include "utility.h"
 #include <string.h>
+#include <pthread.h>
 
 #include <iostream>
+#include <vector>
 
 using namespace std;
 
 namespace {
 
+/// the samples of one image_set, loaded but not yet added
+struct loaded_set {
+	profile_t * profile;
+	string const * app_image;
+	size_t group;
+};
+
+
+/// one image loaded ahead of being added to the profile_container
+struct loaded_image {
+	loaded_image() : abfd(0), done(false) {}
+
+	op_bfd * abfd;
+	vector<loaded_set> sets;
+	/// the message of a fatal error while loading the image
+	string error;
+	/// set once loading is over, successful or not
+	bool done;
+};
+
+
 /// load merged files for one set of sample files
 bool
 populate_from_files(profile_t & profile, op_bfd const & abfd,
@@ -37,49 +61,46 @@ populate_from_files(profile_t & profile, op_bfd const & abfd,
 	list<profile_sample_files>::const_iterator it = files.begin();
 	list<profile_sample_files>::const_iterator const end = files.end();
 
-	bool found = false;
+	list<string> filenames;
 	// we can't handle cg files here obviously
 	for (; it != end; ++it) {
 		// A bit ugly but we must accept silently empty sample filename
 		// since we can create a profile_sample_files for cg file only
 		// (i.e no sample to the binary)
-		if (!it->sample_filename.empty()) {
-			profile.add_sample_file(it->sample_filename);
-			profile.set_offset(abfd);
-			found = true;
-		}
+		if (!it->sample_filename.empty())
+			filenames.push_back(it->sample_filename);
 	}
 
-	return found;
-}
+	if (filenames.empty())
+		return false;
 
-}  // anon namespace
+	profile.add_sample_files(filenames);
+	profile.set_offset(abfd);
+	return true;
+}
 
 
-void
-populate_for_image(profile_container & samples, inverted_profile const & ip,
-	string_filter const & symbol_filter, bool * has_debug_info)
+/**
+ * open the image of ip and load its sample files, touches nothing shared.
+ * op_bfd serializes its libbfd calls only, so the workers filter and sort
+ * the symbols of their images concurrently.
+ */
+void load_image(loaded_image & image, inverted_profile const & ip,
+                string_filter const & symbol_filter,
+                extra_images const & extra_found_images)
 {
-	op_bfd *abfd;
-
 	bool ok = ip.error == image_ok;
 
-	if (strncmp(ip.image.c_str(), KALL_SYM_FILE, strlen(ip.image.c_str())) == 0)
-		abfd = new op_bfd(ip.image, samples.extra_found_images);
-
+	if (strncmp(ip.image.c_str(), KALL_SYM_FILE,
+	            strlen(ip.image.c_str())) == 0)
+		image.abfd = new op_bfd(ip.image, extra_found_images);
 	else
-		abfd = new op_bfd(ip.image, symbol_filter,
-				  samples.extra_found_images, ok);
+		image.abfd = new op_bfd(ip.image, symbol_filter,
+		                        extra_found_images, ok);
 
 	if (!ok && ip.error == image_ok)
 		ip.error = image_format_failure;
 
-	if (ip.error == image_format_failure)
-		report_image_error(ip, false, samples.extra_found_images);
-
-	opd_header header;
-
-	bool found = false;
 	for (size_t i = 0; i < ip.groups.size(); ++i) {
 		list<image_set>::const_iterator it
 			= ip.groups[i].begin();
@@ -91,16 +112,54 @@ populate_for_image(profile_container & samples, inverted_profile const & ip,
 		// changes, and the .add() would mis-attribute
 		// to the wrong app_image otherwise
 		for (; it != end; ++it) {
-			profile_t profile;
-			if (populate_from_files(profile, *abfd, it->files)) {
-				header = profile.get_header();
-				samples.add(profile, *abfd, it->app_image, i);
-				found = true;
+			loaded_set set = { new profile_t, &it->app_image, i };
+			image.sets.push_back(set);
+			if (!populate_from_files(*set.profile, *image.abfd,
+			                         it->files)) {
+				delete set.profile;
+				image.sets.pop_back();
 			}
 		}
 	}
+}
+
 
-	if (found == true && ip.error == image_ok) {
+void release_image(loaded_image & image)
+{
+	for (size_t i = 0; i < image.sets.size(); ++i)
+		delete image.sets[i].profile;
+	image.sets.clear();
+
+	delete image.abfd;
+	image.abfd = 0;
+}
+
+
+/// add a loaded image to samples, in the order of the inverted profiles
+void add_image(profile_container & samples, inverted_profile const & ip,
+               loaded_image & image, bool * has_debug_info)
+{
+	if (!image.error.empty()) {
+		release_image(image);
+		throw op_fatal_error(image.error);
+	}
+
+	if (ip.error == image_format_failure)
+		report_image_error(ip, false, samples.extra_found_images);
+
+	opd_header header;
+
+	for (size_t i = 0; i < image.sets.size(); ++i) {
+		loaded_set const & set = image.sets[i];
+		header = set.profile->get_header();
+		samples.add(*set.profile, *image.abfd, *set.app_image,
+		            set.group);
+	}
+
+	if (has_debug_info && image.abfd->has_debug_info())
+		*has_debug_info = true;
+
+	if (!image.sets.empty() && ip.error == image_ok) {
 		image_error error;
 		string filename =
 			samples.extra_found_images.find_image_path(
@@ -108,8 +167,172 @@ populate_for_image(profile_container & samples, inverted_profile const & ip,
 		check_mtime(filename, header);
 	}
 
+	release_image(image);
+}
+
+
+/// the images shared by populate_for_images() and its workers
+struct image_queue {
+	vector<inverted_profile const *> profiles;
+	vector<loaded_image> images;
+	string_filter const * symbol_filter;
+	extra_images const * extra_found_images;
+	/// the next image to load
+	size_t next;
+	/// the images before this one have been added
+	size_t added;
+	/// how many images can be loaded ahead of the one being added
+	size_t window;
+	/// stop loading, the main thread gave up
+	bool stop;
+	pthread_mutex_t lock;
+	/// signaled when an image is loaded or added
+	pthread_cond_t cond;
+};
+
+
+void * load_images(void * arg)
+{
+	image_queue * queue = static_cast<image_queue *>(arg);
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (!queue->stop && queue->next < queue->images.size() &&
+		       queue->next >= queue->added + queue->window)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (queue->stop || queue->next == queue->images.size())
+			break;
+
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		// exceptions can't cross threads, pass the message on
+		try {
+			load_image(queue->images[i], *queue->profiles[i],
+			           *queue->symbol_filter,
+			           *queue->extra_found_images);
+		} catch (exception const & e) {
+			queue->images[i].error = e.what();
+		}
+		pthread_mutex_lock(&queue->lock);
+
+		queue->images[i].done = true;
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+
+void add_images(profile_container & samples, image_queue & queue,
+                bool * has_debug_info)
+{
+	for (size_t i = 0; i < queue.images.size(); ++i) {
+		pthread_mutex_lock(&queue.lock);
+		while (!queue.images[i].done)
+			pthread_cond_wait(&queue.cond, &queue.lock);
+		pthread_mutex_unlock(&queue.lock);
+
+		add_image(samples, *queue.profiles[i], queue.images[i],
+		          has_debug_info);
+
+		pthread_mutex_lock(&queue.lock);
+		queue.added = i + 1;
+		pthread_cond_broadcast(&queue.cond);
+		pthread_mutex_unlock(&queue.lock);
+	}
+}
+
+}  // anon namespace
+
+
+void
+populate_for_image(profile_container & samples, inverted_profile const & ip,
+	string_filter const & symbol_filter, bool * has_debug_info)
+{
+	loaded_image image;
+
+	try {
+		load_image(image, ip, symbol_filter,
+		           samples.extra_found_images);
+	} catch (...) {
+		release_image(image);
+		throw;
+	}
+
 	if (has_debug_info)
-		*has_debug_info = abfd->has_debug_info();
+		*has_debug_info = false;
+	add_image(samples, ip, image, has_debug_info);
+}
+
+
+void
+populate_for_images(profile_container & samples,
+	list<inverted_profile> const & iprofiles,
+	string_filter const & symbol_filter, bool * has_debug_info, int jobs)
+{
+	list<inverted_profile>::const_iterator it;
+	list<inverted_profile>::const_iterator const end = iprofiles.end();
+
+	if (has_debug_info)
+		*has_debug_info = false;
+
+	if (jobs > (int)iprofiles.size())
+		jobs = iprofiles.size();
 
-	delete abfd;
+	image_queue queue;
+	vector<pthread_t> workers;
+
+	if (jobs > 1) {
+		for (it = iprofiles.begin(); it != end; ++it)
+			queue.profiles.push_back(&*it);
+		queue.images.resize(queue.profiles.size());
+		queue.symbol_filter = &symbol_filter;
+		queue.extra_found_images = &samples.extra_found_images;
+		queue.next = 0;
+		queue.added = 0;
+		queue.window = 2 * jobs;
+		queue.stop = false;
+		pthread_mutex_init(&queue.lock, NULL);
+		pthread_cond_init(&queue.cond, NULL);
+
+		for (int i = 0; i < jobs; ++i) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, load_images, &queue))
+				break;
+			workers.push_back(thread);
+		}
+	}
+
+	if (workers.empty()) {
+		for (it = iprofiles.begin(); it != end; ++it) {
+			bool debug_info = false;
+			populate_for_image(samples, *it, symbol_filter,
+			                   has_debug_info ? &debug_info : 0);
+			if (debug_info)
+				*has_debug_info = true;
+		}
+	} else {
+		try {
+			add_images(samples, queue, has_debug_info);
+		} catch (...) {
+			pthread_mutex_lock(&queue.lock);
+			queue.stop = true;
+			pthread_cond_broadcast(&queue.cond);
+			pthread_mutex_unlock(&queue.lock);
+			for (size_t i = 0; i < workers.size(); ++i)
+				pthread_join(workers[i], NULL);
+			for (size_t i = 0; i < queue.images.size(); ++i)
+				release_image(queue.images[i]);
+			throw;
+		}
+
+		for (size_t i = 0; i < workers.size(); ++i)
+			pthread_join(workers[i], NULL);
+	}
+
+	if (jobs > 1) {
+		pthread_cond_destroy(&queue.cond);
+		pthread_mutex_destroy(&queue.lock);
+	}
 }
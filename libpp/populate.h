@@ -12,6 +12,8 @@
 #ifndef POPULATE_H
 #define POPULATE_H
 
+#include <list>
+
 class profile_container;
 class inverted_profile;
 class string_filter;
@@ -22,4 +24,16 @@ void
 populate_for_image(profile_container & samples, inverted_profile const & ip,
    string_filter const & symbol_filter, bool * has_debug_info);
 
+/**
+ * Load all sample file information for each binary image of iprofiles.
+ * Up to jobs threads open the images and load their sample files ahead
+ * of the main thread, which adds them to samples in the order of
+ * iprofiles: the result doesn't depend on jobs. If non-NULL,
+ * has_debug_info is set to whether any image has debug information.
+ */
+void
+populate_for_images(profile_container & samples,
+   std::list<inverted_profile> const & iprofiles,
+   string_filter const & symbol_filter, bool * has_debug_info, int jobs);
+
 #endif /* POPULATE_H */
@@ -11,14 +11,15 @@
  */
 
 #include <unistd.h>
+#include <pthread.h>
+
 #include <cstring>
+#include <cerrno>
 
 #include <iostream>
 #include <string>
 #include <sstream>
-#include <cstring>
-
-#include <cerrno>
+#include <algorithm>
 
 #include "op_exception.h"
 #include "op_header.h"
@@ -30,6 +31,112 @@
 
 using namespace std;
 
+namespace {
+
+typedef pair<odb_key_t, count_type> sample_t;
+
+/// libodb keeps a process wide list of open sample files, and
+/// populate_for_images() loads sample files from several threads
+pthread_mutex_t odb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void close_sample_file(odb_t & db)
+{
+	pthread_mutex_lock(&odb_lock);
+	odb_close(&db);
+	pthread_mutex_unlock(&odb_lock);
+}
+
+
+bool less_sample_key(sample_t const & lhs, sample_t const & rhs)
+{
+	return lhs.first < rhs.first;
+}
+
+
+bool less_key(sample_t const & lhs, odb_key_t rhs)
+{
+	return lhs.first < rhs;
+}
+
+
+/// the next sample of one of the runs merged by merge_runs()
+struct run_cursor {
+	vector<sample_t>::const_iterator it;
+	vector<sample_t>::const_iterator end;
+
+	/// the heap is a max heap, put the lowest key on top
+	bool operator<(run_cursor const & rhs) const {
+		return rhs.it->first < it->first;
+	}
+};
+
+
+/**
+ * Merge runs of samples sorted by key into merged, adding up the counts
+ * of a key found in several runs. The runs are emptied. A heap of the
+ * runs' next samples gives the next key to output, so merging n samples
+ * from k runs costs n log k, not n k as merging them two by two would.
+ */
+void merge_runs(vector<vector<sample_t> > & runs, vector<sample_t> & merged)
+{
+	vector<run_cursor> heap;
+	size_t total = 0;
+	size_t last_run = 0;
+
+	for (size_t i = 0; i < runs.size(); ++i) {
+		if (runs[i].empty())
+			continue;
+		run_cursor cursor = { runs[i].begin(), runs[i].end() };
+		heap.push_back(cursor);
+		total += runs[i].size();
+		last_run = i;
+	}
+
+	merged.clear();
+	if (heap.size() == 1) {
+		merged.swap(runs[last_run]);
+		return;
+	}
+
+	merged.reserve(total);
+	make_heap(heap.begin(), heap.end());
+	while (!heap.empty()) {
+		pop_heap(heap.begin(), heap.end());
+		run_cursor & next = heap.back();
+		if (!merged.empty() && merged.back().first == next.it->first)
+			merged.back().second += next.it->second;
+		else
+			merged.push_back(*next.it);
+		if (++next.it == next.end)
+			heap.pop_back();
+		else
+			push_heap(heap.begin(), heap.end());
+	}
+
+	for (size_t i = 0; i < runs.size(); ++i)
+		vector<sample_t>().swap(runs[i]);
+}
+
+
+void check_version(string const & filename)
+{
+	// Check first if the sample file version is ok else odb_open() can
+	// fail and the error message will be obscure.
+	opd_header head = read_header(filename);
+
+	if (head.version != OPD_VERSION) {
+		ostringstream os;
+		os << "oprofpp: samples files version mismatch." << endl
+		   << "Be sure you are running the oprofile post-profile tool that" << endl
+		   << "matches the version of operf used to collect the profile" << endl;
+		throw op_fatal_error(os.str());
+	}
+}
+
+} // anonymous namespace
+
+
 profile_t::profile_t()
 	: start_offset(0)
 {
@@ -41,6 +148,14 @@ count_type profile_t::sample_count(string const & filename)
 {
 	odb_t samples_db;
 
+	if (odb_is_frozen(filename.c_str(), sizeof(struct opd_header))) {
+		odb_frozen_t frozen;
+		open_frozen_file(filename, frozen);
+		count_type count = frozen.descr->total_count;
+		odb_frozen_close(&frozen);
+		return count;
+	}
+
 	open_sample_file(filename, samples_db);
 
 	count_type count = 0;
@@ -50,7 +165,7 @@ count_type profile_t::sample_count(string const & filename)
 	for (pos = 0; pos < node_nr; ++pos)
 		count += node[pos].value;
 
-	odb_close(&samples_db);
+	close_sample_file(samples_db);
 
 	return count;
 }
@@ -58,56 +173,149 @@ count_type profile_t::sample_count(string const & filename)
 //static member
 void profile_t::open_sample_file(string const & filename, odb_t & db)
 {
-	// Check first if the sample file version is ok else odb_open() can
-	// fail and the error message will be obscure.
-	opd_header head = read_header(filename);
-
-	if (head.version != OPD_VERSION) {
-		ostringstream os;
-		os << "oprofpp: samples files version mismatch." << endl
-		   << "Be sure you are running the oprofile post-profile tool that" << endl
-		   << "matches the version of operf used to collect the profile" << endl;
-		throw op_fatal_error(os.str());
-	}
+	check_version(filename);
 
+	pthread_mutex_lock(&odb_lock);
 	int rc = odb_open(&db, filename.c_str(), ODB_RDONLY,
 		sizeof(struct opd_header));
+	pthread_mutex_unlock(&odb_lock);
 
 	if (rc)
 		throw op_fatal_error(filename + ": " + strerror(rc));
 }
 
-void profile_t::add_sample_file(string const & filename)
+
+void profile_t::open_frozen_file(string const & filename, odb_frozen_t & db)
 {
-	odb_t samples_db;
+	check_version(filename);
 
-	open_sample_file(filename, samples_db);
+	int rc = odb_frozen_open(&db, filename.c_str(),
+		sizeof(struct opd_header));
 
-	opd_header const & head =
-		*static_cast<opd_header *>(odb_get_data(&samples_db));
+	if (rc)
+		throw op_fatal_error(filename + ": " + strerror(rc));
+}
 
+
+void profile_t::set_header(opd_header const & head, string const & filename)
+{
 	// if we already read a sample file header pointer is non null
 	if (file_header.get())
 		op_check_header(head, *file_header, filename);
 	else
 		file_header.reset(new opd_header(head));
+}
+
+
+void profile_t::read_samples(string const & filename,
+                             ordered_samples_t & samples)
+{
+	if (odb_is_frozen(filename.c_str(), sizeof(struct opd_header))) {
+		odb_frozen_t frozen;
+		odb_frozen_iterator_t it;
+		odb_key_t key;
+		odb_value_t value;
+
+		open_frozen_file(filename, frozen);
+		set_header(*static_cast<opd_header *>(odb_frozen_get_data(&frozen)),
+		           filename);
+
+		// already sorted, only a repeated key needs care
+		samples.reserve(frozen.descr->nr_node);
+		odb_frozen_get_iterator(&frozen, &it);
+		while (odb_frozen_next(&it, &key, &value)) {
+			if (!samples.empty() && samples.back().first == key)
+				samples.back().second += value;
+			else
+				samples.push_back(sample_t(key, value));
+		}
+
+		odb_frozen_close(&frozen);
+		return;
+	}
+
+	odb_t samples_db;
+
+	open_sample_file(filename, samples_db);
+
+	set_header(*static_cast<opd_header *>(odb_get_data(&samples_db)),
+	           filename);
 
 	odb_node_nr_t node_nr, pos;
 	odb_node_t * node = odb_get_iterator(&samples_db, &node_nr);
 
-	for (pos = 0; pos < node_nr; ++pos) {
-		ordered_samples_t::iterator it = 
-		    ordered_samples.find(node[pos].key);
-		if (it != ordered_samples.end()) {
-			it->second += node[pos].value;
+	samples.reserve(node_nr);
+	for (pos = 0; pos < node_nr; ++pos)
+		samples.push_back(sample_t(node[pos].key, node[pos].value));
+
+	close_sample_file(samples_db);
+
+	sort(samples.begin(), samples.end(), less_sample_key);
+
+	// a key is in the hash table only once unless odb_add_node() added
+	// it more than once
+	ordered_samples_t::iterator out = samples.begin();
+	ordered_samples_t::const_iterator it;
+	for (it = samples.begin(); it != samples.end(); ++it) {
+		if (out != samples.begin() && (out - 1)->first == it->first)
+			(out - 1)->second += it->second;
+		else
+			*out++ = *it;
+	}
+	samples.erase(out, samples.end());
+}
+
+
+void profile_t::add_sample_file(string const & filename)
+{
+	ordered_samples_t samples;
+
+	read_samples(filename, samples);
+	add_samples(samples);
+}
+
+
+void profile_t::add_sample_files(list<string> const & filenames)
+{
+	vector<ordered_samples_t> runs(filenames.size() + 1);
+
+	list<string>::const_iterator it = filenames.begin();
+	for (size_t i = 1; it != filenames.end(); ++it, ++i)
+		read_samples(*it, runs[i]);
+
+	runs[0].swap(ordered_samples);
+	merge_runs(runs, ordered_samples);
+}
+
+
+void profile_t::add_samples(ordered_samples_t & samples)
+{
+	if (ordered_samples.empty()) {
+		ordered_samples.swap(samples);
+		return;
+	}
+
+	ordered_samples_t merged;
+	merged.reserve(ordered_samples.size() + samples.size());
+
+	ordered_samples_t::iterator it1 = ordered_samples.begin();
+	ordered_samples_t::iterator it2 = samples.begin();
+	while (it1 != ordered_samples.end() && it2 != samples.end()) {
+		if (it1->first < it2->first) {
+			merged.push_back(*it1++);
+		} else if (it2->first < it1->first) {
+			merged.push_back(*it2++);
 		} else {
-			ordered_samples_t::value_type
-				val(node[pos].key, node[pos].value);
-			ordered_samples.insert(val);
+			merged.push_back(sample_t(it1->first,
+			                          it1->second + it2->second));
+			++it1;
+			++it2;
 		}
 	}
+	merged.insert(merged.end(), it1, ordered_samples.end());
+	merged.insert(merged.end(), it2, samples.end());
 
-	odb_close(&samples_db);
+	ordered_samples.swap(merged);
 }
 
 
@@ -153,10 +361,11 @@ profile_t::samples_range(odb_key_t start, odb_key_t end) const
 			"oprofile-list@lists.sourceforge.net");
 	}
 
-	ordered_samples_t::const_iterator first = 
-		ordered_samples.lower_bound(start);
+	ordered_samples_t::const_iterator first =
+		lower_bound(ordered_samples.begin(), ordered_samples.end(),
+		            start, less_key);
 	ordered_samples_t::const_iterator last =
-		ordered_samples.lower_bound(end);
+		lower_bound(first, ordered_samples.end(), end, less_key);
 
 	return make_pair(const_iterator(first, start_offset),
 		const_iterator(last, start_offset));
@@ -14,7 +14,8 @@
 #define PROFILE_H
 
 #include <string>
-#include <map>
+#include <vector>
+#include <list>
 #include <iterator>
 
 #include "odb.h"
@@ -64,6 +65,12 @@ public:
 	 */
 	void add_sample_file(std::string const & filename);
 
+	/**
+	 * same as add_sample_file() for each of filenames, but all the
+	 * sample files are merged together in a single pass.
+	 */
+	void add_sample_files(std::list<std::string> const & filenames);
+
 	/// Set an appropriate start offset, see comments below.
 	void set_offset(op_bfd const & abfd);
 	u64 get_offset(void) const { return start_offset; }
@@ -88,18 +95,31 @@ private:
 	/// an exception.
 	static void
 	open_sample_file(std::string const & filename, odb_t &);
+	/// same as open_sample_file() for a frozen sample file
+	static void
+	open_frozen_file(std::string const & filename, odb_frozen_t &);
+
+	/// check header against the previous sample files then copy it
+	void set_header(opd_header const & header, std::string const & filename);
+
+	/// storage type for samples sorted by eip, each eip appears once
+	typedef std::vector<std::pair<odb_key_t, count_type> > ordered_samples_t;
+
+	/// read the samples of a sample file, sorted by eip, check its header
+	void read_samples(std::string const & filename,
+	                  ordered_samples_t & samples);
+
+	/// merge samples, sorted by eip, into ordered_samples
+	void add_samples(ordered_samples_t & samples);
 
 	/// copy of the samples file header
 	scoped_ptr<opd_header> file_header;
 
-	/// storage type for samples sorted by eip
-	typedef std::map<odb_key_t, count_type> ordered_samples_t;
-
 	/**
 	 * Samples are stored in hash table, iterating over hash table don't
 	 * provide any ordering, the above count() interface rely on samples
-	 * ordered by eip. This map is only a temporary storage where samples
-	 * are ordered by eip.
+	 * ordered by eip. This array holds the samples of all the sample
+	 * files sorted by eip; frozen sample files are already sorted.
 	 */
 	ordered_samples_t ordered_samples;
 
@@ -46,6 +46,73 @@ struct filename_by_samples {
 	double percent;
 };
 
+
+/**
+ * Find the samples of the symbols of an image, visited by increasing
+ * offset. Each lookup moves forward from where the previous one stopped
+ * instead of searching all the samples, so a symbol without samples
+ * costs next to nothing and the whole image is a single pass over its
+ * symbols and samples.
+ */
+class sample_sweep {
+public:
+	sample_sweep(profile_t const & profile_)
+		:
+		profile(profile_),
+		all(profile_.samples_range()),
+		first(all.first),
+		last(all.first),
+		prev_start(0),
+		prev_end(0)
+	{
+	}
+
+	/// same as profile.samples_range(start, end)
+	profile_t::iterator_pair
+	range(unsigned long long start, unsigned long long end);
+
+private:
+	profile_t const & profile;
+	profile_t::iterator_pair const all;
+	/// the first samples at or after prev_start and prev_end
+	profile_t::const_iterator first;
+	profile_t::const_iterator last;
+	unsigned long long prev_start;
+	unsigned long long prev_end;
+};
+
+
+profile_t::iterator_pair
+sample_sweep::range(unsigned long long start, unsigned long long end)
+{
+	// samples_range() handles symbols before the profile offset and
+	// reports broken layouts, none of which moves the sweep
+	if (start < profile.get_offset() || start > end)
+		return profile.samples_range(start, end);
+
+	if (start < prev_start) {
+		// not sorted by offset, search from scratch
+		profile_t::iterator_pair p_it =
+			profile.samples_range(start, end);
+		first = p_it.first;
+		last = p_it.second;
+	} else {
+		// symbols can overlap, else start from the previous end
+		if (start >= prev_end)
+			first = last;
+		while (first != all.second && first.vma() < start)
+			++first;
+		last = first;
+		while (last != all.second && last.vma() < end)
+			++last;
+	}
+
+	prev_start = start;
+	prev_end = end;
+
+	return make_pair(first, last);
+}
+
 }  // anon namespace
 
 
@@ -76,6 +143,7 @@ void profile_container::add(profile_t const & profile,
 {
 	string const image_name = abfd.get_filename();
 	count_type sym_count_total = 0;
+	sample_sweep sweep(profile);
 
 	for (symbol_index_t i = 0; i < abfd.syms.size(); ++i) {
 
@@ -84,8 +152,10 @@ void profile_container::add(profile_t const & profile,
 
 		abfd.get_symbol_range(i, start, end);
 
-		profile_t::iterator_pair p_it =
-			profile.samples_range(start, end);
+		profile_t::iterator_pair p_it = sweep.range(start, end);
+		if (p_it.first == p_it.second)
+			continue;
+
 		count_type count = accumulate(p_it.first, p_it.second, 0ull);
 
 		// skip entries with no samples
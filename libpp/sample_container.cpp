@@ -10,8 +10,6 @@
  */
 
 #include <climits>
-#include <set>
-#include <numeric>
 #include <algorithm>
 #include <vector>
 
@@ -21,26 +19,60 @@ using namespace std;
 
 namespace {
 
-// FIXME: efficiency ?
-count_array_t add_counts(count_array_t const & counts,
-			   sample_entry const * s)
+typedef sample_container::samples_storage::value_type sample_t;
+
+bool less_sample_index(sample_t const & lhs, sample_t const & rhs)
+{
+	return lhs.first < rhs.first;
+}
+
+
+bool sample_before_symbol(sample_t const & lhs, symbol_entry const * rhs)
 {
-	count_array_t temp(counts);
-	temp += s->counts;
-	return temp;
+	return lhs.first.first < rhs;
 }
 
+
+bool symbol_before_sample(symbol_entry const * lhs, sample_t const & rhs)
+{
+	return lhs < rhs.first.first;
+}
+
+
+/// sort the samples by file location, keeping the storage order of equals
+struct less_loc_index {
+	less_loc_index(vector<file_location> const & keys_) : keys(keys_) {}
+
+	bool operator()(size_t lhs, size_t rhs) const {
+		if (keys[lhs] < keys[rhs])
+			return true;
+		if (keys[rhs] < keys[lhs])
+			return false;
+		return lhs < rhs;
+	}
+
+	vector<file_location> const & keys;
+};
+
 } // namespace anon
 
 
+sample_container::sample_container()
+	: nr_sorted(0)
+{
+}
+
+
 sample_container::samples_iterator sample_container::begin() const
 {
+	sort_samples();
 	return samples.begin();
 }
 
 
 sample_container::samples_iterator sample_container::end() const
 {
+	sort_samples();
 	return samples.end();
 }
 
@@ -48,61 +80,102 @@ sample_container::samples_iterator sample_container::end() const
 sample_container::samples_iterator
 sample_container::begin(symbol_entry const * symbol) const
 {
-	samples_storage::key_type key(symbol, 0);
-
-	return samples.lower_bound(key);
+	sort_samples();
+	return lower_bound(samples.begin(), samples.end(), symbol,
+	                   sample_before_symbol);
 }
 
 
 sample_container::samples_iterator 
 sample_container::end(symbol_entry const * symbol) const
 {
-	samples_storage::key_type key(symbol, ~bfd_vma(0));
-
-	return samples.upper_bound(key);
+	sort_samples();
+	return upper_bound(samples.begin(), samples.end(), symbol,
+	                   symbol_before_sample);
 }
 
 
 void sample_container::insert(symbol_entry const * symbol,
                               sample_entry const & sample)
 {
-	samples_storage::key_type key(symbol, sample.vma);
+	samples.push_back(sample_t(sample_index_t(symbol, sample.vma), sample));
+}
+
 
-	samples_storage::iterator it = samples.find(key);
-	if (it != samples.end()) {
-		it->second.counts += sample.counts;
-	} else {
-		samples[key] = sample;
+void sample_container::sort_samples() const
+{
+	if (nr_sorted == samples.size())
+		return;
+
+	// the first sample inserted at a key gives the entry, the next
+	// ones only add their counts, so keep the insertion order
+	stable_sort(samples.begin() + nr_sorted, samples.end(),
+	            less_sample_index);
+	inplace_merge(samples.begin(), samples.begin() + nr_sorted,
+	              samples.end(), less_sample_index);
+
+	samples_storage::iterator out = samples.begin();
+	samples_storage::const_iterator it;
+	for (it = samples.begin(); it != samples.end(); ++it) {
+		if (out != samples.begin() && (out - 1)->first == it->first)
+			(out - 1)->second.counts += it->second.counts;
+		else if (out != it)
+			*out++ = *it;
+		else
+			++out;
 	}
+	samples.erase(out, samples.end());
+	nr_sorted = samples.size();
+
+	by_loc_keys.clear();
+	by_loc_samples.clear();
 }
 
 
 count_array_t
-sample_container::accumulate_samples(debug_name_id filename_id) const
+sample_container::accumulate_by_loc(file_location const & lower,
+                                    file_location const & upper) const
 {
 	build_by_loc();
 
-	sample_entry lower, upper;
+	vector<file_location> const & keys = by_loc_keys;
+	vector<file_location>::const_iterator first =
+		lower_bound(keys.begin(), keys.end(), lower);
+	vector<file_location>::const_iterator last =
+		upper_bound(first, keys.end(), upper);
 
-	lower.file_loc.filename = upper.file_loc.filename = filename_id;
-	lower.file_loc.linenr = 0;
-	upper.file_loc.linenr = INT_MAX;
+	count_array_t counts;
+	size_t i = first - keys.begin();
+	size_t const end = last - keys.begin();
+	for (; i != end; ++i)
+		counts += by_loc_samples[i]->counts;
 
-	typedef samples_by_loc_t::const_iterator iterator;
+	return counts;
+}
+
+
+count_array_t
+sample_container::accumulate_samples(debug_name_id filename_id) const
+{
+	file_location lower, upper;
 
-	iterator it1 = samples_by_loc.lower_bound(&lower);
-	iterator it2 = samples_by_loc.upper_bound(&upper);
+	lower.filename = upper.filename = filename_id;
+	lower.linenr = 0;
+	upper.linenr = INT_MAX;
 
-	return accumulate(it1, it2, count_array_t(), add_counts);
+	return accumulate_by_loc(lower, upper);
 }
 
 
 sample_entry const *
 sample_container::find_by_vma(symbol_entry const * symbol, bfd_vma vma) const
 {
-	sample_index_t key(symbol, vma);
-	samples_iterator it = samples.find(key);
-	if (it != samples.end())
+	sort_samples();
+
+	sample_t key(sample_index_t(symbol, vma), sample_entry());
+	samples_iterator it = lower_bound(samples.begin(), samples.end(), key,
+	                                  less_sample_index);
+	if (it != samples.end() && it->first == key.first)
 		return &it->second;
 
 	return 0;
@@ -113,29 +186,35 @@ count_array_t
 sample_container::accumulate_samples(debug_name_id filename,
                                      size_t linenr) const
 {
-	build_by_loc();
-
-	sample_entry sample;
-
-	sample.file_loc.filename = filename;
-	sample.file_loc.linenr = linenr;
-
-	typedef pair<samples_by_loc_t::const_iterator,
-		samples_by_loc_t::const_iterator> it_pair;
+	file_location loc;
 
-	it_pair itp = samples_by_loc.equal_range(&sample);
+	loc.filename = filename;
+	loc.linenr = linenr;
 
-	return accumulate(itp.first, itp.second, count_array_t(), add_counts);
+	return accumulate_by_loc(loc, loc);
 }
 
 
 void sample_container::build_by_loc() const
 {
-	if (!samples_by_loc.empty())
+	sort_samples();
+
+	if (!by_loc_keys.empty() || samples.empty())
 		return;
 
-	samples_iterator cit = samples.begin();
-	samples_iterator end = samples.end();
-	for (; cit != end; ++cit)
-		samples_by_loc.insert(&cit->second);
+	vector<file_location> keys(samples.size());
+	vector<size_t> order(samples.size());
+	for (size_t i = 0; i < samples.size(); ++i) {
+		keys[i] = samples[i].second.file_loc;
+		order[i] = i;
+	}
+
+	sort(order.begin(), order.end(), less_loc_index(keys));
+
+	by_loc_keys.resize(order.size());
+	by_loc_samples.resize(order.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		by_loc_keys[i] = keys[order[i]];
+		by_loc_samples[i] = &samples[order[i]].second;
+	}
 }
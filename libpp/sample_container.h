@@ -12,9 +12,8 @@
 #ifndef SAMPLE_CONTAINER_H
 #define SAMPLE_CONTAINER_H
 
-#include <map>
-#include <set>
 #include <string>
+#include <vector>
 
 #include "symbol.h"
 #include "symbol_functors.h"
@@ -23,13 +22,20 @@
  * Arbitrary container of sample entries. Can return
  * number of samples for a file or line number and
  * return the particular sample information for a VMA.
+ *
+ * The samples are kept in an array sorted by symbol then vma, so the
+ * samples of a symbol are a contiguous slice of it. Inserted samples
+ * are appended, then sorted and combined on the first lookup.
  */
 class sample_container {
 	typedef std::pair<symbol_entry const *, bfd_vma> sample_index_t;
 public:
-	typedef std::map<sample_index_t, sample_entry> samples_storage;
+	typedef std::vector<std::pair<sample_index_t, sample_entry> >
+		samples_storage;
 	typedef samples_storage::const_iterator samples_iterator;
 
+	sample_container();
+
 	/// return iterator to the first samples for this symbol
 	samples_iterator begin(symbol_entry const *) const;
 	/// return iterator to the last samples for this symbol
@@ -55,23 +61,32 @@ public:
 					 bfd_vma vma) const;
 
 private:
+	/// sort the samples inserted since the last lookup
+	void sort_samples() const;
+
 	/// build the symbol by file-location cache
 	void build_by_loc() const;
 
-	/// main sample entry container
-	samples_storage samples;
+	/// return the samples at file locations [lower, upper]
+	count_array_t accumulate_by_loc(file_location const & lower,
+	                                file_location const & upper) const;
 
-	typedef std::multiset<sample_entry const *, less_by_file_loc>
-		samples_by_loc_t;
+	/// main sample entry container, sorted on lookups so mutable
+	mutable samples_storage samples;
 
-	// must be declared after the samples_storage to ensure a
-	// correct life-time.
+	/// the first samples_storage entries are sorted, with unique keys
+	mutable size_t nr_sorted;
 
 	/**
-	 * Sample entries by file location. Lazily built when necessary,
-	 * so mutable.
+	 * Sample entries by file location, in two arrays: the sorted file
+	 * locations, searched without touching the samples, then the
+	 * samples at these locations. Lazily built when necessary, so
+	 * mutable.
 	 */
-	mutable samples_by_loc_t samples_by_loc;
+	//@{
+	mutable std::vector<file_location> by_loc_keys;
+	mutable std::vector<sample_entry const *> by_loc_samples;
+	//@}
 };
 
 #endif /* SAMPLE_CONTAINER_H */
@@ -24,10 +24,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <elf.h>
+#include <pthread.h>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <iostream>
+#include <iomanip>
 #include <sstream>
 #include <fstream>
 #include <sstream>
@@ -44,8 +46,11 @@ namespace {
 #ifndef NT_GNU_BUILD_ID
 #define NT_GNU_BUILD_ID 3
 #endif
+/// set by get_build_id(), protected by bfd_lock
 static size_t build_id_size;
 
+pthread_mutex_t bfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 void check_format(string const & file, bfd ** ibfd)
 {
@@ -369,8 +374,22 @@ void fixup_linenr(bfd * abfd, asection * section, asymbol ** syms,
 } // namespace anon
 
 
+bfd_lock_guard::bfd_lock_guard()
+{
+	pthread_mutex_lock(&bfd_lock);
+}
+
+
+bfd_lock_guard::~bfd_lock_guard()
+{
+	pthread_mutex_unlock(&bfd_lock);
+}
+
+
 bfd * open_bfd(string const & file)
 {
+	bfd_lock_guard guard;
+
 	/* bfd keeps its own reference to the filename char *,
 	 * so it must have a lifetime longer than the ibfd */
 	bfd * ibfd = bfd_openr(file.c_str(), NULL);
@@ -387,6 +406,8 @@ bfd * open_bfd(string const & file)
 
 bfd * fdopen_bfd(string const & file, int fd)
 {
+	bfd_lock_guard guard;
+
 	/* bfd keeps its own reference to the filename char *,
 	 * so it must have a lifetime longer than the ibfd */
 	bfd * ibfd = bfd_fdopenr(file.c_str(), NULL, fd);
@@ -411,12 +432,16 @@ bool find_separate_debug_file(bfd * ibfd, string const & filepath_in,
 	// To my knowledge, the build-id should not be bigger than 20 chars.
 	unsigned char buildid[64];
 	
-	if (get_build_id(ibfd, buildid) &&
-	   find_debuginfo_file_by_buildid(buildid, debug_filename))
-		return true;
+	{
+		bfd_lock_guard guard;
 
-	if (!get_debug_link_info(ibfd, basename, crc32))
-		return false;
+		if (get_build_id(ibfd, buildid) &&
+		   find_debuginfo_file_by_buildid(buildid, debug_filename))
+			return true;
+
+		if (!get_debug_link_info(ibfd, basename, crc32))
+			return false;
+	}
 
 	/* Use old method of finding debuginfo file by comparing runtime binary's
 	 * CRC with the CRC we calculate from the debuginfo file's contents.
@@ -454,6 +479,23 @@ bool find_separate_debug_file(bfd * ibfd, string const & filepath_in,
 }
 
 
+string const build_id_string(bfd * ibfd)
+{
+	bfd_lock_guard guard;
+	unsigned char buildid[64];
+
+	if (!get_build_id(ibfd, buildid))
+		return string();
+
+	ostringstream result;
+	result << hex << setfill('0');
+	for (size_t i = 0; i < build_id_size; ++i)
+		result << setw(2) << unsigned(buildid[i]);
+
+	return result.str();
+}
+
+
 bool interesting_symbol(asymbol * sym)
 {
 	// #717720 some binutils are miscompiled by gcc 2.95, one of the
@@ -556,8 +598,10 @@ bfd_info::~bfd_info()
 
 void bfd_info::close()
 {
-	if (abfd)
+	if (abfd) {
+		bfd_lock_guard guard;
 		bfd_close(abfd);
+	}
 }
 
 #if SYNTHESIZE_SYMBOLS
@@ -730,6 +774,8 @@ void bfd_info::get_symbols()
 	if (!abfd)
 		return;
 
+	bfd_lock_guard guard;
+
 	cverb << vbfd << "bfd_info::get_symbols() for "
 	      << bfd_get_filename(abfd) << endl;
 
@@ -776,6 +822,7 @@ find_nearest_line(bfd_info const & b, op_bfd_symbol const & sym,
 	asymbol * empty_syms[1];
 	bfd_vma pc;
 	bool ret;
+	bfd_lock_guard guard;
 
 	if (!b.valid())
 		goto fail;
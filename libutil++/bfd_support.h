@@ -24,6 +24,18 @@
 
 class op_bfd_symbol;
 
+/**
+ * libbfd isn't thread safe. The functions here and the op_bfd members
+ * calling into libbfd hold this while they do, so that several threads
+ * can each use their own op_bfd; the rest of their work, filtering and
+ * sorting the symbols, runs concurrently.
+ */
+class bfd_lock_guard : noncopyable {
+public:
+	bfd_lock_guard();
+	~bfd_lock_guard();
+};
+
 /// holder for BFD state we must keep
 struct bfd_info {
 	bfd_info() : abfd(0), nr_syms(0), synth_syms(0), image_bfd_info(0) {}
@@ -126,6 +138,9 @@ find_separate_debug_file(bfd * ibfd,
                          std::string & debug_filename,
                          extra_images const & extra);
 
+/// return the build-id of ibfd in hexadecimal, an empty string if none
+std::string const build_id_string(bfd * ibfd);
+
 /// open the given BFD
 bfd * open_bfd(std::string const & file);
 
@@ -32,6 +32,7 @@
 #include "locate_images.h"
 #include "string_filter.h"
 #include "stream_util.h"
+#include "symbol_cache.h"
 #include "cverb.h"
 
 using namespace std;
@@ -89,6 +90,17 @@ op_bfd_symbol::op_bfd_symbol(bfd_vma vma, size_t size, string const & name)
 }
 
 
+op_bfd_symbol::op_bfd_symbol(unsigned long value, unsigned long filepos,
+                             bfd_vma vma, size_t size, string const & name,
+                             bool hidden, bool weak)
+	: bfd_symbol(0), symb_value(value),
+	  section_filepos(filepos), section_vma(vma),
+	  symb_size(size), symb_name(name),
+	  symb_hidden(hidden), symb_weak(weak), symb_artificial(false)
+{
+}
+
+
 bool op_bfd_symbol::operator<(op_bfd_symbol const & rhs) const
 {
 	return filepos() < rhs.filepos();
@@ -108,6 +120,7 @@ op_bfd::op_bfd(string const & fname, string_filter const & symbol_filter,
 	extra_found_images(extra_images),
 	file_size(-1),
 	anon_obj(false),
+	syms_filter(symbol_filter),
 	vma_adj(0)
 {
 	fd =  -1;
@@ -176,7 +189,7 @@ op_bfd::op_bfd(string const & fname, string_filter const & symbol_filter,
 		}
 	}
 
-	get_symbols(symbols);
+	get_cached_symbols(symbols, image_path, st.st_size, st.st_mtime);
 
 out:
 	add_symbols(symbols, symbol_filter);
@@ -291,6 +304,87 @@ void op_bfd::get_symbols(op_bfd::symbols_found_t & symbols)
 	}
 }
 
+
+
+void op_bfd::get_cached_symbols(op_bfd::symbols_found_t & symbols,
+                                string const & image_path,
+                                off_t size, time_t mtime)
+{
+	// the symbols of an anonymous object are created from the jit
+	// dump each time
+	if (anon_obj) {
+		get_symbols(symbols);
+		return;
+	}
+
+	scoped_ptr<symbol_cache> cache(
+		new symbol_cache(ibfd, image_path, size, mtime));
+	if (cache->load(symbols, vma_adj)) {
+		symbols_cache.swap(cache);
+		return;
+	}
+
+	get_symbols(symbols);
+	cache->save(symbols, vma_adj, dbfd.valid() ? debug_filename : string());
+}
+
+
+void op_bfd::get_bfd_symbols()
+{
+	if (!symbols_cache.get())
+		return;
+	scoped_ptr<symbol_cache> cache;
+	cache.swap(symbols_cache);
+
+	bfd_vma const cached_vma_adj = vma_adj;
+	symbols_found_t symbols;
+	get_symbols(symbols);
+	// add_symbols() filters symbols in place
+	symbols_found_t const all_symbols(symbols);
+
+	// samples are already attributed to syms by index and callers hold
+	// references to its elements, so syms keeps them whatever the binary
+	// holds now; only their bfd symbols are taken from it
+	vector<op_bfd_symbol> read;
+	read.swap(syms);
+	add_symbols(symbols, syms_filter);
+	read.swap(syms);
+
+	bool same = vma_adj == cached_vma_adj && read.size() == syms.size();
+	for (size_t i = 0; same && i < read.size(); ++i)
+		same = read[i].filepos() == syms[i].filepos() &&
+			read[i].size() == syms[i].size();
+
+	if (same) {
+		for (size_t i = 0; i < syms.size(); ++i)
+			syms[i] = read[i];
+		return;
+	}
+
+	cverb << vbfd << "symbol cache entry out of date for "
+	      << filename << ", rewriting it" << endl;
+	cache->save(all_symbols, vma_adj,
+	            dbfd.valid() ? debug_filename : string());
+
+	bool const vma_adj_changed = vma_adj != cached_vma_adj;
+	vma_adj = cached_vma_adj;
+	if (vma_adj_changed)
+		return;
+
+	// the symbols not found at the same place in the binary keep no
+	// bfd symbol, line number and contents lookups fail for them
+	map<unsigned long, size_t> read_index;
+	for (size_t i = 0; i < read.size(); ++i)
+		read_index[read[i].filepos()] = i;
+	for (size_t i = 0; i < syms.size(); ++i) {
+		map<unsigned long, size_t>::const_iterator it =
+			read_index.find(syms[i].filepos());
+		if (it != read_index.end() &&
+		    read[it->second].size() == syms[i].size())
+			syms[i] = read[it->second];
+	}
+}
+
 #define KERN_ADDR_SPACE_START_SYMBOL  "_text"
 #define KERN_ADDR_SPACE_END_SYMBOL    "_etext"
 
@@ -453,8 +547,15 @@ symbol_has_contents(symbol_index_t sym_idx)
 bool op_bfd::
 get_symbol_contents(symbol_index_t sym_index, unsigned char * contents) const
 {
+	// reading the bfd symbols back doesn't change what syms describe
+	const_cast<op_bfd *>(this)->get_bfd_symbols();
+
 	op_bfd_symbol const & bfd_sym = syms[sym_index];
+	if (!bfd_sym.symbol())
+		return false;
+
 	size_t size = bfd_sym.size();
+	bfd_lock_guard guard;
 
 	if (!bfd_get_section_contents(ibfd.abfd, bfd_sym.symbol()->section, 
 				 contents, 
@@ -495,6 +596,9 @@ bool op_bfd::has_debug_info() const
 bool op_bfd::get_linenr(symbol_index_t sym_idx, bfd_vma offset,
 			string & source_filename, unsigned int & linenr) const
 {
+	// reading the bfd symbols back doesn't change what syms describe
+	const_cast<op_bfd *>(this)->get_bfd_symbols();
+
 	if (!has_debug_info())
 		return false;
 
@@ -24,11 +24,12 @@
 #include "locate_images.h"
 #include "utility.h"
 #include "cached_value.h"
+#include "string_filter.h"
 #include "op_types.h"
 
 class op_bfd;
-class string_filter;
 class extra_images;
+class symbol_cache;
 
 /// all symbol vector indexing uses this type
 typedef size_t symbol_index_t;
@@ -47,6 +48,12 @@ public:
 	/// ctor for artificial symbols
 	op_bfd_symbol(bfd_vma vma, size_t size, std::string const & name);
 
+	/// ctor for symbols read back from the symbol cache, they have no
+	/// bfd symbol until op_bfd reads the symbol table again
+	op_bfd_symbol(unsigned long value, unsigned long section_filepos,
+	              bfd_vma section_vma, size_t size,
+	              std::string const & name, bool hidden, bool weak);
+
 	bfd_vma vma() const { return symb_value + section_vma; }
 	unsigned long value() const { return symb_value; }
 	unsigned long filepos() const { return symb_value + section_filepos; }
@@ -224,6 +231,27 @@ private:
 	 */
 	void get_symbols(symbols_found_t & symbols);
 
+	/**
+	 * get_symbols() through the symbol cache: the symbols are read
+	 * from the cache entry of the binary if there is a valid one,
+	 * else from the binary and saved in the cache. size and mtime
+	 * are the stat of the binary.
+	 */
+	void get_cached_symbols(symbols_found_t & symbols,
+	                        std::string const & image_path,
+	                        off_t size, time_t mtime);
+
+	/**
+	 * Symbols read from the cache have no bfd symbol, which line
+	 * number and contents lookups need. Read the symbol table of the
+	 * binary then, and give the bfd symbols to syms. Samples are
+	 * already attributed to syms, so its elements stay in place even
+	 * if the symbol table doesn't match the cache entry anymore: the
+	 * entry is rewritten, and the symbols not found at the same place
+	 * in the binary get no bfd symbol.
+	 */
+	void get_bfd_symbols();
+
 	/* functions for reading kallsyms */
 	void get_kallsym_symbols(symbols_found_t & symbols, std::ifstream& infile);
 
@@ -294,6 +322,13 @@ private:
 
 	bool anon_obj;
 
+	/// the cache entry syms were read from, until get_bfd_symbols()
+	/// is called; null if they were read from the binary
+	scoped_ptr<symbol_cache> symbols_cache;
+
+	/// the filter syms were built with, for get_bfd_symbols()
+	string_filter syms_filter;
+
 	/**
 	 * If a runtime binary is prelinked, then its p_vaddr field in the
 	 * first PT_LOAD segment will give the address where the binary will
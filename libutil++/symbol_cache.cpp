@@ -0,0 +1,328 @@
+/**
+ * @file symbol_cache.cpp
+ * On disk cache of the symbols op_bfd reads from binaries
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 16, 2026
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "symbol_cache.h"
+#include "op_bfd.h"
+#include "op_config.h"
+#include "op_file.h"
+#include "op_string.h"
+#include "op_libiberty.h"
+#include "cverb.h"
+
+using namespace std;
+
+extern verbose vbfd;
+
+namespace {
+
+string cache_dir;
+
+#define SYMBOL_CACHE_MAGIC "OPSYMS\0\0"
+#define SYMBOL_CACHE_VERSION 1
+
+/**
+ * An entry starts with this header, followed by the array of symbols,
+ * then by the strings: NUL terminated names the entry refers to by
+ * their offset. Everything is in the host byte order.
+ */
+struct entry_header {
+	char magic[8];
+	u32 version;
+	u32 nr_syms;
+	u64 vma_adj;
+	u64 image_size;
+	u64 image_mtime;
+	u64 debug_size;
+	u64 debug_mtime;
+	u64 strings_size;
+	u32 image_name;
+	/// an empty string if the symbols came from the binary only
+	u32 debug_name;
+};
+
+#define ENTRY_SYM_HIDDEN	1
+#define ENTRY_SYM_WEAK		2
+
+struct entry_symbol {
+	u64 value;
+	u64 section_filepos;
+	u64 section_vma;
+	u64 size;
+	u32 name;
+	u32 flags;
+};
+
+
+/// the strings of an entry being saved
+class string_table {
+public:
+	u32 add(string const & str) {
+		u32 offset = strings.size();
+		strings.insert(strings.end(), str.begin(), str.end());
+		strings.push_back('\0');
+		return offset;
+	}
+
+	vector<char> strings;
+};
+
+
+int write_all(int fd, void const * buf, size_t size)
+{
+	char const * pos = static_cast<char const *>(buf);
+
+	while (size) {
+		ssize_t nr = write(fd, pos, size);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		pos += nr;
+		size -= nr;
+	}
+
+	return 0;
+}
+
+
+/// where the debug file of a build-id would be found
+string const build_id_debug_file(string const & build_id)
+{
+	return string(DEBUGDIR) + "/.build-id/" + build_id.substr(0, 2) +
+		"/" + build_id.substr(2) + ".debug";
+}
+
+}  // anon namespace
+
+
+symbol_cache::symbol_cache(bfd_info const & ibfd, string const & path,
+                           off_t size, time_t mtime)
+	:
+	image_path(path),
+	image_size(size),
+	image_mtime(mtime),
+	separate_debug(!ibfd.has_debug_info())
+{
+	if (cache_dir.empty())
+		return;
+
+	build_id = build_id_string(ibfd.abfd);
+
+	// a stripped binary and its unstripped or prelinked copy share
+	// their build-id, not their symbols, so the size and mtime are part
+	// of the name too
+	ostringstream name;
+	name << cache_dir << '/';
+	if (build_id.size() > 2) {
+		name << build_id;
+	} else {
+		build_id.erase();
+		// the path is checked on load, a hash collision only
+		// shares an entry
+		name << "path-" << hex << op_hash_string(path.c_str()) << dec;
+	}
+	name << '-' << size << '-' << mtime << ".syms";
+	entry_path = name.str();
+}
+
+
+void symbol_cache::set_dir(string const & dir)
+{
+	cache_dir = dir;
+}
+
+
+bool symbol_cache::load(list<op_bfd_symbol> & symbols, bfd_vma & vma_adj) const
+{
+	if (entry_path.empty())
+		return false;
+
+	int fd = open(entry_path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < off_t(sizeof(entry_header))) {
+		close(fd);
+		return false;
+	}
+
+	void * entry = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (entry == MAP_FAILED)
+		return false;
+
+	bool ok = read_entry(static_cast<char const *>(entry), st.st_size,
+	                     symbols, vma_adj);
+	munmap(entry, st.st_size);
+
+	cverb << vbfd << (ok ? "using" : "ignoring") << " symbol cache entry "
+	      << entry_path << endl;
+
+	return ok;
+}
+
+
+bool symbol_cache::read_entry(char const * entry, size_t entry_size,
+                              list<op_bfd_symbol> & symbols,
+                              bfd_vma & vma_adj) const
+{
+	entry_header const * header =
+		reinterpret_cast<entry_header const *>(entry);
+
+	if (memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != SYMBOL_CACHE_VERSION)
+		return false;
+
+	size_t const syms_size = size_t(header->nr_syms) * sizeof(entry_symbol);
+	if (entry_size - sizeof(entry_header) < syms_size ||
+	    entry_size - sizeof(entry_header) - syms_size !=
+	    header->strings_size)
+		return false;
+
+	char const * strings = entry + sizeof(entry_header) + syms_size;
+	u64 const strings_size = header->strings_size;
+	if (!strings_size || strings[strings_size - 1] != '\0' ||
+	    header->image_name >= strings_size ||
+	    header->debug_name >= strings_size)
+		return false;
+
+	if (header->image_size != u64(image_size) ||
+	    header->image_mtime != u64(image_mtime))
+		return false;
+
+	// copies of a binary with a build-id can share an entry
+	if (build_id.empty() && image_path != strings + header->image_name)
+		return false;
+
+	string const debug_filename = strings + header->debug_name;
+	if (!debug_filename.empty()) {
+		struct stat st;
+		if (stat(debug_filename.c_str(), &st) ||
+		    header->debug_size != u64(st.st_size) ||
+		    header->debug_mtime != u64(st.st_mtime))
+			return false;
+	} else if (separate_debug && !build_id.empty() &&
+	           access(build_id_debug_file(build_id).c_str(), R_OK) == 0) {
+		return false;
+	}
+
+	entry_symbol const * sym = reinterpret_cast<entry_symbol const *>
+		(entry + sizeof(entry_header));
+	list<op_bfd_symbol> result;
+	for (u32 i = 0; i < header->nr_syms; ++i, ++sym) {
+		if (sym->name >= strings_size)
+			return false;
+		result.push_back(op_bfd_symbol(sym->value, sym->section_filepos,
+			sym->section_vma, sym->size, strings + sym->name,
+			sym->flags & ENTRY_SYM_HIDDEN,
+			sym->flags & ENTRY_SYM_WEAK));
+	}
+
+	symbols.swap(result);
+	vma_adj = header->vma_adj;
+	return true;
+}
+
+
+void symbol_cache::save(list<op_bfd_symbol> const & symbols, bfd_vma vma_adj,
+                        string const & debug_filename) const
+{
+	if (entry_path.empty())
+		return;
+
+	entry_header header;
+	memset(&header, '\0', sizeof(header));
+	memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof(header.magic));
+	header.version = SYMBOL_CACHE_VERSION;
+	header.nr_syms = symbols.size();
+	header.vma_adj = vma_adj;
+	header.image_size = image_size;
+	header.image_mtime = image_mtime;
+
+	if (!debug_filename.empty()) {
+		struct stat st;
+		if (stat(debug_filename.c_str(), &st))
+			return;
+		header.debug_size = st.st_size;
+		header.debug_mtime = st.st_mtime;
+	}
+
+	string_table strings;
+	header.image_name = strings.add(image_path);
+	header.debug_name = strings.add(debug_filename);
+
+	vector<entry_symbol> syms;
+	syms.reserve(symbols.size());
+	list<op_bfd_symbol>::const_iterator it;
+	for (it = symbols.begin(); it != symbols.end(); ++it) {
+		entry_symbol sym;
+		sym.value = it->value();
+		sym.section_filepos = it->filepos() - it->value();
+		sym.section_vma = it->vma() - it->value();
+		sym.size = it->size();
+		sym.name = strings.add(it->name());
+		sym.flags = (it->hidden() ? ENTRY_SYM_HIDDEN : 0) |
+			(it->weak() ? ENTRY_SYM_WEAK : 0);
+		syms.push_back(sym);
+	}
+	header.strings_size = strings.strings.size();
+
+	// write a temporary file then rename it, so that a concurrent
+	// run never maps a partial entry
+	string const tmp = entry_path + ".XXXXXX";
+	char * tmp_name = xstrdup(tmp.c_str());
+	int err = create_dir(cache_dir.c_str());
+	int fd = -1;
+	if (!err) {
+		fd = mkstemp(tmp_name);
+		if (fd < 0)
+			err = errno;
+	}
+	if (!err)
+		err = write_all(fd, &header, sizeof(header));
+	if (!err && !syms.empty())
+		err = write_all(fd, &syms[0], syms.size() * sizeof(syms[0]));
+	if (!err)
+		err = write_all(fd, &strings.strings[0],
+		                strings.strings.size());
+	if (fd >= 0 && close(fd) && !err)
+		err = errno;
+	if (!err && rename(tmp_name, entry_path.c_str()))
+		err = errno;
+	if (err && fd >= 0)
+		unlink(tmp_name);
+	free(tmp_name);
+
+	if (err)
+		cverb << vbfd << "unable to write symbol cache entry "
+		      << entry_path << ": " << strerror(err) << endl;
+	else
+		cverb << vbfd << "wrote symbol cache entry " << entry_path
+		      << endl;
+}
@@ -0,0 +1,86 @@
+/**
+ * @file symbol_cache.h
+ * On disk cache of the symbols op_bfd reads from binaries
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ *
+ * Created on: Oct 16, 2026
+ */
+
+#ifndef SYMBOL_CACHE_H
+#define SYMBOL_CACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <list>
+#include <string>
+
+#include "bfd_support.h"
+#include "utility.h"
+
+class op_bfd_symbol;
+
+/**
+ * Reading the symbol table of a large binary through BFD takes seconds.
+ * op_bfd saves the symbols it keeps from a binary, filtered and sorted
+ * but before any user symbol filter is applied, in an entry of the cache
+ * directory; the next runs map the entry and skip BFD symbol reading.
+ *
+ * An entry is named after the build-id of the binary, or after its path
+ * if it has none, and after its size and modification time: copies
+ * sharing a build-id can have different symbols. It records the separate
+ * debug file the symbols were partly read from, and isn't used anymore
+ * once that file changes, or once a debug file shows up under the
+ * build-id debug directory for a binary which had none.
+ *
+ * The cache is disabled until set_dir() is called.
+ */
+class symbol_cache : noncopyable {
+public:
+	/**
+	 * @param ibfd  the binary, opened
+	 * @param image_path  where the binary was opened from
+	 * @param size  the size of the binary
+	 * @param mtime  the modification time of the binary
+	 */
+	symbol_cache(bfd_info const & ibfd, std::string const & image_path,
+	             off_t size, time_t mtime);
+
+	/// use the cache directory dir, an empty dir disables the cache
+	static void set_dir(std::string const & dir);
+
+	/**
+	 * Read back the symbols and vma_adj of the binary. Return false
+	 * if the cache is disabled, or has no valid entry for the binary.
+	 */
+	bool load(std::list<op_bfd_symbol> & symbols, bfd_vma & vma_adj) const;
+
+	/**
+	 * Save the symbols and vma_adj of the binary, debug_filename is
+	 * the separate debug file some symbols came from, empty if none.
+	 * Failures are only reported by --verbose=bfd.
+	 */
+	void save(std::list<op_bfd_symbol> const & symbols, bfd_vma vma_adj,
+	          std::string const & debug_filename) const;
+
+private:
+	/// load() helper, check and read the mapped entry
+	bool read_entry(char const * entry, size_t entry_size,
+	                std::list<op_bfd_symbol> & symbols,
+	                bfd_vma & vma_adj) const;
+
+	std::string image_path;
+	off_t image_size;
+	time_t image_mtime;
+	/// the build-id of the binary in hexadecimal, empty if none
+	std::string build_id;
+	/// the binary has no debug information of its own, so a separate
+	/// debug file may be used
+	bool separate_debug;
+	/// the path of the entry, empty if the cache is disabled
+	std::string entry_path;
+};
+
+#endif /* !SYMBOL_CACHE_H */
@@ -0,0 +1,137 @@
+/**
+ * @file op_bfd_tests.cpp
+ * tests op_bfd symbols read back from the symbol cache
+ *
+ * @remark Copyright 2026 OProfile authors
+ * @remark Read the file COPYING
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <string>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <vector>
+
+#include "op_bfd.h"
+#include "bfd_support.h"
+#include "symbol_cache.h"
+#include "locate_images.h"
+#include "string_filter.h"
+#include "file_manip.h"
+
+using namespace std;
+
+static string image;
+
+
+static void fail(string const & what)
+{
+	cerr << "op_bfd on a stale symbol cache entry: " << what << endl;
+	exit(EXIT_FAILURE);
+}
+
+
+/// rewrite the cache entry of image with one symbol less
+static void write_stale_entry()
+{
+	struct stat st;
+	if (stat(image.c_str(), &st))
+		fail("can't stat " + image);
+
+	bfd_info info;
+	info.abfd = open_bfd(image);
+	symbol_cache cache(info, image, st.st_size, st.st_mtime);
+
+	list<op_bfd_symbol> symbols;
+	bfd_vma vma_adj;
+	if (!cache.load(symbols, vma_adj))
+		fail("no cache entry written");
+
+	list<op_bfd_symbol>::iterator it = symbols.begin();
+	advance(it, symbols.size() / 2);
+	symbols.erase(it);
+	cache.save(symbols, vma_adj, string());
+}
+
+
+static void stale_entry_tests()
+{
+	extra_images extra_found_images;
+	bool ok = true;
+	size_t nr_syms;
+
+	{
+		op_bfd abfd(image, string_filter(), extra_found_images, ok);
+		nr_syms = abfd.syms.size();
+	}
+	if (!ok || nr_syms < 3)
+		fail("can't read the symbols of " + image);
+
+	write_stale_entry();
+
+	op_bfd abfd(image, string_filter(), extra_found_images, ok);
+	vector<op_bfd_symbol> const & syms = abfd.syms;
+	if (syms.size() != nr_syms - 1)
+		fail("the entry wasn't used");
+
+	// what samples would have been attributed to
+	op_bfd_symbol const * first = &syms[0];
+	vector<string> names;
+	for (size_t i = 0; i < syms.size(); ++i)
+		names.push_back(syms[i].name());
+
+	// reads the symbol table of the binary back
+	string source;
+	unsigned int linenr;
+	abfd.get_linenr(0, syms[0].vma(), source, linenr);
+
+	if (&syms[0] != first || syms.size() != names.size())
+		fail("the symbols were replaced");
+	for (size_t i = 0; i < syms.size(); ++i) {
+		if (syms[i].name() != names[i])
+			fail("symbol " + names[i] + " changed");
+	}
+
+	op_bfd rewritten(image, string_filter(), extra_found_images, ok);
+	if (rewritten.syms.size() != nr_syms)
+		fail("the entry wasn't rewritten");
+}
+
+
+static void remove_dir(string const & dir)
+{
+	DIR * d = opendir(dir.c_str());
+	if (!d)
+		return;
+	struct dirent * dirent;
+	while ((dirent = readdir(d)) != 0) {
+		string const name = dirent->d_name;
+		if (name != "." && name != "..")
+			unlink((dir + '/' + name).c_str());
+	}
+	closedir(d);
+	rmdir(dir.c_str());
+}
+
+
+int main(int, char * argv[])
+{
+	char dir[] = "/tmp/op_bfd_tests.XXXXXX";
+	if (!mkdtemp(dir)) {
+		cerr << "can't create the symbol cache directory\n";
+		return EXIT_FAILURE;
+	}
+
+	image = op_realpath(argv[0]);
+	symbol_cache::set_dir(dir);
+	stale_entry_tests();
+	remove_dir(dir);
+
+	return EXIT_SUCCESS;
+}
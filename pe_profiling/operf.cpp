@@ -50,6 +50,8 @@
 #include "op_get_time.h"
 #include "operf_stats.h"
 #include "op_netburst.h"
+#include "op_sample_file.h"
+#include "odb.h"
 #include "utility.h"
 
 using namespace std;
@@ -132,6 +134,15 @@ string vmlinux;
 bool separate_cpu;
 bool separate_thread;
 bool post_conversion;
+int record_threads;
+int convert_threads;
+bool freeze_samples;
+bool write_behind;
+int checkpoint_interval;
+int ring_size;
+int flight_recorder;
+int sample_rate;
+int sample_file_growth;
 set<string> evts;
 }
 
@@ -151,13 +162,21 @@ struct option long_options [] =
  {"separate-cpu", no_argument, NULL, 'c'},
  {"separate-thread", no_argument, NULL, 't'},
  {"lazy-conversion", no_argument, NULL, 'l'},
+ {"record-threads", required_argument, NULL, 'r'},
+ {"convert-threads", required_argument, NULL, 'T'},
+ {"freeze-samples", no_argument, NULL, 'F'},
+ {"write-behind", required_argument, NULL, 'W'},
+ {"ring-size", required_argument, NULL, 'R'},
+ {"flight-recorder", required_argument, NULL, 'f'},
+ {"sample-rate", required_argument, NULL, 'S'},
+ {"sample-file-growth", required_argument, NULL, 'G'},
  {"help", no_argument, NULL, 'h'},
  {"version", no_argument, NULL, 'v'},
  {"usage", no_argument, NULL, 'u'},
  {NULL, 9, NULL, 0}
 };
 
-const char * short_options = "V:d:k:gsap:e:ctlhuv";
+const char * short_options = "V:d:k:gsap:e:ctlr:T:FW:R:f:S:G:huv";
 
 vector<string> verbose_string;
 
@@ -227,6 +246,12 @@ void _set_basic_SIGINT_handler_for_child(void)
 	}
 }
 
+// Pass the request for a flight recorder snapshot on to operf-record.
+static void op_sig_snapshot(int val __attribute__((unused)))
+{
+	kill(operf_record_pid, SIGUSR2);
+}
+
 void set_signals_for_parent(void)
 {
 	struct sigaction act;
@@ -244,6 +269,20 @@ void set_signals_for_parent(void)
 		perror("operf: install of SIGINT handler failed: ");
 		exit(EXIT_FAILURE);
 	}
+
+	if (operf_options::flight_recorder) {
+		act.sa_handler = op_sig_snapshot;
+		// Don't let the snapshot request interrupt our waitpid.
+		act.sa_flags = SA_RESTART;
+		sigemptyset(&act.sa_mask);
+		if (sigaction(SIGUSR2, &act, NULL)) {
+			perror("operf: install of SIGUSR2 handler failed: ");
+			exit(EXIT_FAILURE);
+		}
+		cout << "operf: Keeping the last " << operf_options::flight_recorder
+		     << " seconds of samples. Use 'kill -SIGUSR2 " << getpid()
+		     << "' to save them." << endl;
+	}
 }
 
 static string args_to_string(void)
@@ -866,6 +905,33 @@ static int __delete_old_previous_sample_data(const char *fpath,
 	}
 }
 
+static int __freeze_sample_file(const char *fpath,
+                                const struct stat *sb  __attribute__((unused)),
+                                int tflag,
+                                struct FTW *ftwbuf __attribute__((unused)))
+{
+	struct opd_header header;
+	int fd, rc;
+	bool is_sample_file;
+
+	if (tflag != FTW_F)
+		return 0;
+
+	// The session dir also holds the stats and the JIT ELF files.
+	if ((fd = open(fpath, O_RDONLY)) < 0)
+		return 0;
+	is_sample_file = read(fd, &header, sizeof(header)) == sizeof(header) &&
+	                 !memcmp(header.magic, OPD_MAGIC, sizeof(header.magic));
+	close(fd);
+	if (!is_sample_file || odb_is_frozen(fpath, sizeof(header)))
+		return 0;
+
+	if ((rc = odb_freeze(fpath, sizeof(header))))
+		cerr << "Unable to freeze sample file " << fpath << ": "
+		     << strerror(rc) << endl;
+	return 0;
+}
+
 /* Read perf_events sample data written by the operf-record process through
  * the sample_data_pipe or file (dependent on 'lazy-conversion' option)
  * and convert the perf format sample data to to oprofile format sample files.
@@ -961,6 +1027,10 @@ static void convert_sample_data(void)
 	while (jit_conversion_running) {
 		sleep(1);
 	}
+	if (operf_options::freeze_samples) {
+		cverb << vdebug << "Freezing sample files in " << current_sampledir << endl;
+		nftw(current_sampledir.c_str(), __freeze_sample_file, 32, FTW_PHYS);
+	}
 out:
 	if (!operf_options::post_conversion)
 		_exit(rc);
@@ -1335,6 +1405,63 @@ static int _process_operf_and_app_args(int argc, char * const argv[])
 		case 'l':
 			operf_options::post_conversion = true;
 			break;
+		case 'r':
+			operf_options::record_threads = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --record-threads option.");
+			if (operf_options::record_threads < 0)
+				__print_usage_and_exit("operf: --record-threads value must not be negative.");
+			break;
+		case 'T':
+			operf_options::convert_threads = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --convert-threads option.");
+			if (operf_options::convert_threads < 0)
+				__print_usage_and_exit("operf: --convert-threads value must not be negative.");
+			break;
+		case 'F':
+			operf_options::freeze_samples = true;
+			break;
+		case 'W':
+			operf_options::write_behind = true;
+			operf_options::checkpoint_interval = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --write-behind option.");
+			if (operf_options::checkpoint_interval < 0)
+				__print_usage_and_exit("operf: --write-behind value must not be negative.");
+			break;
+		case 'R':
+			operf_options::ring_size = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --ring-size option.");
+			if (operf_options::ring_size < 0)
+				__print_usage_and_exit("operf: --ring-size value must not be negative.");
+			break;
+		case 'f':
+			operf_options::flight_recorder = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --flight-recorder option.");
+			if (operf_options::flight_recorder <= 0)
+				__print_usage_and_exit("operf: --flight-recorder value must be positive.");
+			// Snapshots are written to the operf data file, converted at the end.
+			operf_options::post_conversion = true;
+			break;
+		case 'S':
+			operf_options::sample_rate = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --sample-rate option.");
+			if (operf_options::sample_rate <= 0)
+				__print_usage_and_exit("operf: --sample-rate value must be positive.");
+			break;
+		case 'G':
+			operf_options::sample_file_growth = strtol(optarg, &endptr, 10);
+			if ((endptr >= optarg) && (endptr <= (optarg + strlen(optarg) - 1)))
+				__print_usage_and_exit("operf: Invalid numeric value for --sample-file-growth option.");
+			if (operf_options::sample_file_growth < 2 ||
+			    operf_options::sample_file_growth > 256 ||
+			    (operf_options::sample_file_growth & (operf_options::sample_file_growth - 1)))
+				__print_usage_and_exit("operf: --sample-file-growth value must be a power of 2 from 2 to 256.");
+			break;
 		case 'h':
 			__print_usage_and_exit(NULL);
 			break;
@@ -1361,6 +1488,11 @@ static void process_args(int argc, char * const argv[])
 {
 	int non_options_idx  = _process_operf_and_app_args(argc, argv);
 
+	if (operf_options::flight_recorder && operf_options::record_threads > 1)
+		__print_usage_and_exit("operf: --flight-recorder can't be used with --record-threads.");
+	// before any sample file is opened, by this process or its children
+	if (operf_options::sample_file_growth)
+		odb_set_growth_factor(operf_options::sample_file_growth);
 	if (non_options_idx < 0) {
 		__print_usage_and_exit(NULL);
 	} else if ((non_options_idx) > 0) {
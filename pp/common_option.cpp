@@ -23,6 +23,7 @@
 #include "cverb.h"
 #include "common_option.h"
 #include "file_manip.h"
+#include "symbol_cache.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -38,6 +39,7 @@ namespace options {
 	string command_options;
 	vector<string> image_path;
 	string root_path;
+	string symbol_cache_dir;
 }
 
 namespace {
@@ -55,6 +57,8 @@ popt::option common_options_array[] = {
 		     "comma-separated path to search missing binaries", "path"),
 	popt::option(options::root_path, "root", 'R',
 		     "path to filesystem to search for missing binaries", "path"),
+	popt::option(options::symbol_cache_dir, "symbol-cache", '\0',
+		     "directory caching the symbols read from binaries", "path"),
 };
 
 int session_dir_supplied;
@@ -195,6 +199,8 @@ options::spec get_options(int argc, char const * argv[])
 	}
 	init_op_config_dirs(options::session_dir.c_str());
 
+	symbol_cache::set_dir(options::symbol_cache_dir);
+
 	if (!options::threshold_opt.empty())
 		options::threshold = handle_threshold(options::threshold_opt);
 
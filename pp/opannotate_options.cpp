@@ -41,6 +41,7 @@ namespace options {
 	bool assembly;
 	vector<string> objdump_params;
 	bool exclude_dependent;
+	int jobs = 1;
 }
 
 
@@ -82,6 +83,9 @@ popt::option options_array[] = {
 	popt::option(options::threshold_opt, "threshold", 't',
 		     "minimum percentage needed to produce output",
 		     "percent"),
+	popt::option(options::jobs, "jobs", 'j',
+		     "number of threads loading the binary images (default 1)",
+		     "num"),
 };
 
 }  // anonymous namespace
@@ -128,6 +132,11 @@ void handle_options(options::spec const & spec)
 		exit(EXIT_FAILURE);
 	}
 
+	if (jobs < 1) {
+		cerr << "illegal --jobs value: " << jobs << endl;
+		exit(EXIT_FAILURE);
+	}
+
 	if (search_dirs.empty() && !base_dirs.empty()) {
 		cerr << "--base-dirs is useless unless you specify an "
 			"alternative source location with --search-dirs"
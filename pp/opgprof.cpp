@@ -257,6 +257,7 @@ void load_cg(profile_t & cg_db, list<profile_sample_files> const & files)
 {
 	list<profile_sample_files>::const_iterator it = files.begin();
 	list<profile_sample_files>::const_iterator const end = files.end();
+	list<string> cg_files;
 
 	/* the list of non cg files is a super set of the list of cg file
 	 * (module always log a samples to non-cg files before logging
@@ -272,9 +273,11 @@ void load_cg(profile_t & cg_db, list<profile_sample_files> const & files)
 			 * data in from/to eip. */
 			cverb << vsfile << "loading cg samples file : " 
 			      << *cit << endl;
-			cg_db.add_sample_file(*cit);
+			cg_files.push_back(*cit);
 		}
 	}
+
+	cg_db.add_sample_files(cg_files);
 }
 
 
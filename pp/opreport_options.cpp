@@ -50,6 +50,7 @@ namespace options {
 	bool global_percent;
 	bool xml;
 	string xml_options;
+	int jobs = 1;
 }
 
 
@@ -109,6 +110,9 @@ popt::option options_array[] = {
 
 	popt::option(options::xml, "xml", 'X',
 		     "XML output"),
+	popt::option(options::jobs, "jobs", 'j',
+		     "number of threads loading the binary images (default 1)",
+		     "num"),
 
 };
 
@@ -315,6 +319,11 @@ void handle_options(options::spec const & spec)
 	merge_by = handle_merge_option(mergespec, true, exclude_dependent);
 	handle_output_file();
 	demangle = handle_demangle_option(demangle_option);
+
+	if (jobs < 1) {
+		cerr << "illegal --jobs value: " << jobs << endl;
+		exit(EXIT_FAILURE);
+	}
 	check_options(spec.first.size());
 
 	symbol_filter = string_filter(include_symbols, exclude_symbols);